@@ -10,6 +10,7 @@
 #include "SDL/SDL_image.h"
 
 #include <string>
+#include <string.h>
 #include <fstream>
 #include <math.h>
 #include <stdio.h>
@@ -17,7 +18,26 @@
 #include <time.h>
 
 #include <vector>
+#include <map>
 #include <cmath>
+#include <algorithm>
+#include <functional>
+
+// High resolution timer for profiling
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 
 /******************* MAIN VARIABLES ********************************/
@@ -37,7 +57,13 @@ const int LEVEL_HEIGHT = 14990;
 //Tile variables
 const int TILE_WIDTH = 510;
 const int TILE_HEIGHT = 357;
-const int TOTAL_TILES = 1260;
+const int TILE_COLUMNS = (LEVEL_WIDTH + TILE_WIDTH - 1) / TILE_WIDTH;
+const int TILE_ROWS = (LEVEL_HEIGHT + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+//Spatial grid variables (used for area queries over the level)
+const int GRID_CELL = 1000;
+const int GRID_COLUMNS = LEVEL_WIDTH / GRID_CELL + 1;
+const int GRID_ROWS = LEVEL_HEIGHT / GRID_CELL + 1;
 
 // Gameplay variables
 const int MAX_PLAYERS = 10;
@@ -53,47 +79,69 @@ const int LIGHT2 = 3;
 const int HEAVY2 = 4;
 const int MOTHER2 = 5;
 
+// Player input flags (one byte per tick is all a lockstep peer sends)
+const Uint8 INPUT_UP = 1;
+const Uint8 INPUT_LEFT = 2;
+const Uint8 INPUT_RIGHT = 4;
+const Uint8 INPUT_DOWN = 8;
+const Uint8 INPUT_FIRE = 16;
+const Uint8 INPUT_LIGHT = 32; // Respawn as light ship
+const Uint8 INPUT_HEAVY = 64; // Respawn as heavy ship
+
+// Drift is kept in tenths of a pixel so movement stays in integers
+const int DRIFT_SCALE = 10;
+
+// Number of directions ships and pods can face, 0 = up, turning clockwise one heading per turn.
+// Any of 16, 32 or 64; headings between the hand-drawn ones are turned from them when they load. Peers must agree on it.
+const int HEADINGS = 16;
+// Headings with a hand-drawn image (1.gif to 16.gif) for each ship state and the pod
+const int DRAWN_HEADINGS = 16;
+
 // AI Personalities
 const int SCOUT = 0;
 const int GUARDIAN = 1;
 const int HUNTER = 2;
 const int MOTHERSHIP = 3;
 
-//The surfaces that will be used
-SDL_Surface *menu[4]; // Menu Textures
-SDL_Surface *ships[8][16][2]; //A array storing the images of the ships in [type][angle][moving] order.
-SDL_Surface *planetTex[4]; // Planet Textures
+// Handle of a texture in the asset registry
+typedef int Texture;
+const Texture NO_TEXTURE = -1;
+// A frame of a sprite set, drawn from the set's atlas when it has one
+struct Sprite
+{
+	int set, frame;
+};
+
+//The textures that will be used
+Texture menu[4]; // Menu Textures
+Sprite ships[8][HEADINGS][2]; //A array storing the frames of the ships in [type][angle][moving] order.
+Texture planetTex[4]; // Planet Textures
 SDL_Surface *screen = NULL; // Screen representation
-SDL_Surface *tileSheet = NULL; // Tile sheet
-SDL_Surface *laser = NULL; // Laser texture
-SDL_Surface *shieldTexture[8]; // Sheild textures
-SDL_Surface *explosion[6][11]; // Explosion textures
-SDL_Surface *displaybar[2]; // Display
-SDL_Surface *healthbar[8]; // healthbar textures
-SDL_Surface *shieldbar = NULL; // shieldbar texture
-SDL_Surface *radar_screen[2]; // Radar texture
-SDL_Surface *radar_dot[8]; // Radar dot texture
-SDL_Surface *planet_owner[2]; // Planet owner textures
-SDL_Surface *pod[16]; // Pod textures
-SDL_Surface *shooting_star = NULL; // Shooting star texture
-SDL_Surface *button[9][2]; // Button Textures (menu)
+int screen_bpp = SCREEN_BPP; // Bits per pixel of the screen and the textures (-bpp 16 for RGB565)
+int screen_width = SCREEN_WIDTH, screen_height = SCREEN_HEIGHT; // Size of the screen (-size <width> <height>)
+Texture tileSheet = NO_TEXTURE; // Tile sheet
+Texture laser = NO_TEXTURE; // Laser texture
+Texture shieldTexture[8]; // Sheild textures
+Sprite explosion[6][11]; // Explosion frames
+Texture displaybar[2]; // Display
+Texture healthbar[8]; // healthbar textures
+Texture shieldbar = NO_TEXTURE; // shieldbar texture
+Texture radar_screen[2]; // Radar texture
+Texture radar_dot[8]; // Radar dot texture
+Texture planet_owner[2]; // Planet owner textures
+Sprite pod[HEADINGS]; // Pod frames
+Texture shooting_star = NO_TEXTURE; // Shooting star texture
+Texture button[9][2]; // Button Textures (menu)
 
 //Event structure
 SDL_Event event; 
 
-// Variables relating to the ships playing
-int this_mothership; // Position in array of user's team's mothership
-int enemy_mothership; // Position in array of enemy mothership 
-int red_mother, blue_mother;
-SDL_Rect mothership[2]; // Coords of both motherships (0 = friendly, 1 = enemy)
-
 // Menu variables
-bool paused = true;
 int menu_position = 0; 
 int active_button = 0;
 int player_type = 0;
 
-//Camera respresentation
+//Camera respresentation (the view of the match being drawn)
 SDL_Rect camera = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
 
 /********************************* CIRCLE STRUCTURE ***********************************/
@@ -103,22 +151,152 @@ struct Circle
     int x, y; // X and Y location on map
     int r; // Radius
 };
-// Distance between two points
-double distance( int x1, int y1, int x2, int y2 )
-{
-    return sqrt( pow( (double)x2 - (double)x1, 2 ) + pow( (double)y2 - (double)y1, 2 ) );
-}
 // Check collision between two circles
 bool check_collision( Circle &A, Circle &B )
 {
     //If the distance between the circles is less than the sum of their radii
-    if( distance( A.x, A.y, B.x, B.y ) < ( A.r + B.r ) )
+	//(compared squared so the result is exact on every machine)
+	int x = B.x - A.x;
+	int y = B.y - A.y;
+	int r = A.r + B.r;
+    if( x*x + y*y < r*r )
     {
         //The circles have collided
         return true;
     }
     return false;    
 }
+// Check whether a point moving in a straight line from (x1, y1) to (x2, y2) passes inside a circle
+bool check_sweep( int x1, int y1, int x2, int y2, Circle &A )
+{
+	// Measured in 64 bits with no division, so the result is exact on every machine
+	Sint64 dx = x2 - x1;
+	Sint64 dy = y2 - y1;
+	Sint64 px = A.x - x1;
+	Sint64 py = A.y - y1;
+	Sint64 r2 = (Sint64)A.r * A.r;
+	Sint64 along = px * dx + py * dy;
+	Sint64 length2 = dx * dx + dy * dy;
+	// The closest point is the start or the end of the line, or somewhere between
+	if (along <= 0) return px * px + py * py < r2;
+	if (along >= length2)
+	{
+		Sint64 ex = A.x - x2;
+		Sint64 ey = A.y - y2;
+		return ex * ex + ey * ey < r2;
+	}
+	return (px * px + py * py) * length2 - along * along < r2 * length2;
+}
+/********************************* RANDOM NUMBERS ***********************************/
+/*
+ Seeded random number generator. Every peer that starts from the same seed
+ gets the same sequence, unlike the global rand().
+*/
+class Random
+{
+	private:
+	Uint32 state;
+	
+	public:
+	Random();
+	void seed(Uint32 s);
+	// Returns a number from 0 to n-1
+	int next(int n);
+};
+
+Random::Random()
+{
+	seed(1);
+}
+void Random::seed(Uint32 s)
+{
+	// Xorshift can't start from zero
+	if (s == 0) s = 0x9E3779B9;
+	state = s;
+}
+int Random::next(int n)
+{
+	if (n <= 0) return 0;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return (int)(state % (Uint32)n);
+}
+
+// Generator for effects that are not part of the simulation
+Random effects_rng;
+
+/********************************* WORLD STRUCTURE ***********************************/
+// State shared by everything in one match. Each room has its own.
+class Projectile_Pool;
+
+struct World
+{
+	int player_count; // Number of ships in play
+	int this_mothership; // Position in array of user's team's mothership
+	int enemy_mothership; // Position in array of enemy mothership 
+	int red_mother, blue_mother;
+	SDL_Rect mothership[2]; // Coords of both motherships (0 = friendly, 1 = enemy)
+	SDL_Rect camera; // View of the match's player
+	bool paused;
+	Random rng; // Generator used by the simulation
+	Projectile_Pool *projectiles; // Every shot in flight
+};
+
+/********************************* HEADINGS ***********************************/
+// Sine (x1024) of 64 evenly spaced angles. Fixed integers so every machine moves ships identically.
+const int SINE_64[64] = { 0, 100, 200, 297, 392, 483, 569, 650, 724, 792, 851, 903, 946, 980, 1004, 1019, 1024, 1019, 1004, 980, 946, 903, 851, 792, 724, 650, 569, 483, 392, 297, 200, 100, 0, -100, -200, -297, -392, -483, -569, -650, -724, -792, -851, -903, -946, -980, -1004, -1019, -1024, -1019, -1004, -980, -946, -903, -851, -792, -724, -650, -569, -483, -392, -297, -200, -100 };
+
+// Unit vector (x1024) of a heading
+inline int heading_x( int h )
+{
+	return SINE_64[h * (64 / HEADINGS)];
+}
+inline int heading_y( int h )
+{
+	return -SINE_64[(h * (64 / HEADINGS) + 16) % 64];
+}
+
+// Returns the heading (0 to HEADINGS-1) that points from one location towards the other
+int heading_between( int x1, int y1, int x2, int y2 )
+{
+	int x = x2 - x1;
+	int y = y2 - y1;
+	// The target is in sector h if it is clockwise of heading h but not of heading h+1
+	for (int h = 0; h < HEADINGS; h++)
+	{
+		int next = (h + 1) % HEADINGS;
+		if (heading_x(h) * y - heading_y(h) * x >= 0 && heading_x(next) * y - heading_y(next) * x < 0) return h;
+	}
+	return 0;
+}
+
+// Folds a value into an FNV-1a hash (used to compare world states between peers)
+Uint32 hash_int( Uint32 h, int value )
+{
+	for (int i = 0; i < 4; i++)
+	{
+		h ^= (Uint32)(value >> (i * 8)) & 0xFF;
+		h *= 16777619;
+	}
+	return h;
+}
+
+// Moves a value towards zero by step without passing it
+int approach_zero( int value, int step )
+{
+	if (value > step) return value - step;
+	if (value < -step) return value + step;
+	return 0;
+}
+
+// Distance between the centres of two circles
+int get_distance(Circle a, Circle b)
+{
+	int x = b.x - a.x;
+	int y = b.y - a.y;
+    return (int) sqrt((double)(x*x + y*y));
+}
 bool collision( SDL_Rect &A, SDL_Rect &B )
 {
     //The sides of the rectangles
@@ -164,1534 +342,5717 @@ bool collision( SDL_Rect &A, SDL_Rect &B )
     return true;
 }
 
-void apply_surface( int x, int y, SDL_Surface* source, SDL_Surface* destination)
+/********************************************* SPRITE BLITTER ***************************************/
+/*
+ Draws sprites without going through SDL when the sprite and the target are
+ both 32 bits per pixel in the same format, or both RGB565 with -bpp 16, which
+ is every texture the game converts. Pixels matching the colour key are
+ skipped and surface alpha is blended as SDL does it, d + (s - d) * a / 256.
+ With AVX2 eight 32-bit pixels are done at a time and written with a masked
+ store, or sixteen RGB565 pixels; with SSE2 four, or eight RGB565 pixels,
+ merging the kept target pixels back in before storing. Anything else (other formats, RLE encoded surfaces,
+ per pixel alpha) is left to SDL_BlitSurface.
+*/
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BLIT_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BLIT_SSE2
+#endif
+
+// Draws one row of n pixels. Pixels whose colour equals key are skipped if keyed is set;
+// alpha below 255 blends the rest with what is under them.
+void blit_row( Uint32 *to, const Uint32 *from, int n, bool keyed, Uint32 key, Uint32 rgb, int alpha )
+{
+	if (!keyed && alpha == 255)
+	{
+		memcpy(to, from, n * 4);
+		return;
+	}
+	int i = 0;
+#ifdef BLIT_AVX2
+	__m256i key8 = _mm256_set1_epi32((int)key);
+	__m256i rgb8 = _mm256_set1_epi32((int)rgb);
+	__m256i ones8 = _mm256_set1_epi32(-1);
+	__m256i zero8 = _mm256_setzero_si256();
+	__m256i a8 = _mm256_set1_epi16((short)alpha);
+	__m256i b8 = _mm256_set1_epi16((short)(256 - alpha));
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(from + i));
+		if (alpha != 255)
+		{
+			__m256i d = _mm256_loadu_si256((const __m256i*)(to + i));
+			__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero8), a8), _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero8), b8));
+			__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero8), a8), _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero8), b8));
+			__m256i blended = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+			if (!keyed)
+			{
+				_mm256_storeu_si256((__m256i*)(to + i), blended);
+				continue;
+			}
+			// Keyed pixels are tested on the source, not the blend
+			__m256i keep = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_and_si256(s, rgb8), key8), ones8);
+			_mm256_maskstore_epi32((int*)(to + i), keep, blended);
+			continue;
+		}
+		__m256i keep = _mm256_xor_si256(_mm256_cmpeq_epi32(_mm256_and_si256(s, rgb8), key8), ones8);
+		_mm256_maskstore_epi32((int*)(to + i), keep, s);
+	}
+#elif defined(BLIT_SSE2)
+	__m128i key4 = _mm_set1_epi32((int)key);
+	__m128i rgb4 = _mm_set1_epi32((int)rgb);
+	__m128i zero4 = _mm_setzero_si128();
+	__m128i a4 = _mm_set1_epi16((short)alpha);
+	__m128i b4 = _mm_set1_epi16((short)(256 - alpha));
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(from + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(to + i));
+		__m128i out = s;
+		if (alpha != 255)
+		{
+			__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(s, zero4), a4), _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero4), b4));
+			__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(s, zero4), a4), _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero4), b4));
+			out = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+		}
+		if (keyed)
+		{
+			// Where the source is the key, put back what was there
+			__m128i skip = _mm_cmpeq_epi32(_mm_and_si128(s, rgb4), key4);
+			out = _mm_or_si128(_mm_and_si128(skip, d), _mm_andnot_si128(skip, out));
+		}
+		_mm_storeu_si128((__m128i*)(to + i), out);
+	}
+#endif
+	for (; i < n; i++)
+	{
+		Uint32 s = from[i];
+		if (keyed && (s & rgb) == key) continue;
+		if (alpha == 255)
+		{
+			to[i] = s;
+			continue;
+		}
+		Uint32 d = to[i];
+		Uint32 out = 0;
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			Uint32 sc = (s >> shift) & 0xFF;
+			Uint32 dc = (d >> shift) & 0xFF;
+			out |= ((sc * alpha + dc * (256 - alpha)) >> 8) << shift;
+		}
+		to[i] = out;
+	}
+}
+
+// RGB565 version of blit_row. Every bit is colour, so the key is compared with the whole pixel.
+#if defined(BLIT_AVX2)
+// Blends one channel of sixteen pixels, each in the low bits of its 16-bit lane
+inline __m256i blend_channel( __m256i s, __m256i d, __m256i a, __m256i b )
+{
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, b)), 8);
+}
+#elif defined(BLIT_SSE2)
+// Blends one channel of eight pixels, each in the low bits of its 16-bit lane
+inline __m128i blend_channel( __m128i s, __m128i d, __m128i a, __m128i b )
+{
+	return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, b)), 8);
+}
+#endif
+void blit_row16( Uint16 *to, const Uint16 *from, int n, bool keyed, Uint16 key, int alpha )
+{
+	if (!keyed && alpha == 255)
+	{
+		memcpy(to, from, n * 2);
+		return;
+	}
+	int i = 0;
+#if defined(BLIT_AVX2)
+	__m256i key16 = _mm256_set1_epi16((short)key);
+	__m256i a16 = _mm256_set1_epi16((short)alpha);
+	__m256i b16 = _mm256_set1_epi16((short)(256 - alpha));
+	__m256i green = _mm256_set1_epi16(0x3F);
+	__m256i blue = _mm256_set1_epi16(0x1F);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)(from + i));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(to + i));
+		__m256i out = s;
+		if (alpha != 255)
+		{
+			__m256i r = blend_channel(_mm256_srli_epi16(s, 11), _mm256_srli_epi16(d, 11), a16, b16);
+			__m256i g = blend_channel(_mm256_and_si256(_mm256_srli_epi16(s, 5), green), _mm256_and_si256(_mm256_srli_epi16(d, 5), green), a16, b16);
+			__m256i b = blend_channel(_mm256_and_si256(s, blue), _mm256_and_si256(d, blue), a16, b16);
+			out = _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi16(r, 11), _mm256_slli_epi16(g, 5)), b);
+		}
+		// There is no masked store for 16-bit lanes, so the kept target pixels are merged back in
+		if (keyed) out = _mm256_blendv_epi8(out, d, _mm256_cmpeq_epi16(s, key16));
+		_mm256_storeu_si256((__m256i*)(to + i), out);
+	}
+#elif defined(BLIT_SSE2)
+	__m128i key8 = _mm_set1_epi16((short)key);
+	__m128i a8 = _mm_set1_epi16((short)alpha);
+	__m128i b8 = _mm_set1_epi16((short)(256 - alpha));
+	__m128i green = _mm_set1_epi16(0x3F);
+	__m128i blue = _mm_set1_epi16(0x1F);
+	for (; i + 8 <= n; i += 8)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)(from + i));
+		__m128i d = _mm_loadu_si128((const __m128i*)(to + i));
+		__m128i out = s;
+		if (alpha != 255)
+		{
+			__m128i r = blend_channel(_mm_srli_epi16(s, 11), _mm_srli_epi16(d, 11), a8, b8);
+			__m128i g = blend_channel(_mm_and_si128(_mm_srli_epi16(s, 5), green), _mm_and_si128(_mm_srli_epi16(d, 5), green), a8, b8);
+			__m128i b = blend_channel(_mm_and_si128(s, blue), _mm_and_si128(d, blue), a8, b8);
+			out = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(r, 11), _mm_slli_epi16(g, 5)), b);
+		}
+		if (keyed)
+		{
+			__m128i skip = _mm_cmpeq_epi16(s, key8);
+			out = _mm_or_si128(_mm_and_si128(skip, d), _mm_andnot_si128(skip, out));
+		}
+		_mm_storeu_si128((__m128i*)(to + i), out);
+	}
+#endif
+	for (; i < n; i++)
+	{
+		Uint16 s = from[i];
+		if (keyed && s == key) continue;
+		if (alpha == 255)
+		{
+			to[i] = s;
+			continue;
+		}
+		Uint16 d = to[i];
+		Uint32 r = ((s >> 11) * alpha + (d >> 11) * (256 - alpha)) >> 8;
+		Uint32 g = (((s >> 5) & 0x3F) * alpha + ((d >> 5) & 0x3F) * (256 - alpha)) >> 8;
+		Uint32 b = ((s & 0x1F) * alpha + (d & 0x1F) * (256 - alpha)) >> 8;
+		to[i] = (Uint16)((r << 11) | (g << 5) | b);
+	}
+}
+
+// Whether the sprite blitter can draw the source onto the target
+bool sprite_blittable( SDL_Surface *source, SDL_Surface *target )
+{
+	SDL_PixelFormat *from = source->format;
+	SDL_PixelFormat *to = target->format;
+	if (from->BytesPerPixel != to->BytesPerPixel) return false;
+	if (from->BytesPerPixel == 2)
+	{
+		if (from->Rmask != 0xF800 || from->Gmask != 0x07E0 || from->Bmask != 0x001F) return false;
+	}
+	else if (from->BytesPerPixel != 4) return false;
+	if (from->Rmask != to->Rmask || from->Gmask != to->Gmask || from->Bmask != to->Bmask) return false;
+	if ((source->flags & SDL_RLEACCEL) || (target->flags & SDL_RLEACCEL)) return false;
+	// Per pixel alpha is left to SDL
+	return from->Amask == 0 || !(source->flags & SDL_SRCALPHA);
+}
+
+// Draws part of a sprite (all of it if clip is NULL) with its top left corner at x, y, clipped
+// like SDL_BlitSurface. Alpha is the surface's unless one (255 for opaque) is given.
+// Nothing about the source is changed, so sprites can be drawn from several threads at once.
+// Returns false without drawing if the surfaces have to be left to SDL.
+bool blit_sprite( SDL_Surface *source, SDL_Rect *clip, SDL_Surface *target, int x, int y, int alpha = -1 )
+{
+	if (!sprite_blittable(source, target)) return false;
+	SDL_PixelFormat *from = source->format;
+	bool keyed = (source->flags & SDL_SRCCOLORKEY) != 0;
+	if (alpha < 0) alpha = (source->flags & SDL_SRCALPHA) ? from->alpha : 255;
+
+	// The part of the source asked for, inside the source
+	int sx = 0, sy = 0, w = source->w, h = source->h;
+	if (clip != NULL)
+	{
+		sx = clip->x;
+		sy = clip->y;
+		w = clip->w;
+		h = clip->h;
+	}
+	if (sx < 0)
+	{
+		w += sx;
+		x -= sx;
+		sx = 0;
+	}
+	if (sy < 0)
+	{
+		h += sy;
+		y -= sy;
+		sy = 0;
+	}
+	w = std::min(w, source->w - sx);
+	h = std::min(h, source->h - sy);
+	// Then inside the target's clip rectangle
+	SDL_Rect &bounds = target->clip_rect;
+	if (x < bounds.x)
+	{
+		w -= bounds.x - x;
+		sx += bounds.x - x;
+		x = bounds.x;
+	}
+	if (y < bounds.y)
+	{
+		h -= bounds.y - y;
+		sy += bounds.y - y;
+		y = bounds.y;
+	}
+	w = std::min(w, bounds.x + bounds.w - x);
+	h = std::min(h, bounds.y + bounds.h - y);
+	if (w <= 0 || h <= 0) return true;
+
+	Uint32 rgb = from->Rmask | from->Gmask | from->Bmask;
+	Uint32 key = from->colorkey & rgb;
+	if (SDL_MUSTLOCK(target)) SDL_LockSurface(target);
+	for (int row = 0; row < h; row++)
+	{
+		Uint8 *out = (Uint8*)target->pixels + (y + row) * target->pitch;
+		const Uint8 *in = (const Uint8*)source->pixels + (sy + row) * source->pitch;
+		if (from->BytesPerPixel == 2) blit_row16((Uint16*)out + x, (const Uint16*)in + sx, w, keyed, (Uint16)key, alpha);
+		else blit_row((Uint32*)out + x, (const Uint32*)in + sx, w, keyed, key, rgb, alpha);
+	}
+	if (SDL_MUSTLOCK(target)) SDL_UnlockSurface(target);
+	return true;
+}
+
+void apply_surface( int x, int y, SDL_Surface* source, SDL_Surface* destination, SDL_Rect* clip = NULL )
 {
     //Make a temporary rectangle to hold the offsets
     SDL_Rect Offset;
-    SDL_Rect* clip = NULL;
     
     //Give the offsets to the rectangle
     Offset.x = x;
     Offset.y = y;
     
-    //Blit surface
-    SDL_BlitSurface( source, clip, destination, &Offset );
+    //Blit surface, with the sprite blitter if it can take it
+    if( !blit_sprite( source, clip, destination, x, y ) ) SDL_BlitSurface( source, clip, destination, &Offset );
 }
 
-/************************************ TILE CLASS ****************************************/
-class Tile
-{
-    private:
-	//The image attached to the tile
-    SDL_Surface *image;
-    //Tile dimensions and location
-    SDL_Rect box;
-    
-    public:
-    Tile( int x, int y, SDL_Surface *img );
-    //Show the tile
-    void show( SDL_Surface *screen );
-    //Return box
-    SDL_Rect &get_box();
-};
-Tile::Tile( int x, int y, SDL_Surface *img )
+// Returns the pixel at x, y of a locked surface
+Uint32 get_pixel( SDL_Surface *surface, int x, int y )
 {
-    //Get the offsets
-    box.x = x;
-    box.y = y;
-
-    //Get the image
-	image = img;
-    
-    //Set the collision box
-    box.w = img->w;
-    box.h = img->h;
+	Uint8 *p = (Uint8*)surface->pixels + y * surface->pitch + x * surface->format->BytesPerPixel;
+	switch (surface->format->BytesPerPixel)
+	{
+		case 1: return *p;
+		case 2: return *(Uint16*)p;
+		case 3: return p[0] | (p[1] << 8) | (p[2] << 16);
+		default: return *(Uint32*)p;
+	}
 }
 
-void Tile::show( SDL_Surface *screen )
+// High resolution clock in milliseconds (defined with the timer)
+double precise_ticks();
+
+/******************************************** RENDER QUEUE CLASS ****************************************/
+/*
+ Draw commands for one frame. Everything drawn on screen is added here instead
+ of being blitted straight away. At the end of the frame the commands are culled
+ against the screen, sorted by layer and executed in one pass, timing each layer.
+ Within a world layer commands are grouped by source surface, as nothing in
+ those layers depends on being drawn before its neighbours. Screen layers (the
+ HUD, radar frame and menus) keep the order they were added in.
+ With -bands the frame can be split into horizontal bands drawn at the same
+ time, each by its own thread running every command clipped to its band, so
+ the result is the same as drawing it in one pass. That needs every blit to go
+ through the sprite blitter, since SDL changes a source surface's state when
+ it blits it; frames with anything else are drawn in one pass.
+ In a window only what changed is presented. Each blit's place on screen is
+ compared with the frame before: blits that appeared, went away, changed
+ order or whose source was redrawn mark their rectangles dirty, and only those
+ are sent with SDL_UpdateRects. Passes, and frames where most of the screen
+ changed (any scroll of the background), are presented with a full flip.
+ The background is a backdrop drawn under everything. While it stays the same
+ surface and isn't redrawn, the screen still holds it from the last frame, so
+ it is only put back where the last frame drew over it.
+*/
+const int LAYER_BACKGROUND = 0;
+const int LAYER_STARS = 1;
+const int LAYER_PLANETS = 2;
+const int LAYER_PROJECTILES = 3;
+const int LAYER_PODS = 4;
+const int LAYER_MOTHERSHIPS = 5;
+const int LAYER_SHIPS = 6;
+const int LAYER_EFFECTS = 7;
+const int LAYER_LOGOS = 8;
+const int LAYER_HUD = 9;
+const int LAYER_RADAR = 10;
+const int LAYER_RADAR_DOTS = 11;
+const int LAYER_MENU = 12;
+const int LAYER_COUNT = 13;
+
+const char *LAYER_NAMES[LAYER_COUNT] = { "background", "stars", "planets", "projectiles", "pods", "motherships", "ships", "effects", "logos", "hud", "radar", "radar dots", "menu" };
+// Layers whose commands may be reordered to group the same surfaces
+const bool LAYER_SORTED[LAYER_COUNT] = { false, true, true, true, true, true, true, true, true, false, false, true, false };
+// Flip the whole screen when more than this percentage of it changed
+const int DIRTY_FLIP_PERCENT = 40;
+// Flip the whole screen rather than send more dirty rectangles than this
+const int DIRTY_MAX_RECTS = 64;
+
+// Draws straight onto the target instead of blitting a surface. Passes may run for several bands
+// at once, each with a target whose clip rectangle is its band, and must only draw inside it.
+typedef void (*Render_Pass)(void *data, SDL_Surface *target);
+
+struct Draw_Command
 {
-    //If the tile is on screen
-    if( collision( camera, box ) == true )
-    {
-        //Show the tile
-        apply_surface( box.x - camera.x, box.y - camera.y, tileSheet, screen);    
-    }
-}    
+	int layer;
+	// Surface to group by (NULL keeps the order the commands were added in)
+	SDL_Surface *group;
+	int sequence;
+	SDL_Surface *source;
+	// Part of the source to draw
+	SDL_Rect clip;
+	int x, y;
+	// Alpha to set on the source before blitting, or -1 to leave it
+	int alpha;
+	// Set for passes instead of blits, which use clip for the area they draw in (empty if anywhere)
+	Render_Pass pass;
+	void *data;
+};
 
-SDL_Rect &Tile::get_box()
+// Orders commands by layer, then surface, then the order they were added
+bool draw_before(const Draw_Command &a, const Draw_Command &b)
 {
-    return box;
+	if (a.layer != b.layer) return a.layer < b.layer;
+	if (a.group != b.group) return std::less<SDL_Surface*>()(a.group, b.group);
+	return a.sequence < b.sequence;
 }
 
+// Where a blit landed on the target, to compare one frame with the next
+struct Drawn_Area
+{
+	SDL_Surface *source;
+	SDL_Rect area;
+	// Corner of the part of the source drawn there
+	Sint16 clip_x, clip_y;
+	int alpha;
+	// Place in the frame's drawing order
+	int order;
+};
 
+// Orders areas by everything but their order, so the same blit in two frames sorts the same
+bool drawn_before(const Drawn_Area &a, const Drawn_Area &b)
+{
+	if (a.source != b.source) return std::less<SDL_Surface*>()(a.source, b.source);
+	if (a.area.x != b.area.x) return a.area.x < b.area.x;
+	if (a.area.y != b.area.y) return a.area.y < b.area.y;
+	if (a.area.w != b.area.w) return a.area.w < b.area.w;
+	if (a.area.h != b.area.h) return a.area.h < b.area.h;
+	if (a.clip_x != b.clip_x) return a.clip_x < b.clip_x;
+	if (a.clip_y != b.clip_y) return a.clip_y < b.clip_y;
+	if (a.alpha != b.alpha) return a.alpha < b.alpha;
+	return a.order < b.order;
+}
+bool same_drawing(const Drawn_Area &a, const Drawn_Area &b)
+{
+	return a.source == b.source && a.area.x == b.area.x && a.area.y == b.area.y && a.area.w == b.area.w && a.area.h == b.area.h
+		&& a.clip_x == b.clip_x && a.clip_y == b.clip_y && a.alpha == b.alpha;
+}
 
+class Render_Queue;
 
+// One band of the frame and the thread that draws it
+struct Render_Band
+{
+	Render_Queue *queue;
+	SDL_Thread *thread;
+	// The target's pixels, clipped to the band
+	SDL_Surface *view;
+	double layer_time[LAYER_COUNT];
+};
 
-
-/********************************************** PLANET CLASS **************************************/
-/*
- * Defines the planets used in the game
-*/
-class Planet
+class Render_Queue
 {
 	private:
-	//Holds coordinates and dimensions of the collision box
-	SDL_Rect box;
-	Circle circle;
-	//Number of resource points remaining
-	int capture_time;
-	// Type of planet
-	int type;
+	std::vector<Draw_Command> commands;
+	// Totals for each layer since the last report
+	double layer_time[LAYER_COUNT];
+	int layer_blits[LAYER_COUNT];
+	int culled;
+	int frames, split_frames;
+	// World entities drawn and culled before they reached the queue
+	int entities_drawn, entities_culled;
 	
-	int owner;
-	// X and Y Velocity
-	int red_team, blue_team;
+	// Bands (the first is drawn by the thread calling flush) and what the threads share
+	std::vector<Render_Band> bands;
+	SDL_mutex *lock;
+	SDL_cond *wake, *finished;
+	int generation, pending;
+	bool running;
+	
+	// What this frame and the last one drew, and what has to be presented
+	std::vector<Drawn_Area> drawn, last_drawn;
+	std::vector<SDL_Surface*> redrawn;
+	std::vector<SDL_Rect> dirty;
+	bool whole_frame;
+	// Areas passes drew in this frame and the last
+	std::vector<SDL_Rect> passed, last_passed;
+	// Surface drawn under everything, and where the last frame drew over it
+	SDL_Surface *backdrop, *last_backdrop;
+	std::vector<SDL_Rect> covered;
+	bool covered_known;
+	// Presentation totals since the last report
+	double presented;
+	int partial_frames;
+	
+	// Records where a blit drawn with this alpha lands on the target
+	void mark(const Draw_Command &command, SDL_Surface *target, int alpha);
+	// Records where a pass drew
+	void mark_pass(const Draw_Command &command);
+	// Adds the blits that put back the backdrop, whole or only where the last frame drew over it
+	void add_backdrop(SDL_Surface *target);
+	// Works out the rectangles that differ from the last frame
+	void find_dirty(SDL_Surface *target);
+	// Adds a dirty rectangle, merging it with any it overlaps
+	void add_dirty(SDL_Rect rect);
+	// Draws the commands one after another
+	void draw_serial(SDL_Surface *target);
+	// Culls the commands and settles the alpha each is drawn with, as drawing them in order would.
+	// Returns false, changing nothing, if any of them can't be drawn in bands.
+	bool prepare_bands(SDL_Surface *target);
+	void draw_bands(SDL_Surface *target);
+	void draw_band(Render_Band &band);
+	// Band thread entry point
+	static int work(void *data);
 	
 	public:
-	Planet();
-	// Displays planet on screen
-	void show(SDL_Surface *screen);
-	void create(int type, int x, int y);
-	void capture(int strength, int team);
-	void init(int i);
-	int get_owner();
-	SDL_Rect get_coords();
-	Circle get_circle();
+	Render_Queue();
+	~Render_Queue();
+	// Splits frames into this many bands drawn at once (1 draws each frame in one pass)
+	void set_bands(int count);
+	// Adds a blit of the whole source surface with its top left corner at x, y
+	void add(int layer, int x, int y, SDL_Surface *source, int alpha = -1);
+	// Adds a blit of part of the source surface, such as one frame of an atlas
+	void add(int layer, int x, int y, SDL_Surface *source, const SDL_Rect &clip);
+	// Adds a pass that draws itself when its layer is reached
+	void add_pass(int layer, Render_Pass pass, void *data);
+	// Adds a pass that only draws inside the given area of the target
+	void add_pass(int layer, Render_Pass pass, void *data, const SDL_Rect &area);
+	// Sets the screen-sized surface drawn under everything this frame
+	void set_backdrop(SDL_Surface *surface);
+	// Records how many world entities were in view this frame and how many were culled
+	void count(int drawn, int culled);
+	// Culls, sorts and draws the frame's commands, then empties the queue
+	void flush(SDL_Surface *target);
+	// Notes that a source's pixels changed, so wherever it's drawn next frame is presented
+	void redraw(SDL_Surface *source);
+	// Presents the whole of the next frame
+	void invalidate();
+	// Shows the last flushed frame, sending only what changed when the screen is a window
+	bool present(SDL_Surface *screen);
+	// Prints the average cost of each layer per frame since the last report
+	void report(FILE *out);
 };
 
-Planet::Planet()
+Render_Queue::Render_Queue()
 {
+	for (int i = 0; i < LAYER_COUNT; i++)
+	{
+		layer_time[i] = 0;
+		layer_blits[i] = 0;
+	}
+	culled = 0;
+	frames = 0;
+	split_frames = 0;
+	entities_drawn = 0;
+	entities_culled = 0;
+	lock = SDL_CreateMutex();
+	wake = SDL_CreateCond();
+	finished = SDL_CreateCond();
+	generation = 0;
+	pending = 0;
+	running = false;
+	whole_frame = true;
+	presented = 0;
+	partial_frames = 0;
+	backdrop = NULL;
+	last_backdrop = NULL;
+	covered_known = false;
 }
-
-int Planet::get_owner()
+Render_Queue::~Render_Queue()
 {
-	return owner;
+	set_bands(1);
+	SDL_DestroyCond(finished);
+	SDL_DestroyCond(wake);
+	SDL_DestroyMutex(lock);
 }
-SDL_Rect Planet::get_coords()
+void Render_Queue::set_bands(int count)
 {
-	return box;
+	// Stop the old threads
+	SDL_mutexP(lock);
+	running = false;
+	SDL_CondBroadcast(wake);
+	SDL_mutexV(lock);
+	for (unsigned int i = 0; i < bands.size(); i++)
+	{
+		if (bands[i].thread != NULL) SDL_WaitThread(bands[i].thread, NULL);
+		SDL_FreeSurface(bands[i].view);
+	}
+	bands.clear();
+	if (count <= 1) return;
+	
+	// Every band is set up before any thread starts, as they hold pointers into the list
+	bands.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		bands[i].queue = this;
+		bands[i].thread = NULL;
+		bands[i].view = NULL;
+		for (int l = 0; l < LAYER_COUNT; l++)
+		{
+			bands[i].layer_time[l] = 0;
+		}
+	}
+	running = true;
+	for (int i = 1; i < count; i++)
+	{
+		bands[i].thread = SDL_CreateThread(work, &bands[i]);
+	}
 }
-Circle Planet::get_circle()
+void Render_Queue::count(int drawn, int culled)
 {
-	return circle;
+	// Passes may count from several bands at once
+	SDL_mutexP(lock);
+	entities_drawn += drawn;
+	entities_culled += culled;
+	SDL_mutexV(lock);
 }
-void Planet::show( SDL_Surface *screen )
-{    
-    //Show the planet
-	if (type > -1)
-	{
-		apply_surface( box.x - camera.x, box.y - camera.y, planetTex[type], screen);
-	}
+void Render_Queue::add(int layer, int x, int y, SDL_Surface *source, int alpha)
+{
+	if (source == NULL) return;
+	Draw_Command command;
+	command.layer = layer;
+	command.group = LAYER_SORTED[layer] ? source : NULL;
+	command.sequence = (int)commands.size();
+	command.source = source;
+	command.clip.x = 0;
+	command.clip.y = 0;
+	command.clip.w = source->w;
+	command.clip.h = source->h;
+	command.x = x;
+	command.y = y;
+	command.alpha = alpha;
+	command.pass = NULL;
+	command.data = NULL;
+	commands.push_back(command);
 }
-
-// Start planet in a rand location on screen with a rand velocity
-void Planet::init(int i)
+void Render_Queue::add(int layer, int x, int y, SDL_Surface *source, const SDL_Rect &clip)
 {
-	type = i;
-	red_team = 0;
-	blue_team = 0;
-	owner = 0;
-	circle.x = box.x;
-	circle.y = box.y;
-	circle.r = box.w/2;
+	if (source == NULL) return;
+	add(layer, x, y, source);
+	commands.back().clip = clip;
 }
-
-// Create planet to given type specifications
-void Planet::create(int i, int x, int y)
+void Render_Queue::add_pass(int layer, Render_Pass pass, void *data)
 {
-	if (i == 0)
-	{
-		capture_time = 900;
-		box.w = 366;
-		box.h = 366;
-		box.x = x;
-		box.y = y;
-		init(i);
-	}
-	if (i == 1)
+	Draw_Command command;
+	command.layer = layer;
+	command.group = NULL;
+	command.sequence = (int)commands.size();
+	command.source = NULL;
+	command.clip.x = 0;
+	command.clip.y = 0;
+	command.clip.w = 0;
+	command.clip.h = 0;
+	command.x = 0;
+	command.y = 0;
+	command.alpha = -1;
+	command.pass = pass;
+	command.data = data;
+	commands.push_back(command);
+}
+void Render_Queue::add_pass(int layer, Render_Pass pass, void *data, const SDL_Rect &area)
+{
+	add_pass(layer, pass, data);
+	commands.back().clip = area;
+}
+void Render_Queue::set_backdrop(SDL_Surface *surface)
+{
+	backdrop = surface;
+}
+void Render_Queue::add_backdrop(SDL_Surface *target)
+{
+	if (backdrop == NULL) return;
+	bool kept = backdrop == last_backdrop && covered_known && backdrop->w == target->w && backdrop->h == target->h
+		&& std::find(redrawn.begin(), redrawn.end(), backdrop) == redrawn.end();
+	if (!kept)
 	{
-		capture_time = 1200;
-		box.w = 409;
-		box.h = 403;
-		box.x = x;
-		box.y = y;
-		init(i);
-
+		add(LAYER_BACKGROUND, 0, 0, backdrop);
+		return;
 	}
-
-	if (i == 2)
+	for (unsigned int i = 0; i < covered.size(); i++)
 	{
-		capture_time = 900;
-		box.w = 360;
-		box.h = 360;
-		box.x = x;
-		box.y = y;
-		init(i);
-
+		add(LAYER_BACKGROUND, covered[i].x, covered[i].y, backdrop, covered[i]);
 	}
-	if (i == 3)
+}
+void Render_Queue::flush(SDL_Surface *target)
+{
+	add_backdrop(target);
+	covered_known = true;
+	std::sort(commands.begin(), commands.end(), draw_before);
+	if (bands.size() > 1 && prepare_bands(target))
 	{
-		capture_time = 900;
-		box.w = 360;
-		box.h = 366;
-		box.x = x;
-		box.y = y;
-		init(i);
-
+		draw_bands(target);
+		split_frames++;
 	}
+	else draw_serial(target);
+	find_dirty(target);
+	commands.clear();
+	last_backdrop = backdrop;
+	backdrop = NULL;
+	frames++;
 }
-
-// Drain resources to a given value
-void Planet::capture(int strength, int team)
+void Render_Queue::draw_serial(SDL_Surface *target)
 {
-	if (team == 1)
+	unsigned int i = 0;
+	while (i < commands.size())
 	{
-		if (blue_team < capture_time) blue_team += strength;
-		if (red_team > 0) red_team -= strength;
+		int layer = commands[i].layer;
+		double start = precise_ticks();
+		for (; i < commands.size() && commands[i].layer == layer; i++)
+		{
+			Draw_Command &command = commands[i];
+			if (command.pass != NULL)
+			{
+				command.pass(command.data, target);
+				mark_pass(command);
+				layer_blits[layer]++;
+				continue;
+			}
+			// Anything entirely off the target would be clipped away by SDL anyway
+			if (command.x >= target->w || command.y >= target->h || command.x + command.clip.w <= 0 || command.y + command.clip.h <= 0)
+			{
+				culled++;
+				continue;
+			}
+			if (command.alpha >= 0) SDL_SetAlpha(command.source, SDL_SRCALPHA, command.alpha);
+			mark(command, target, (command.source->flags & SDL_SRCALPHA) ? command.source->format->alpha : 255);
+			apply_surface(command.x, command.y, command.source, target, &command.clip);
+			layer_blits[layer]++;
+		}
+		layer_time[layer] += precise_ticks() - start;
 	}
-	if (team == 2)
+}
+bool Render_Queue::prepare_bands(SDL_Surface *target)
+{
+	for (unsigned int i = 0; i < commands.size(); i++)
 	{
-		if (red_team < capture_time) red_team += strength;
-		if (blue_team > 0 ) blue_team -= strength;
+		if (commands[i].pass == NULL && !sprite_blittable(commands[i].source, target)) return false;
 	}
-	if (red_team >= capture_time) 
+	unsigned int kept = 0;
+	for (unsigned int i = 0; i < commands.size(); i++)
 	{
-		owner = 2;
+		Draw_Command command = commands[i];
+		if (command.pass == NULL)
+		{
+			if (command.x >= target->w || command.y >= target->h || command.x + command.clip.w <= 0 || command.y + command.clip.h <= 0)
+			{
+				culled++;
+				continue;
+			}
+			// Alpha set for one blit stays on the surface for the ones after it
+			if (command.alpha >= 0) SDL_SetAlpha(command.source, SDL_SRCALPHA, command.alpha);
+			command.alpha = (command.source->flags & SDL_SRCALPHA) ? command.source->format->alpha : 255;
+			mark(command, target, command.alpha);
+		}
+		else mark_pass(command);
+		layer_blits[command.layer]++;
+		commands[kept++] = command;
 	}
-	if (blue_team >= capture_time) 
+	commands.resize(kept);
+	return true;
+}
+void Render_Queue::draw_bands(SDL_Surface *target)
+{
+	if (SDL_MUSTLOCK(target)) SDL_LockSurface(target);
+	// Views share the target's pixels, each clipped to its own rows
+	int count = (int)bands.size();
+	for (int i = 0; i < count; i++)
 	{
-		owner = 1;
+		Render_Band &band = bands[i];
+		if (band.view == NULL || band.view->pixels != target->pixels || band.view->w != target->w || band.view->h != target->h)
+		{
+			SDL_FreeSurface(band.view);
+			SDL_PixelFormat *format = target->format;
+			band.view = SDL_CreateRGBSurfaceFrom(target->pixels, target->w, target->h, format->BitsPerPixel, target->pitch, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+			if (band.view == NULL) continue;
+			SDL_Rect rows = { 0, (Sint16)(target->h * i / count), (Uint16)target->w, (Uint16)(target->h * (i + 1) / count - target->h * i / count) };
+			SDL_SetClipRect(band.view, &rows);
+		}
 	}
 	
-}
-
-
-
-/******************************************** PROJECTILE CLASS ****************************************/
-/*
-  Projectile fired from ship
-*/
-
-class Projectile
-{
-    private:
-    //The projectile's collision box
-	SDL_Rect box;
-    
-	// Related velocities
-	int xVel, yVel, distance, maxDistance;
-	bool isActive;
+	SDL_mutexP(lock);
+	pending = count - 1;
+	generation++;
+	SDL_CondBroadcast(wake);
+	SDL_mutexV(lock);
+	draw_band(bands[0]);
+	SDL_mutexP(lock);
+	while (pending > 0)
+	{
+		SDL_CondWait(finished, lock);
+	}
+	SDL_mutexV(lock);
+	if (SDL_MUSTLOCK(target)) SDL_UnlockSurface(target);
 	
-	public:
-    Projectile();
-	void shoot(int x, int y, int velX, int velY);
-	SDL_Rect get_coords();
-	SDL_Rect next_coords();
-	bool active();
-	void move();
-	void show();
-	void destroy();
-};
-// Creates a new projectile
-Projectile::Projectile()
+	// A layer takes as long as its slowest band
+	for (int l = 0; l < LAYER_COUNT; l++)
+	{
+		double slowest = 0;
+		for (int i = 0; i < count; i++)
+		{
+			slowest = std::max(slowest, bands[i].layer_time[l]);
+			bands[i].layer_time[l] = 0;
+		}
+		layer_time[l] += slowest;
+	}
+}
+void Render_Queue::draw_band(Render_Band &band)
 {
-	maxDistance = 5;
-	isActive = false;
-	distance = maxDistance;
-	box.x = -1;
-	box.y = -1;
-	box.w = 0;
-	box.h = 0;
+	SDL_Surface *view = band.view;
+	if (view == NULL) return;
+	int top = view->clip_rect.y;
+	int bottom = view->clip_rect.y + view->clip_rect.h;
+	unsigned int i = 0;
+	while (i < commands.size())
+	{
+		int layer = commands[i].layer;
+		double start = precise_ticks();
+		for (; i < commands.size() && commands[i].layer == layer; i++)
+		{
+			Draw_Command &command = commands[i];
+			if (command.pass != NULL) command.pass(command.data, view);
+			else if (command.y < bottom && command.y + command.clip.h > top) blit_sprite(command.source, &command.clip, view, command.x, command.y, command.alpha);
+		}
+		band.layer_time[layer] += precise_ticks() - start;
+	}
 }
-// Destroys the projectile
-void Projectile::destroy()
+int Render_Queue::work(void *data)
 {
-	xVel = 0;
-	yVel = 0;
-	box.x = 0;
-	box.y = 0;
+	Render_Band *band = (Render_Band*)data;
+	Render_Queue *queue = band->queue;
+	int drawn = 0;
+	SDL_mutexP(queue->lock);
+	while (true)
+	{
+		while (queue->running && queue->generation == drawn)
+		{
+			SDL_CondWait(queue->wake, queue->lock);
+		}
+		if (!queue->running) break;
+		drawn = queue->generation;
+		SDL_mutexV(queue->lock);
+		
+		queue->draw_band(*band);
+		
+		SDL_mutexP(queue->lock);
+		if (--queue->pending == 0) SDL_CondSignal(queue->finished);
+	}
+	SDL_mutexV(queue->lock);
+	return 0;
 }
-void Projectile::move()
+void Render_Queue::mark(const Draw_Command &command, SDL_Surface *target, int alpha)
 {
-	box.x += xVel;
-	box.y += yVel;
-	distance ++;
-	// Make projectile inactive if max distance has been exceeded.
-	if (distance >= maxDistance) isActive = false;
+	Drawn_Area d;
+	d.source = command.source;
+	int x = std::max(command.x, 0);
+	int y = std::max(command.y, 0);
+	d.area.x = (Sint16)x;
+	d.area.y = (Sint16)y;
+	d.area.w = (Uint16)(std::min(command.x + command.clip.w, target->w) - x);
+	d.area.h = (Uint16)(std::min(command.y + command.clip.h, target->h) - y);
+	d.clip_x = command.clip.x;
+	d.clip_y = command.clip.y;
+	d.alpha = alpha;
+	d.order = (int)drawn.size();
+	drawn.push_back(d);
 }
-void Projectile::show()
+void Render_Queue::mark_pass(const Draw_Command &command)
 {
-	apply_surface( box.x - camera.x, box.y - camera.y, laser, screen);
+	// Passes that don't say where they draw may have drawn anywhere
+	if (command.clip.w == 0 || command.clip.h == 0)
+	{
+		whole_frame = true;
+		covered_known = false;
+	}
+	else passed.push_back(command.clip);
 }
-// Returns true if projectile is active
-bool Projectile::active()
+void Render_Queue::add_dirty(SDL_Rect rect)
 {
-	if (isActive){ return true;}
-	else return false;
+	// Grow the rectangle over any it touches, until it overlaps none
+	unsigned int i = 0;
+	while (i < dirty.size())
+	{
+		SDL_Rect &d = dirty[i];
+		if (d.x > rect.x + rect.w || rect.x > d.x + d.w || d.y > rect.y + rect.h || rect.y > d.y + d.h)
+		{
+			i++;
+			continue;
+		}
+		int x1 = std::max(d.x + d.w, rect.x + rect.w);
+		int y1 = std::max(d.y + d.h, rect.y + rect.h);
+		rect.x = std::min(d.x, rect.x);
+		rect.y = std::min(d.y, rect.y);
+		rect.w = (Uint16)(x1 - rect.x);
+		rect.h = (Uint16)(y1 - rect.y);
+		dirty[i] = dirty.back();
+		dirty.pop_back();
+		i = 0;
+	}
+	dirty.push_back(rect);
 }
-// Sets the projectile away
-void Projectile::shoot( int x, int y, int velX, int velY)
+void Render_Queue::find_dirty(SDL_Surface *target)
 {
-	//Initialize the offsets
-    box.x = x;
-    box.y = y;
-    box.w = 20;
-    box.h = 20;
-
-	distance = 0;
-	isActive = true;
-	//Initialize the velocity
-	xVel = velX*3;
-	yVel = velY*3;
+	std::vector<Drawn_Area> now = drawn;
+	std::sort(now.begin(), now.end(), drawn_before);
+	std::sort(last_drawn.begin(), last_drawn.end(), drawn_before);
+	
+	// Pair each blit with the same one last frame; anything unpaired is dirty
+	std::vector<int> was(drawn.size(), -1);
+	unsigned int a = 0, b = 0;
+	while (a < now.size() || b < last_drawn.size())
+	{
+		if (a < now.size() && b < last_drawn.size() && same_drawing(now[a], last_drawn[b])) was[now[a++].order] = last_drawn[b++].order;
+		else if (b == last_drawn.size() || (a < now.size() && drawn_before(now[a], last_drawn[b]))) add_dirty(now[a++].area);
+		else add_dirty(last_drawn[b++].area);
+	}
+	// A paired blit is dirty too if its source was redrawn, or if it's now drawn before one it was drawn after
+	int latest = -1;
+	for (unsigned int i = 0; i < drawn.size(); i++)
+	{
+		if (was[i] < 0) continue;
+		if (was[i] < latest || std::find(redrawn.begin(), redrawn.end(), drawn[i].source) != redrawn.end()) add_dirty(drawn[i].area);
+		latest = std::max(latest, was[i]);
+	}
+	// What passes draw changes every frame
+	for (unsigned int i = 0; i < passed.size(); i++)
+	{
+		add_dirty(passed[i]);
+	}
+	for (unsigned int i = 0; i < last_passed.size(); i++)
+	{
+		add_dirty(last_passed[i]);
+	}
 	
+	// Everything but the backdrop is drawn over it, and has to be taken off next frame
+	covered.clear();
+	for (unsigned int i = 0; i < drawn.size(); i++)
+	{
+		if (drawn[i].source != backdrop) covered.push_back(drawn[i].area);
+	}
+	covered.insert(covered.end(), passed.begin(), passed.end());
+	last_passed.swap(passed);
+	passed.clear();
+	
+	long area = 0;
+	for (unsigned int i = 0; i < dirty.size(); i++)
+	{
+		area += (long)dirty[i].w * dirty[i].h;
+	}
+	if (area * 100 > (long)target->w * target->h * DIRTY_FLIP_PERCENT || (int)dirty.size() > DIRTY_MAX_RECTS) whole_frame = true;
+	last_drawn.swap(drawn);
+	drawn.clear();
+	redrawn.clear();
 }
-SDL_Rect Projectile::get_coords()
+void Render_Queue::redraw(SDL_Surface *source)
 {
-	return box;
+	redrawn.push_back(source);
 }
-
-/********************************************* EXPLOSION CLASS ****************************************/
-/*
-  Explosion created by destroying a ship
-*/
-class Explosion
-{
-    private:
-    //The Explosion's collision box
-	SDL_Rect box;
-    int stage;
-	// Related velocities
-	bool active;
-
-	public:
-    Explosion();
-	void show(int x, int y, int type);
-	void reset();
-};
-// Creates a new Explosion
-Explosion::Explosion()
+void Render_Queue::invalidate()
 {
-	stage = -1;
-	active = false;
-	box.x = -1;
-	box.y = -1;
-	box.w = 0;
-	box.h = 0;
+	whole_frame = true;
+	covered_known = false;
 }
-
-void Explosion::show(int x, int y, int type)
+bool Render_Queue::present(SDL_Surface *screen)
 {
-	if (stage == -1)
+	bool flipped = whole_frame || (screen->flags & SDL_FULLSCREEN);
+	int bytes = screen->format->BytesPerPixel;
+	if (flipped) presented += (double)screen->w * screen->h * bytes;
+	else
 	{
-		box.x = x;
-		box.y = y;
-		active = true;
-		switch(type)
+		for (unsigned int i = 0; i < dirty.size(); i++)
 		{
-			case 0:
-			box.w = 110;
-			box.h = 110;
-			break;
-			
-			case 2:
-			box.w = 470;
-			box.h = 470;
-			break;
-			
-			default: break;
+			presented += (double)dirty[i].w * dirty[i].h * bytes;
 		}
+		if (!dirty.empty()) SDL_UpdateRects(screen, (int)dirty.size(), &dirty[0]);
+		partial_frames++;
 	}
-	if(active)
+	whole_frame = false;
+	dirty.clear();
+	if (flipped) return SDL_Flip(screen) != -1;
+	return true;
+}
+void Render_Queue::report(FILE *out)
+{
+	if (frames == 0) return;
+	fprintf(out, "render over %d frames (per frame): %.1f entities drawn, %.1f culled, %.1f blits culled\n", frames, (double)entities_drawn / frames, (double)entities_culled / frames, (double)culled / frames);
+	if (!bands.empty()) fprintf(out, "  %d of %d frames drawn in %d bands\n", split_frames, frames, (int)bands.size());
+	fprintf(out, "  presented %.0f kB per frame, %d of %d frames as dirty rectangles\n", presented / 1024 / frames, partial_frames, frames);
+	for (int i = 0; i < LAYER_COUNT; i++)
 	{
-		stage++;
-		if(type > 2) type -= 3;
-		apply_surface( box.x - camera.x, box.y - camera.y, explosion[type][stage], screen);
-		if (stage >= 7) active = false;
+		if (layer_blits[i] == 0) continue;
+		fprintf(out, "  %-12s %6.1f blits %7.3f ms\n", LAYER_NAMES[i], (double)layer_blits[i] / frames, layer_time[i] / frames);
+		layer_time[i] = 0;
+		layer_blits[i] = 0;
 	}
-	
+	culled = 0;
+	frames = 0;
+	split_frames = 0;
+	presented = 0;
+	partial_frames = 0;
+	entities_drawn = 0;
+	entities_culled = 0;
+	fflush(out);
+}
+
+// Draw commands for the frame being built
+Render_Queue render_queue;
+
+
+/********************************************* IMAGE LOADING ****************************************/
+// Converts a decoded image to the display format with the colour key set, freeing the decoded copy
+SDL_Surface *optimize_image( SDL_Surface *loadedImage )
+{
+    //The optimized image that will be used
+    SDL_Surface* optimizedImage = NULL;
+    
+    //If nothing went wrong in loading the image
+    if( loadedImage != NULL )
+    {
+        //Create an optimized image
+        optimizedImage = SDL_DisplayFormat( loadedImage );
+        
+        //Free the old image
+        SDL_FreeSurface( loadedImage );
+        
+        //If the image was optimized just fine
+        if( optimizedImage != NULL )
+        {
+            //Set all pixels of color 0x00FFFF to be transparent
+	    Uint32 colorkey = SDL_MapRGB( optimizedImage->format, 255, 0, 255 );
+            SDL_SetColorKey( optimizedImage, SDL_RLEACCEL | SDL_SRCCOLORKEY, colorkey );
+        }
+    }
+    
+    //Return the optimized image
+    return optimizedImage;
 }
-void Explosion::reset()
+SDL_Surface *load_image( std::string filename ) 
 {
-	stage = -1;
+    //Load the image and optimize it
+    return optimize_image( IMG_Load( filename.c_str() ) );
 }
 
-
-/***************************************** ESCAPE POD CLASS ************************************/
+/********************************************* SPRITE ROTATION ***************************************/
 /*
-  Escape pod created when a ship is destroyed
+ Headings of a ship or pod that have no hand-drawn image are made at load time
+ by turning the hand-drawn heading before them, so the lighting drawn into each
+ image is only ever a few degrees off. Packs written by -cookassets hold the
+ turned frames as well, and frames found there are copied rather than turned
+ again each time their set loads. Each target pixel takes the nearest source
+ pixel, so the colour key stays exact and the turned frames need no new
+ transparency. The source position moves by a fixed step along a row, so with
+ SSE2 four positions are worked out and bounds checked at once; the pixels are
+ then fetched one by one.
 */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ROTATE_SSE2
+#endif
 
-//The Pod that will move around on the screen
-class Pod
+// Copies one pixel of the given size
+inline void copy_pixel( Uint8 *to, const Uint8 *from, int bpp )
 {
-    private:
+	switch (bpp)
+	{
+		case 1: *to = *from; break;
+		case 2: *(Uint16*)to = *(const Uint16*)from; break;
+		case 3: to[0] = from[0]; to[1] = from[1]; to[2] = from[2]; break;
+		default: *(Uint32*)to = *(const Uint32*)from; break;
+	}
+}
+// Writes a pixel value of the given size
+inline void put_pixel( Uint8 *to, Uint32 pixel, int bpp )
+{
+	copy_pixel(to, (const Uint8*)&pixel, bpp);
+}
 
-    //The Pod's collision box
-	Circle circle;
-    int xVel, yVel, speed, team, angle, desired_angle, think;
-	public:
+// Draws a sprite turned clockwise by a number of headings into an area of the target
+// the size of the sprite. The target must have the sprite's pixel format.
+void rotate_image( SDL_Surface *source, int turn, SDL_Surface *target, SDL_Rect place )
+{
+	double angle = 6.283185307179586 * turn / HEADINGS;
+	float c = (float)cos(angle);
+	float s = (float)sin(angle);
+	float cx = (source->w - 1) / 2.0f;
+	float cy = (source->h - 1) / 2.0f;
+	int bpp = source->format->BytesPerPixel;
+	Uint32 key = source->format->colorkey;
+
+	SDL_LockSurface(source);
+	SDL_LockSurface(target);
+	const Uint8 *pixels = (const Uint8*)source->pixels;
+	for (int y = 0; y < place.h; y++)
+	{
+		Uint8 *row = (Uint8*)target->pixels + (place.y + y) * target->pitch + place.x * bpp;
+		// Source position of the row's first pixel; each pixel along moves it by (c, -s).
+		// Positions are biased by 1.5 so truncating rounds to nearest for everything from -1.5 up.
+		float dy = y - cy;
+		float sx = -cx * c + dy * s + cx + 1.5f;
+		float sy = cx * s + dy * c + cy + 1.5f;
+		int x = 0;
+#ifdef ROTATE_SSE2
+		__m128 steps = _mm_set_ps(3, 2, 1, 0);
+		__m128 vx = _mm_add_ps(_mm_set1_ps(sx), _mm_mul_ps(steps, _mm_set1_ps(c)));
+		__m128 vy = _mm_sub_ps(_mm_set1_ps(sy), _mm_mul_ps(steps, _mm_set1_ps(s)));
+		__m128 step_x = _mm_set1_ps(4 * c);
+		__m128 step_y = _mm_set1_ps(-4 * s);
+		__m128i one = _mm_set1_epi32(1);
+		__m128i none = _mm_set1_epi32(-1);
+		__m128i width = _mm_set1_epi32(source->w);
+		__m128i height = _mm_set1_epi32(source->h);
+		for (; x + 4 <= place.w; x += 4)
+		{
+			__m128i ix = _mm_sub_epi32(_mm_cvttps_epi32(vx), one);
+			__m128i iy = _mm_sub_epi32(_mm_cvttps_epi32(vy), one);
+			__m128i inside = _mm_and_si128(_mm_and_si128(_mm_cmpgt_epi32(ix, none), _mm_cmplt_epi32(ix, width)), _mm_and_si128(_mm_cmpgt_epi32(iy, none), _mm_cmplt_epi32(iy, height)));
+			// One bit per byte, so each pixel's flag is every fourth bit
+			int mask = _mm_movemask_epi8(inside);
+			int xs[4], ys[4];
+			_mm_storeu_si128((__m128i*)xs, ix);
+			_mm_storeu_si128((__m128i*)ys, iy);
+			for (int k = 0; k < 4; k++)
+			{
+				Uint8 *to = row + (x + k) * bpp;
+				if (mask & (1 << (k * 4))) copy_pixel(to, pixels + ys[k] * source->pitch + xs[k] * bpp, bpp);
+				else put_pixel(to, key, bpp);
+			}
+			vx = _mm_add_ps(vx, step_x);
+			vy = _mm_add_ps(vy, step_y);
+		}
+#endif
+		for (; x < place.w; x++)
+		{
+			int ix = (int)(sx + x * c) - 1;
+			int iy = (int)(sy - x * s) - 1;
+			Uint8 *to = row + x * bpp;
+			if (ix >= 0 && ix < source->w && iy >= 0 && iy < source->h) copy_pixel(to, pixels + iy * source->pitch + ix * bpp, bpp);
+			else put_pixel(to, key, bpp);
+		}
+	}
+	SDL_UnlockSurface(target);
+	SDL_UnlockSurface(source);
+}
 
-	Pod();
-	void set_team(int t);
-	Circle get_coords();
-	
-	// Spawns the Pod with re-initialised settings
-	void spawn(int x, int y);
-	void destroy();
-	void move();
-	void show(SDL_Surface *screen);
-	void reset();
-	void set_angle(Circle one, Circle two);
-	int get_distance(Circle one, Circle two);
-};
+/********************************************* ASSET PACK *******************************************/
+/*
+ A file of textures already converted to 32-bpp pixels, written offline by
+ -cookassets so the game does not decode and convert every image at startup:
 
-Pod::Pod()
+   page 0: "CPAK", version, entries, pixel masks, then an entry per image
+           (its path, size, pitch, colour key and where its pixels are)
+   after it: each image's pixels, row after row, starting on a 16 byte boundary
+
+ The file is memory mapped copy-on-write and surfaces are made straight over
+ the mapped pixels, so nothing is copied and every process using the same pack
+ shares its pages. If the display's format differs from the pack's, textures
+ are converted as they are taken out.
+*/
+const int PACK_VERSION = 1;
+const int PACK_NAME = 64;
+const int PACK_ALIGN = 16;
+const int PACK_PAGE = 4096;
+// The pack's pixel format: 32-bpp XRGB
+const Uint32 PACK_RMASK = 0x00FF0000;
+const Uint32 PACK_GMASK = 0x0000FF00;
+const Uint32 PACK_BMASK = 0x000000FF;
+
+struct Pack_Header
 {
-	
-	circle.x = 0;
-	circle.y = 0;
-	circle.r = 0;
-	speed = 60;
-	think = 0;
-}
-int Pod::get_distance(Circle one, Circle two)
+	char magic[4];
+	int version;
+	int entries;
+	Uint32 rmask, gmask, bmask;
+};
+struct Pack_Entry
 {
-	int x = 0;
-	int y = 0;
-	Circle a = one;
-	Circle b = two;
-	
-	// if a < b, subtract it from b, else vice versa
-	if (a.x < b.x) x = b.x - a.x;
-	else x = a.x - b.x;
-	
-	if (a.y < b.y) y = b.y - a.y;
-	else y = a.y - b.y;
-	
-	return x + y;
-}
-void Pod::set_team(int t)
+	char path[PACK_NAME];
+	int w, h, pitch;
+	Uint32 key;
+	Uint32 offset;
+};
+
+class Asset_Pack
 {
-	if (t < 3) {team = 1;}
-	else team = 2;
+	private:
+	Uint8 *base;
+	long size;
+	std::vector<Pack_Entry> entries;
 	
-	circle.x = 0;
-	circle.y = 0;
+	public:
+	Asset_Pack();
+	~Asset_Pack();
+	bool open(const char *name);
+	// Unmaps the pack. Surfaces made from it must be freed first.
+	void close();
+	bool is_open();
+	// Makes a display surface of a texture in the pack, or returns NULL if the pack doesn't have it
+	SDL_Surface *surface(const char *path);
+	// Converts decoded images to the pack's format and writes them with their paths
+	static bool write(const char *name, std::vector<std::string> &paths, std::vector<SDL_Surface*> &images);
+};
+
+Asset_Pack::Asset_Pack()
+{
+	base = NULL;
+	size = 0;
 }
-Circle Pod::get_coords()
+Asset_Pack::~Asset_Pack()
 {
-	return circle;
+	close();
 }
-void Pod::set_angle(Circle one, Circle two)
+bool Asset_Pack::open(const char *name)
 {
-	int x;
-	int y;
-	if (one.x < two.x) x = two.x - one.x;
-	else x = one.x - two.x;
-	if (one.y < two.y) y = two.y - one.y;
-	else y = one.y - two.y;
-
-	if(one.x == two.x && one.y == two.y){}
-	else if(one.x == two.x && one.y > two.y) angle = 0;
-	else if (one.x < two.x && one.y == two.y) angle = 4;
-	else if (one.x == two.x && one.y < two.y) angle = 8;
-	else if (one.x > two.x && one.y == two.y) angle = 12;
-	else
+	close();
+#ifdef WIN32
+	HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	size = (long)GetFileSize(file, NULL);
+	if (size < PACK_PAGE)
 	{
-		float radians = atan((float)x/(float)y);
-	
-		if (one.x < two.x && one.y > two.y){} //  add 0
-		else if (one.x < two.x && one.y < two.y) radians += (float)1.57079633; // add 90
-		else if (one.x > two.x && one.y < two.y) radians += (float)3.14159265; // add 180
-		else if (one.x > two.x && one.y > two.y) radians = (float)6.28318531 - radians;// 4.71238898; // add 270
-		
-		desired_angle = (int)((float)radians / 0.392697);
+		CloseHandle(file);
+		return false;
 	}
-
-}
-void Pod::move()
-{
-	Circle temp;
-	int mship;
-	if (team == 1) mship = blue_mother;
-	else mship = red_mother;
-	temp.x = mothership[mship].x + (mothership[mship].w/2);
-	temp.y = mothership[mship].y + (mothership[mship].h/2);
-	temp.r = 10;
-	if (think < 0) think++;
-	else 
+	HANDLE mapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return false;
+	base = (Uint8*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+	if (base == NULL) return false;
+#else
+	int file = ::open(name, O_RDONLY);
+	if (file < 0) return false;
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size < PACK_PAGE)
 	{
-		think = -5;
-		set_angle(circle, temp);
+		::close(file);
+		return false;
 	}
-	int rotate = 0;
-	if (angle != desired_angle)
+	size = (long)info.st_size;
+	// Private so that SDL may write to a texture (to undo RLE) without touching the file
+	void *view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	::close(file);
+	if (view == MAP_FAILED) return false;
+	base = (Uint8*)view;
+#endif
+	
+	// Check the header and that every image it describes is in the file
+	Pack_Header header;
+	memcpy(&header, base, sizeof(header));
+	long table = sizeof(header) + (long)header.entries * sizeof(Pack_Entry);
+	if (memcmp(header.magic, "CPAK", 4) != 0 || header.version != PACK_VERSION || header.entries < 0 || table > size
+		|| header.rmask != PACK_RMASK || header.gmask != PACK_GMASK || header.bmask != PACK_BMASK)
 	{
-		if (angle < desired_angle) rotate = 1;
-		else rotate = -1;
-		
+		close();
+		return false;
 	}
-	else rotate = 0;
-	// Rotate to meet desired angle
-	if (rotate == -1)
+	entries.resize(header.entries);
+	if (header.entries > 0) memcpy(&entries[0], base + sizeof(header), header.entries * sizeof(Pack_Entry));
+	for (int i = 0; i < header.entries; i++)
 	{
-		if (angle-1 > -1) angle -= 1;
-		else angle = 15;
+		Pack_Entry &entry = entries[i];
+		entry.path[PACK_NAME - 1] = 0;
+		if (entry.w <= 0 || entry.h <= 0 || entry.pitch < entry.w * 4 || entry.offset % PACK_ALIGN != 0 || entry.offset + (long)entry.pitch * entry.h > size)
+		{
+			close();
+			return false;
+		}
 	}
-	if (rotate == 1)
+	return true;
+}
+void Asset_Pack::close()
+{
+	if (base != NULL)
 	{
-		if (angle+1 < 16) angle += 1;
-		else angle = 0;
+#ifdef WIN32
+		UnmapViewOfFile(base);
+#else
+		munmap(base, size);
+#endif
 	}
-	float rad = (float)0.39269908169872414 * ((angle+1) - 5);
-	circle.x += (int)(cos(rad) * speed);
-	circle.y += (int)(sin(rad) * speed); 
-	if (get_distance(temp, circle) < 70) destroy();
+	base = NULL;
+	size = 0;
+	entries.clear();
 }
-void Pod::show( SDL_Surface *screen)
+bool Asset_Pack::is_open()
 {
-	if (angle < 0 || angle > 15) angle = 0;
-	apply_surface(circle.x - camera.x ,circle.y - camera.y,pod[angle],screen);
+	return base != NULL;
 }
-void Pod::spawn(int x, int y)
+SDL_Surface *Asset_Pack::surface(const char *path)
 {
-	circle.x = x;
-	circle.y = y;
-	circle.r = 90;
+	for (unsigned int i = 0; i < entries.size(); i++)
+	{
+		Pack_Entry &entry = entries[i];
+		if (strcmp(entry.path, path) != 0) continue;
+		
+		SDL_Surface *image = SDL_CreateRGBSurfaceFrom(base + entry.offset, entry.w, entry.h, 32, entry.pitch, PACK_RMASK, PACK_GMASK, PACK_BMASK, 0);
+		if (image == NULL) return NULL;
+		SDL_PixelFormat *format = SDL_GetVideoSurface() ? SDL_GetVideoSurface()->format : NULL;
+		if (format != NULL && (format->BitsPerPixel != 32 || format->Rmask != PACK_RMASK || format->Gmask != PACK_GMASK || format->Bmask != PACK_BMASK))
+		{
+			// The display wants another format, so this texture can't share the pack's pixels
+			return optimize_image(image);
+		}
+		SDL_SetColorKey( image, SDL_RLEACCEL | SDL_SRCCOLORKEY, entry.key );
+		return image;
+	}
+	return NULL;
 }
-
-void Pod::destroy()
+bool Asset_Pack::write(const char *name, std::vector<std::string> &paths, std::vector<SDL_Surface*> &images)
 {
-	circle.r = 0;
+	SDL_Surface *reference = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32, PACK_RMASK, PACK_GMASK, PACK_BMASK, 0);
+	if (reference == NULL) return false;
+	
+	// Lay the images out after the table
+	Pack_Header header;
+	memcpy(header.magic, "CPAK", 4);
+	header.version = PACK_VERSION;
+	header.entries = 0;
+	header.rmask = PACK_RMASK;
+	header.gmask = PACK_GMASK;
+	header.bmask = PACK_BMASK;
+	std::vector<Pack_Entry> table;
+	std::vector<SDL_Surface*> converted;
+	long table_size = sizeof(header) + (long)paths.size() * sizeof(Pack_Entry);
+	Uint32 offset = (Uint32)(((table_size + PACK_PAGE - 1) / PACK_PAGE) * PACK_PAGE);
+	for (unsigned int i = 0; i < paths.size(); i++)
+	{
+		SDL_Surface *image = SDL_ConvertSurface(images[i], reference->format, SDL_SWSURFACE);
+		if (image == NULL || paths[i].size() >= (unsigned int)PACK_NAME)
+		{
+			SDL_FreeSurface(image);
+			fprintf(stderr, "Could not pack %s\n", paths[i].c_str());
+			continue;
+		}
+		Pack_Entry entry;
+		memset(&entry, 0, sizeof(entry));
+		strncpy(entry.path, paths[i].c_str(), PACK_NAME - 1);
+		entry.w = image->w;
+		entry.h = image->h;
+		entry.pitch = image->w * 4;
+		entry.key = SDL_MapRGB(reference->format, 255, 0, 255);
+		entry.offset = offset;
+		offset += (Uint32)(((entry.pitch * entry.h + PACK_ALIGN - 1) / PACK_ALIGN) * PACK_ALIGN);
+		table.push_back(entry);
+		converted.push_back(image);
+	}
+	header.entries = (int)table.size();
+	SDL_FreeSurface(reference);
+	
+	bool ok = false;
+	FILE *file = fopen(name, "wb");
+	if (file != NULL)
+	{
+		std::vector<char> head(table.empty() ? PACK_PAGE : table[0].offset, 0);
+		memcpy(&head[0], &header, sizeof(header));
+		if (!table.empty()) memcpy(&head[sizeof(header)], &table[0], table.size() * sizeof(Pack_Entry));
+		fwrite(&head[0], 1, head.size(), file);
+		std::vector<char> padding(PACK_ALIGN, 0);
+		for (unsigned int i = 0; i < table.size(); i++)
+		{
+			SDL_Surface *image = converted[i];
+			SDL_LockSurface(image);
+			for (int y = 0; y < image->h; y++)
+			{
+				fwrite((Uint8*)image->pixels + y * image->pitch, 1, table[i].pitch, file);
+			}
+			SDL_UnlockSurface(image);
+			int written = table[i].pitch * table[i].h;
+			fwrite(&padding[0], 1, (PACK_ALIGN - written % PACK_ALIGN) % PACK_ALIGN, file);
+		}
+		ok = ferror(file) == 0;
+		fclose(file);
+	}
+	for (unsigned int i = 0; i < converted.size(); i++)
+	{
+		SDL_FreeSurface(converted[i]);
+	}
+	return ok;
 }
 
+// Textures made from a pack point into it, so it stays open until they are freed
+Asset_Pack asset_pack;
 
+// Reads a whole file into memory
+bool read_file(const char *name, std::vector<char> &bytes)
+{
+	FILE *file = fopen(name, "rb");
+	if (file == NULL) return false;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	bytes.resize(size > 0 ? size : 0);
+	bool ok = size >= 0 && (size == 0 || fread(&bytes[0], 1, size, file) == (size_t)size);
+	fclose(file);
+	return ok;
+}
 
-/*********************************************** SHIP CLASS *******************************************/
+/********************************************* ASSET LOADER *****************************************/
 /*
- Representation of a player's ship
+ Loads a batch of images at startup. Reading the files is spread over a few
+ worker threads, but SDL_image's GIF decoder keeps its state in statics, so the
+ workers decode the bytes they read one at a time. Converting to the display
+ format touches the video surface, so the main thread does that, taking each
+ image in order as soon as it is decoded.
+ Time spent is kept per group of assets for the startup report.
 */
-
-//The Ship that will move around on the screen
-class Ship
+const int ASSET_THREADS = 4;
+const int ASSET_SHIPS = 0;
+const int ASSET_EXPLOSIONS = 1;
+const int ASSET_PODS = 2;
+const int ASSET_PLANETS = 3;
+const int ASSET_HUD = 4;
+const int ASSET_MENU = 5;
+const int ASSET_BACKGROUND = 6;
+const int ASSET_GROUPS = 7;
+const char *ASSET_GROUP_NAMES[ASSET_GROUPS] = { "ships", "explosions", "pods", "planets", "hud", "menu", "background" };
+
+struct Asset_Request
 {
-    private:
-
-    //The Ship's collision box
-	SDL_Rect box;
-	Circle circle;
-    
-	// The projectile that will be fired from the ship
-	Projectile proj;
-	Explosion explosion;
-	Pod pod;
-	
-    //The movement components of the Ship
-    int rotate, moving, angle, lastX, lastY, breaking;
+	// Where the finished surface goes
+	SDL_Surface **target;
+	std::string path;
+	int group;
+	// Filled in by the worker that decodes it
+	SDL_Surface *decoded;
+	double decode_ms;
+	bool done;
+};
 
-	
-	// Signals the state of the ship
-	bool render;
-	
-	// The dimensions of the ship's collision box.
-	int shipSize, speed, damage;
-	
-	// Signals the state of the shield
-	int showShield;
-	int recharge;
-	
-	bool shoot;
-	
-	// Ship stats (type = light, heavy or mothership = 1-3)
-	int shield, health, type, max_shield, reveal;
+// A turned copy of an image, made when a pack is written
+struct Turn_Request
+{
+	std::string path, name;
+	int turn;
+};
 
-	// Drift calculations
-    double xDrift, yDrift, accelerating;
+class Asset_Loader
+{
+	private:
+	std::vector<Asset_Request> requests;
+	std::vector<Turn_Request> turns;
+	// Next request for a worker to take
+	unsigned int next;
+	SDL_mutex *lock;
+	// Signalled whenever a request has been decoded
+	SDL_cond *decoded;
+	// Held while SDL_image decodes
+	SDL_mutex *decoding;
+	// Per group: images, time decoding (summed over the workers) and time converting
+	int count[ASSET_GROUPS];
+	double decode_ms[ASSET_GROUPS], convert_ms[ASSET_GROUPS];
+	double total_ms;
 	
-	// Variables dealing with AI
-	bool ai, ai_shoot;
-	int personality, desired_angle, ai_think;
-	Circle target;
-
+	// Worker thread entry point
+	static int work(void *data);
+	void decode(Asset_Request &request);
 	
 	public:
+	Asset_Loader();
+	~Asset_Loader();
+	// Queues an image to be loaded into *target
+	void add(SDL_Surface **target, std::string path, int group);
+	// Queues a copy of a queued image turned clockwise by some headings, stored under a name when a pack is written
+	void add_turned(std::string path, int turn, std::string name);
+	// Loads every queued image. Returns the number that could not be loaded.
+	int load(int threads);
+	// Loads every queued image from a pack, decoding any the pack doesn't hold
+	int load(Asset_Pack &pack);
+	// Decodes every queued image and writes them to a pack file
+	bool cook(const char *name);
+	// Prints the time each group took
+	void report(FILE *out);
+};
 
-	Ship();
-	
-	int xVel, yVel;
-	
-	// Sets the type of the ship
-	void set_type(int type);
-	
-	// Spawns the ship with re-initialised settings
-	void spawn();
-	
-	//Sets the camera over the Ship
-    void set_camera();
-	
-	// Returns true if render = 1
-	bool do_render();
+Asset_Loader::Asset_Loader()
+{
+	next = 0;
+	lock = SDL_CreateMutex();
+	decoded = SDL_CreateCond();
+	decoding = SDL_CreateMutex();
+	for (int g = 0; g < ASSET_GROUPS; g++)
+	{
+		count[g] = 0;
+		decode_ms[g] = 0;
+		convert_ms[g] = 0;
+	}
+	total_ms = 0;
+}
+Asset_Loader::~Asset_Loader()
+{
+	SDL_DestroyMutex(decoding);
+	SDL_DestroyCond(decoded);
+	SDL_DestroyMutex(lock);
+}
+void Asset_Loader::add(SDL_Surface **target, std::string path, int group)
+{
+	Asset_Request request;
+	request.target = target;
+	request.path = path;
+	request.group = group;
+	request.decoded = NULL;
+	request.decode_ms = 0;
+	request.done = false;
+	requests.push_back(request);
+}
+void Asset_Loader::add_turned(std::string path, int turn, std::string name)
+{
+	Turn_Request request;
+	request.path = path;
+	request.name = name;
+	request.turn = turn;
+	turns.push_back(request);
+}
+void Asset_Loader::decode(Asset_Request &request)
+{
+	double start = precise_ticks();
+	SDL_Surface *image = NULL;
+	std::vector<char> bytes;
+	if (read_file(request.path.c_str(), bytes) && !bytes.empty())
+	{
+		SDL_mutexP(decoding);
+		image = IMG_Load_RW( SDL_RWFromMem(&bytes[0], (int)bytes.size()), 1 );
+		SDL_mutexV(decoding);
+	}
+	double took = precise_ticks() - start;
 	
-	// Returns the ship's current type
-	int get_type();
+	SDL_mutexP(lock);
+	request.decoded = image;
+	request.decode_ms = took;
+	request.done = true;
+	SDL_CondBroadcast(decoded);
+	SDL_mutexV(lock);
+}
+int Asset_Loader::work(void *data)
+{
+	Asset_Loader *loader = (Asset_Loader*)data;
 	
-	//Handles the input from the keyboard
-    void handle_input( SDL_Event &event );
-    
-    //Moves the Ship after each loop repetition
-    void move(Planet planets[], Ship players[]);
+	SDL_mutexP(loader->lock);
+	while (loader->next < loader->requests.size())
+	{
+		Asset_Request &request = loader->requests[loader->next++];
+		SDL_mutexV(loader->lock);
+		loader->decode(request);
+		SDL_mutexP(loader->lock);
+	}
+	SDL_mutexV(loader->lock);
+	return 0;
+}
+int Asset_Loader::load(int threads)
+{
+	double start = precise_ticks();
+	if (requests.empty()) return 0;
 	
-    
-    //Shows the Ship on the screen
-    void show( SDL_Surface *screen );
+	// SDL_image sets its loaders up on first use, so the first image is decoded here
+	next = 1;
+	decode(requests[0]);
+	std::vector<SDL_Thread*> workers;
+	for (int i = 0; i < threads; i++)
+	{
+		workers.push_back(SDL_CreateThread(work, this));
+	}
 	
-	//Displays the health and shield respresentation
-	void show_health( SDL_Surface *screen);
+	int failed = 0;
+	for (unsigned int i = 0; i < requests.size(); i++)
+	{
+		Asset_Request &request = requests[i];
+		SDL_mutexP(lock);
+		while (!request.done)
+		{
+			SDL_CondWait(decoded, lock);
+		}
+		SDL_mutexV(lock);
 		
-	int get_damage();
-	
-	//Called when a ship takes damage
-    void hurt(int damage);
-	
-	//Called to destroy ship
-	void destroy();
-	
-	//Called to show the shield if it has power
-	void show_shield();
-	
-	// Recharges the shield if i=1
-	void recharge_shield(int i);
+		double converting = precise_ticks();
+		*request.target = optimize_image( request.decoded );
+		convert_ms[request.group] += precise_ticks() - converting;
+		decode_ms[request.group] += request.decode_ms;
+		count[request.group]++;
+		if (*request.target == NULL)
+		{
+			fprintf(stderr, "Could not load %s\n", request.path.c_str());
+			failed++;
+		}
+	}
+	for (unsigned int i = 0; i < workers.size(); i++)
+	{
+		SDL_WaitThread(workers[i], NULL);
+	}
+	requests.clear();
+	next = 0;
+	total_ms += precise_ticks() - start;
+	return failed;
+}
+int Asset_Loader::load(Asset_Pack &pack)
+{
+	double start = precise_ticks();
+	int failed = 0;
+	for (unsigned int i = 0; i < requests.size(); i++)
+	{
+		Asset_Request &request = requests[i];
+		double converting = precise_ticks();
+		*request.target = pack.surface(request.path.c_str());
+		if (*request.target == NULL) *request.target = load_image(request.path);
+		convert_ms[request.group] += precise_ticks() - converting;
+		count[request.group]++;
+		if (*request.target == NULL)
+		{
+			fprintf(stderr, "Could not load %s\n", request.path.c_str());
+			failed++;
+		}
+	}
+	requests.clear();
+	total_ms += precise_ticks() - start;
+	return failed;
+}
+bool Asset_Loader::cook(const char *name)
+{
+	// Each file is stored once, however many textures use it
+	std::vector<std::string> paths;
+	std::vector<SDL_Surface*> images;
+	for (unsigned int i = 0; i < requests.size(); i++)
+	{
+		if (std::find(paths.begin(), paths.end(), requests[i].path) != paths.end()) continue;
+		SDL_Surface *image = IMG_Load(requests[i].path.c_str());
+		if (image == NULL)
+		{
+			fprintf(stderr, "Could not load %s\n", requests[i].path.c_str());
+			continue;
+		}
+		paths.push_back(requests[i].path);
+		images.push_back(image);
+	}
 	
-	// Returns the ship's box dimensions and coordinates
-	SDL_Rect get_coords();
-	Circle get_circle();
-	Circle get_pod();
-	// Returns the dimensions and coords of the projectile
-	Projectile get_proj();
+	// Turned frames are stored too, so loading from the pack turns nothing
+	SDL_Surface *reference = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 32, PACK_RMASK, PACK_GMASK, PACK_BMASK, 0);
+	unsigned int decoded = images.size();
+	for (unsigned int i = 0; i < turns.size() && reference != NULL; i++)
+	{
+		Turn_Request &request = turns[i];
+		if (std::find(paths.begin(), paths.end(), request.name) != paths.end()) continue;
+		unsigned int k = std::find(paths.begin(), paths.begin() + decoded, request.path) - paths.begin();
+		if (k == decoded) continue;
+		SDL_Surface *image = SDL_ConvertSurface(images[k], reference->format, SDL_SWSURFACE);
+		SDL_Surface *copy = SDL_CreateRGBSurface(SDL_SWSURFACE, images[k]->w, images[k]->h, 32, PACK_RMASK, PACK_GMASK, PACK_BMASK, 0);
+		if (image == NULL || copy == NULL)
+		{
+			SDL_FreeSurface(image);
+			SDL_FreeSurface(copy);
+			continue;
+		}
+		SDL_SetColorKey(image, SDL_SRCCOLORKEY, SDL_MapRGB(image->format, 255, 0, 255));
+		SDL_Rect place = { 0, 0, (Uint16)image->w, (Uint16)image->h };
+		rotate_image(image, request.turn, copy, place);
+		SDL_FreeSurface(image);
+		paths.push_back(request.name);
+		images.push_back(copy);
+	}
+	SDL_FreeSurface(reference);
 	
-	// Destroys the projectile when called.
-	void destroy_proj();
-	void reveal_ship();
-	void ai_move(Planet planets[], Ship players[]);
-	int get_nearest(Planet planets[]);
-	int get_nearest(Ship players[]);
-	int get_team();
-	bool enemyVisible(Ship players[]);
-	int enemyInRange(Ship players[]);
-	bool revealed();
+	bool ok = Asset_Pack::write(name, paths, images);
+	for (unsigned int i = 0; i < images.size(); i++)
+	{
+		SDL_FreeSurface(images[i]);
+	}
+	requests.clear();
+	turns.clear();
+	return ok;
+}
+void Asset_Loader::report(FILE *out)
+{
+	fprintf(out, "assets        images  decode ms  convert ms\n");
+	for (int g = 0; g < ASSET_GROUPS; g++)
+	{
+		fprintf(out, "%-12s  %6d  %9.2f  %10.2f\n", ASSET_GROUP_NAMES[g], count[g], decode_ms[g], convert_ms[g]);
+	}
+	fprintf(out, "loaded in %.2f ms\n", total_ms);
+	fflush(out);
+}
+
+/******************************************** ASSET REGISTRY ****************************************/
+/*
+ Owns every texture. A texture is registered once per file and gets a handle
+ that stays valid until the registry is cleared, whether or not its pixels are
+ loaded. Holders take references: a texture is loaded when it gets its first
+ one and freed as soon as the last is dropped, so nothing is freed twice or
+ left behind. Surface alpha belongs to the surface, so a file that is drawn
+ translucent is registered apart from an opaque use of the same file.
+*/
+struct Texture_Slot
+{
+	std::string path;
+	// Asset group it is counted in, and the surface alpha to set (-1 for none)
+	int group, alpha;
+	SDL_Surface *surface;
+	int refs;
+	long bytes;
+	// Made by the game (atlases) rather than loaded from a file, so never reloaded or packed
+	bool generated;
+};
+
+class Asset_Registry
+{
+	private:
+	std::vector<Texture_Slot> slots;
+	// Handles by path and alpha
+	std::map<std::pair<std::string, int>, Texture> handles;
+	Asset_Loader loader;
+	Asset_Pack *pack;
+	long group_bytes[ASSET_GROUPS];
 	
-	int get_distance(Circle one, Circle two);
-	void get_heading();
-	void set_angle(Circle one, Circle two);
-	bool isOverPlanet(Planet planets[]);
-	void ai_on();
+	// Loads every slot that is held but has no surface, in one batch
+	void load_missing();
+	void unload(Texture t);
 	
+	public:
+	Asset_Registry();
+	// Takes textures from a pack rather than decoding them
+	void use_pack(Asset_Pack *p);
+	// Returns the handle of a texture, registering it the first time it is asked for
+	Texture find(const char *path, int group, int alpha);
+	// Takes a surface the game made under a name, replacing whatever was under it. The caller holds one reference.
+	Texture adopt(const char *name, int group, SDL_Surface *surface);
+	// Adds a reference to each texture, loading the ones that had none
+	void acquire(std::vector<Texture> &textures);
+	void acquire(Texture t);
+	// Drops a reference to each texture, freeing the ones nobody holds
+	void release(std::vector<Texture> &textures);
+	void release(Texture t);
+	// The texture's surface, or NULL if it isn't loaded
+	SDL_Surface *surface(Texture t);
+	long bytes(Texture t);
+	// The file a texture is loaded from
+	const char *path(Texture t);
+	// A new surface of something stored in the pack under a name, or NULL if there is no pack or it isn't there
+	SDL_Surface *cooked(const char *name);
+	// Bytes held by every loaded texture
+	long resident();
+	// Loads every held texture again (from the pack if there is one), keeping the handles
+	void reload();
+	// Queues every registered texture, for writing a pack
+	void queue_all(Asset_Loader &out);
+	// Frees every texture and forgets every handle
+	void clear();
+	// Prints load times, and resident memory per asset group
+	void report(FILE *out);
 };
 
-Ship::Ship()
+Asset_Registry::Asset_Registry()
 {
-
-	render = false;
-	recharge = 0;
-	breaking = 0;
-	ai = false;
-	reveal = 0;
-	ai_shoot = false;
-	shoot = false;
-	ai_think = 1;
-	desired_angle = 0;
+	pack = NULL;
+	for (int g = 0; g < ASSET_GROUPS; g++)
+	{
+		group_bytes[g] = 0;
+	}
 }
-void Ship::ai_on()
+void Asset_Registry::use_pack(Asset_Pack *p)
 {
-	ai = true;
-	
-	
-	if (type == 2 || type == 5)
+	pack = p;
+}
+Texture Asset_Registry::find(const char *path, int group, int alpha)
+{
+	std::pair<std::string, int> key(path, alpha);
+	std::map<std::pair<std::string, int>, Texture>::iterator found = handles.find(key);
+	if (found != handles.end()) return found->second;
+	Texture_Slot slot;
+	slot.path = path;
+	slot.group = group;
+	slot.alpha = alpha;
+	slot.surface = NULL;
+	slot.refs = 0;
+	slot.bytes = 0;
+	slot.generated = false;
+	slots.push_back(slot);
+	handles[key] = (Texture)(slots.size() - 1);
+	return (Texture)(slots.size() - 1);
+}
+Texture Asset_Registry::adopt(const char *name, int group, SDL_Surface *surface)
+{
+	Texture t = find(name, group, -1);
+	Texture_Slot &slot = slots[t];
+	unload(t);
+	slot.generated = true;
+	slot.surface = surface;
+	slot.bytes = (long)surface->pitch * surface->h;
+	slot.refs++;
+	group_bytes[slot.group] += slot.bytes;
+	return t;
+}
+void Asset_Registry::load_missing()
+{
+	std::vector<Texture> loading;
+	for (unsigned int i = 0; i < slots.size(); i++)
 	{
-		personality = 3;
+		if (slots[i].refs > 0 && slots[i].surface == NULL && slots[i].bytes == 0 && !slots[i].generated)
+		{
+			loader.add(&slots[i].surface, slots[i].path, slots[i].group);
+			loading.push_back((Texture)i);
+		}
 	}
-	else
+	if (loading.empty()) return;
+	if (pack != NULL && pack->is_open()) loader.load(*pack);
+	else loader.load(ASSET_THREADS);
+	
+	for (unsigned int k = 0; k < loading.size(); k++)
 	{
-		personality = rand()%3;
+		Texture_Slot &slot = slots[loading[k]];
+		if (slot.surface == NULL)
+		{
+			// Counted as loaded so a missing file isn't looked for again while it is held
+			slot.bytes = -1;
+			continue;
+		}
+		if (slot.alpha >= 0) SDL_SetAlpha(slot.surface, SDL_SRCALPHA, (Uint8)slot.alpha);
+		slot.bytes = (long)slot.surface->pitch * slot.surface->h;
+		group_bytes[slot.group] += slot.bytes;
 	}
 }
-void Ship::set_type(int t)
+void Asset_Registry::unload(Texture t)
 {
-	type = t;
-	if (type == 0)
+	Texture_Slot &slot = slots[t];
+	if (slot.surface != NULL)
 	{
-		shipSize = 110;
-		max_shield = 100;
-		shield = 200;
-		health = 100;
-		speed = 40;
-		type = 0;
-		damage = 5;
-		render = true;
-		spawn();
-		explosion.reset();
+		SDL_FreeSurface(slot.surface);
+		group_bytes[slot.group] -= slot.bytes;
+		// A surface made later could take its address, and look to the screen like the same sprite
+		render_queue.invalidate();
 	}
-	else if (type == 1)
+	slot.surface = NULL;
+	slot.bytes = 0;
+}
+void Asset_Registry::acquire(std::vector<Texture> &textures)
+{
+	for (unsigned int i = 0; i < textures.size(); i++)
 	{
-
-		shipSize = 150;
-		type = 1;
-		max_shield = 200;
-		shield = 200;
-		health = 200;
-		damage = 10;
-		speed = 30;
-		render = true;
-		spawn();
-		explosion.reset();
+		if (textures[i] >= 0 && textures[i] < (Texture)slots.size()) slots[textures[i]].refs++;
 	}
-	else if (type == 2)
+	load_missing();
+}
+void Asset_Registry::acquire(Texture t)
+{
+	std::vector<Texture> one(1, t);
+	acquire(one);
+}
+void Asset_Registry::release(std::vector<Texture> &textures)
+{
+	for (unsigned int i = 0; i < textures.size(); i++)
 	{
-
-		shipSize = 470;
-		type = 2;
-		max_shield = 2000 *(MAX_PLAYERS/10); // Mothership's health is determined by number of potential enemies
-		shield = 2000 *(MAX_PLAYERS/10);
-		speed = 20;
-		damage = 30;
-		health = 2000 *(MAX_PLAYERS/10);
-		render = true;
-		spawn();
-		explosion.reset();
+		release(textures[i]);
 	}
-	else if (type == 3)
-	{
-
-		shipSize = 110;
-		type = 3;
-		max_shield = 100;
-		shield = 200;
-		health = 100;
-		speed = 40;
-		damage = 5;
-		render = true;
-		spawn();
-		explosion.reset();
+}
+void Asset_Registry::release(Texture t)
+{
+	// Handles from before a clear are ignored
+	if (t < 0 || t >= (Texture)slots.size() || slots[t].refs == 0) return;
+	if (--slots[t].refs == 0) unload(t);
+}
+SDL_Surface *Asset_Registry::surface(Texture t)
+{
+	if (t < 0 || t >= (Texture)slots.size()) return NULL;
+	return slots[t].surface;
+}
+long Asset_Registry::bytes(Texture t)
+{
+	if (t < 0 || t >= (Texture)slots.size() || slots[t].bytes < 0) return 0;
+	return slots[t].bytes;
+}
+const char *Asset_Registry::path(Texture t)
+{
+	if (t < 0 || t >= (Texture)slots.size()) return "";
+	return slots[t].path.c_str();
+}
+SDL_Surface *Asset_Registry::cooked(const char *name)
+{
+	if (pack == NULL) return NULL;
+	return pack->surface(name);
+}
+long Asset_Registry::resident()
+{
+	long total = 0;
+	for (int g = 0; g < ASSET_GROUPS; g++)
+	{
+		total += group_bytes[g];
 	}
-	else if (type == 4)
+	return total;
+}
+void Asset_Registry::reload()
+{
+	for (unsigned int i = 0; i < slots.size(); i++)
 	{
-
-		shipSize = 150;
-		type = 4;
-		max_shield = 200;
-		shield = 200;
-		health = 200;
-		speed =30;
-		damage = 10;
-		render = true;
-		spawn();
-		explosion.reset();
+		if (slots[i].refs > 0 && !slots[i].generated) unload((Texture)i);
 	}
-	else if (type == 5)
+	load_missing();
+}
+void Asset_Registry::queue_all(Asset_Loader &out)
+{
+	for (unsigned int i = 0; i < slots.size(); i++)
 	{
-
-		shipSize = 470;
-		type = 5;
-		max_shield = 2000 *(MAX_PLAYERS/10);
-		shield = 2000 *(MAX_PLAYERS/10);
-		speed = 20;
-		health = 2000 *(MAX_PLAYERS/10);
-		damage = 30;
-		render = true;
-		spawn();
-		explosion.reset();
+		if (!slots[i].generated) out.add(&slots[i].surface, slots[i].path, slots[i].group);
 	}
-
 }
-
-// Re-initialises variables to starting values
-void Ship::spawn()
+void Asset_Registry::clear()
 {
-	angle = 0;
-	rotate = 0;
-	moving = 0;
-	xVel = 0;
-	yVel = 0;
-	xDrift = 0;
-	yDrift = 0;
-	shoot = false;
-
-	box.w = shipSize;
-	box.h = shipSize; 
-	// both motherships have been placed
-	if (mothership[0].x > 0 && mothership[1].x > 0)
+	for (unsigned int i = 0; i < slots.size(); i++)
 	{
-		// if ship = 0 or 1
-		if (type < 2)
-		{
-			// Spawn near mothership
-			box.x = mothership[blue_mother].x + rand()%mothership[blue_mother].w/2;
-			box.y = mothership[blue_mother].y + rand()%mothership[blue_mother].w/2;
-		}
-		// if ship == 3 or 4
-		else if (type > 2 && type < 5)
-		{
-			box.x = mothership[red_mother].x + rand()%mothership[red_mother].w/2;
-			box.y = mothership[red_mother].y + rand()%mothership[red_mother].w/2;
-		}
-		// If ship = 2 or 5
-		else
-		{
-			// Spawn at rand
-			box.x =  rand()%15000;
-			while (box.x + box.w > LEVEL_WIDTH) 
-			{
-				box.x = rand()%15000;
-			}
-			
-			box.y =  rand()%15000;
-			while (box.y + box.h > LEVEL_HEIGHT)
-			{
-				box.y = rand()%15000;
-			}
-		}
-	}	
-	else
+		unload((Texture)i);
+	}
+	slots.clear();
+	handles.clear();
+}
+void Asset_Registry::report(FILE *out)
+{
+	loader.report(out);
+	int held[ASSET_GROUPS];
+	for (int g = 0; g < ASSET_GROUPS; g++)
 	{
-		// Spawn motherships at rand
-		box.x =  rand()%15000;
-		while (box.x + box.w > LEVEL_WIDTH) 
-		{
-			box.x = rand()%15000;
-		}
-		
-		box.y =  rand()%15000;
-		while (box.y + box.h > LEVEL_HEIGHT)
-		{
-			box.y = rand()%15000;
-		}
+		held[g] = 0;
 	}
-	circle.x = box.x + shipSize/2;
-	circle.y = box.y + shipSize/2;
-	circle.r = shipSize/2;
-	showShield = 0;
+	for (unsigned int i = 0; i < slots.size(); i++)
+	{
+		if (slots[i].surface != NULL) held[slots[i].group]++;
+	}
+	fprintf(out, "resident    textures      kB\n");
+	for (int g = 0; g < ASSET_GROUPS; g++)
+	{
+		fprintf(out, "%-12s  %6d  %6ld\n", ASSET_GROUP_NAMES[g], held[g], group_bytes[g] / 1024);
+	}
+	fprintf(out, "%ld kB in %d textures registered\n", resident() / 1024, (int)slots.size());
+	fflush(out);
+}
+
+// Every texture the game uses
+Asset_Registry assets;
+
+/********************************************* SPRITE CACHE *****************************************/
+/*
+ Textures are held in sets (each ship type's sprites, each explosion, the menu
+ and so on) that are only loaded the first time they are used, or when
+ prefetch is told a ship of that type is coming. When more than the budget is
+ resident, the sets used least recently let go of their textures, which the
+ registry frees unless another set still holds them. Sets used this frame are
+ still queued for drawing and are never let go; pinned sets (the HUD, planets,
+ background) are never let go. Nor are the sets held for the match being played
+ (its ships and their explosions, two motherships alone being over 50 MB), so
+ the budget only decides what else stays resident: the menu and earlier matches.
+ Sets of animation frames (ships, explosions, pods) are packed into one atlas
+ surface when they load, in rows tallest first, and their frames are drawn as
+ parts of it. The separate frames are let go once they are packed, so a set
+ costs one allocation and its blits all read from the same surface.
+ A frame can be another frame turned by some headings (see SPRITE ROTATION),
+ so ships and pods can face more headings than they have images for.
+*/
+const int SET_SHIPS = 0; // One set per ship type
+const int SET_EXPLOSIONS = 6; // One set per explosion
+const int SET_PODS = 9;
+const int SET_PLANETS = 10;
+const int SET_HUD = 11;
+const int SET_MENU = 12;
+const int SET_BACKGROUND = 13;
+const int SPRITE_SETS = 14;
+// Default budget for resident textures, in megabytes (-spritebudget sets it)
+const int SPRITE_BUDGET = 64;
+
+struct Sprite_Frame
+{
+	// Index of the set's texture the frame is drawn from, and how many headings it is turned clockwise
+	int source, turn;
+	// Where the frame is in the set's atlas
+	SDL_Rect place;
+	// The frame's own texture when the set isn't packed: its source, or a turned copy
+	Texture own;
+	// Size of the frame, known from the first time the set is loaded
+	int w, h;
+};
+
+struct Sprite_Set
+{
+	// Pinned for good, or held while the current match needs it
+	bool pinned, held, loaded;
+	// Frame the set was last used on
+	int last_used;
+	std::vector<Texture> textures;
+	// Asset group of the set's textures
+	int group;
+	// Whether the set is packed into an atlas, and the atlas while it is loaded
+	bool packed;
+	Texture atlas;
+	std::vector<Sprite_Frame> frames;
+	// Bytes the frames took as separate surfaces
+	long frame_bytes;
+};
+
+class Sprite_Cache
+{
+	private:
+	Sprite_Set sets[SPRITE_SETS];
+	long budget;
+	int frame;
+	int loads, evictions;
+	// False to draw packed sets from their separate frames (-noatlas)
+	bool atlases;
+	// Frames turned and the time spent turning them, and frames taken already turned from the pack
+	int turned;
+	double turn_ms;
+	int cooked;
 	
-	accelerating = 0;	
-	pod.set_team(type);	
+	void load(int set);
+	// The name a turned frame is stored under in a pack
+	std::string turned_name(int set, const Sprite_Frame &f);
+	// A turned frame from the pack, if it has one the frame's size
+	SDL_Surface *cooked_frame(int set, const Sprite_Frame &f, SDL_Surface *image);
+	void evict(int set);
+	// Packs a loaded set's frames into its atlas and lets go of them
+	bool build_atlas(int set);
+	// Gives each turned frame of a loaded set its own texture
+	bool build_frames(int set);
+	// Lets go of the least recently used sets until the budget is met
+	void trim();
+	
+	public:
+	Sprite_Cache();
+	// Sets the budget in bytes
+	void set_budget(long bytes);
+	// Registers a texture as part of a set and returns its handle
+	Texture add(int set, const char *path, int group, int alpha);
+	// Registers a texture, turned clockwise by a number of headings, as the next frame of a set that is packed into an atlas
+	Sprite add_frame(int set, const char *path, int group, int turn = 0);
+	void pin(int set);
+	// Keeps a set from being let go until it is no longer held
+	void hold(int set, bool on);
+	void use_atlases(bool on);
+	// Loads a set if it isn't resident and marks it used this frame. Returns false if it couldn't be loaded.
+	bool use(int set);
+	// Loads a set ahead of its first use
+	void prefetch(int set);
+	// Loads every pinned set
+	void load_pinned();
+	// Starts a new frame; sets used before it may be evicted
+	void next_frame();
+	// Queues a frame of a set to be drawn
+	void draw(int layer, int x, int y, const Sprite &sprite);
+	// Gets the size of a frame, returning false if its set has never been loaded
+	bool frame_size(const Sprite &sprite, int &w, int &h);
+	// Loads every held texture again and repacks the atlases
+	void reload();
+	// Lets go of every set
+	void clear();
+	// Queues every turned frame, for writing a pack
+	void queue_turned(Asset_Loader &out);
+	// Prints how many sets are loaded and how often sets were loaded and evicted
+	void report(FILE *out);
+};
 
+Sprite_Cache::Sprite_Cache()
+{
+	for (int i = 0; i < SPRITE_SETS; i++)
+	{
+		sets[i].pinned = false;
+		sets[i].held = false;
+		sets[i].loaded = false;
+		sets[i].last_used = -1;
+		sets[i].group = 0;
+		sets[i].packed = false;
+		sets[i].atlas = NO_TEXTURE;
+		sets[i].frame_bytes = 0;
+	}
+	budget = (long)SPRITE_BUDGET * 1024 * 1024;
+	frame = 0;
+	loads = 0;
+	evictions = 0;
+	atlases = true;
+	turned = 0;
+	turn_ms = 0;
+	cooked = 0;
 }
-int Ship::get_damage()
+void Sprite_Cache::set_budget(long bytes)
 {
-	return damage;
+	budget = bytes;
 }
-void Ship::set_camera()
+Texture Sprite_Cache::add(int set, const char *path, int group, int alpha)
 {
-
-	camera.x = ( box.x + box.w / 2 ) - SCREEN_WIDTH / 2;
-	camera.y = ( box.y + box.h / 2 ) - SCREEN_HEIGHT / 2;
-    
-    //Keep the camera in bounds.
-    if( camera.x < 0 )
-    {
-        camera.x = 0;    
-    }
-    if( camera.y < 0 )
-    {
-        camera.y = 0;    
-    }
-    if( camera.x > LEVEL_WIDTH - camera.w )
-    {
-        camera.x = LEVEL_WIDTH - camera.w;    
-    }
-    if( camera.y > LEVEL_HEIGHT - camera.h )
-    {
-        camera.y = LEVEL_HEIGHT - camera.h;    
-    }    
+	Texture t = assets.find(path, group, alpha);
+	sets[set].textures.push_back(t);
+	sets[set].group = group;
+	return t;
 }
-
-bool Ship::do_render()
+Sprite Sprite_Cache::add_frame(int set, const char *path, int group, int turn)
 {
-	if (render) return true;
-	else return false;
+	Sprite_Set &s = sets[set];
+	// Surface alpha belongs to the whole atlas, so frames are always opaque
+	Texture t = assets.find(path, group, -1);
+	Sprite_Frame f;
+	f.source = (int)(std::find(s.textures.begin(), s.textures.end(), t) - s.textures.begin());
+	if (f.source == (int)s.textures.size()) add(set, path, group, -1);
+	f.turn = turn % HEADINGS;
+	f.own = f.turn == 0 ? t : NO_TEXTURE;
+	f.w = 0;
+	f.h = 0;
+	s.frames.push_back(f);
+	s.packed = true;
+	
+	Sprite sprite;
+	sprite.set = set;
+	sprite.frame = (int)s.frames.size() - 1;
+	return sprite;
 }
-
-int Ship::get_type()
+void Sprite_Cache::pin(int set)
 {
-	return type;
+	sets[set].pinned = true;
 }
-
-void Ship::handle_input( SDL_Event &event )
+void Sprite_Cache::hold(int set, bool on)
 {
-	
-    //If a key was pressed
-    if( event.type == SDL_KEYDOWN && render)
-    {
-        switch( event.key.keysym.sym )
-        {
-			// If up, move in current direction
-            case SDLK_UP: 
-			moving = 1;
-			break;
-			
-			// If left, begin rotating anti-clockwise
-            case SDLK_LEFT:
-			rotate = -1;
-			break;
-
-			// If right, begin rotating clockwise
-            case SDLK_RIGHT:
-			rotate = 1;
-			break;    
-			
-			// If down, decelerate ship
-			case SDLK_DOWN:
-			breaking = 1;
-			break;
-
-			// If spacebar is pressed, fire a shot in the direction the ship is currently facing
-			case SDLK_SPACE:
-			shoot = true;
-			break;
-
-			default: break;
-        }
-    }
-    //If a key was released
-    else if( event.type == SDL_KEYUP && render)
-    {
-        switch( event.key.keysym.sym )
-        {
-			// If up, stop moving and begin drifting
-			case SDLK_UP: 
-			moving = 0;
-			yDrift += yVel;
-			xDrift += xVel;
-			yVel = 0;
-			xVel = 0;
-			accelerating = 0;
-			break;
-			
-			// If left, stop rotating
-			case SDLK_LEFT:
-			rotate = 0;
-			break;
-			
-			// If right, stop rotating
-			case SDLK_RIGHT:
-			rotate = 0;
-			break;
-			
-			// If down, stop breaking
-			case SDLK_DOWN:
-			breaking = 0;
-			break;
-			
-			// If space, stop shooting
-			case SDLK_SPACE:
-			shoot = false;
-			break;
-			
-			default: break;
-        }
-    }
+	sets[set].held = on;
 }
-
-void Ship::move(Planet planets[], Ship players[])
+void Sprite_Cache::use_atlases(bool on)
 {
-	// If ai is active, switch to AI move
-	if(ai){ai_move(planets, players);}
+	atlases = on;
+}
+void Sprite_Cache::load(int set)
+{
+	Sprite_Set &s = sets[set];
+	assets.acquire(s.textures);
+	// Turning a frame keeps its size
+	for (unsigned int i = 0; i < s.frames.size(); i++)
+	{
+		SDL_Surface *image = assets.surface(s.textures[s.frames[i].source]);
+		if (image == NULL) continue;
+		s.frames[i].w = image->w;
+		s.frames[i].h = image->h;
+	}
+	if (sets[set].packed && atlases && !build_atlas(set))
+	{
+		fprintf(stderr, "Couldn't pack sprite set %d, drawing its frames separately\n", set);
+	}
+	if (sets[set].packed && sets[set].atlas == NO_TEXTURE) build_frames(set);
+	// A set that failed to load is still marked loaded, so it isn't retried every frame
+	sets[set].loaded = true;
+	loads++;
+}
+void Sprite_Cache::evict(int set)
+{
+	Sprite_Set &s = sets[set];
+	if (s.atlas != NO_TEXTURE) assets.release(s.atlas);
 	else
 	{
-		// If ship is revealed, decrement time to be revealed
-		if (reveal > 0)
-		{
-			reveal --;
-		}
-		// Recharge shield if necessary
-		if (type == 2 || type == 5) recharge = 1;
-		if (recharge == 1)
+		assets.release(s.textures);
+		for (unsigned int i = 0; i < s.frames.size(); i++)
 		{
-			if (shield < max_shield) shield ++;
-			recharge = 0;
+			if (s.frames[i].turn == 0) continue;
+			assets.release(s.frames[i].own);
+			s.frames[i].own = NO_TEXTURE;
 		}
-		
-		// Update angle
-		if (rotate == -1)
+	}
+	s.atlas = NO_TEXTURE;
+	s.loaded = false;
+	evictions++;
+}
+bool Sprite_Cache::build_atlas(int set)
+{
+	Sprite_Set &s = sets[set];
+	if (s.frames.empty()) return false;
+	
+	// Rows about as wide as the atlas is tall, frames placed tallest first so each row wastes little
+	std::vector<SDL_Surface*> images;
+	std::vector<std::pair<int, int> > order;
+	long area = 0;
+	int width = 0;
+	s.frame_bytes = 0;
+	for (unsigned int i = 0; i < s.frames.size(); i++)
+	{
+		SDL_Surface *image = assets.surface(s.textures[s.frames[i].source]);
+		if (image == NULL) return false;
+		images.push_back(image);
+		order.push_back(std::make_pair(-image->h, (int)i));
+		area += (long)image->w * image->h;
+		width = std::max(width, image->w);
+		s.frame_bytes += (long)image->pitch * image->h;
+	}
+	width = std::max(width, (int)sqrt((double)area));
+	std::sort(order.begin(), order.end());
+	
+	int x = 0, y = 0, row_height = 0, used = 0;
+	for (unsigned int k = 0; k < order.size(); k++)
+	{
+		SDL_Surface *image = images[order[k].second];
+		if (x + image->w > width)
 		{
-			if (angle-1 > -1) angle -= 1;
-			else angle = 15;
+			x = 0;
+			y += row_height;
+			row_height = 0;
 		}
-		if (rotate == 1)
-		{
-			if (angle+1 < 16) angle += 1;
-			else angle = 0;
-		}	
-		
-		// Record current heading of ship and velocities
-		float rad = (float)0.39269908169872414 * ((angle+1) - 5);
-		if (accelerating < speed && moving == 1) accelerating ++;
-		lastX = (int)(cos(rad) * accelerating);
-		lastY = (int)(sin(rad) * accelerating); 
-		
-		// Shoot if pressed
-		if (shoot)
+		SDL_Rect &place = s.frames[order[k].second].place;
+		place.x = x;
+		place.y = y;
+		place.w = image->w;
+		place.h = image->h;
+		x += image->w;
+		used = std::max(used, x);
+		row_height = std::max(row_height, image->h);
+	}
+	width = used;
+	int height = y + row_height;
+	// Blits take 16 bit coordinates
+	if (width > 32767 || height > 32767) return false;
+	
+	SDL_PixelFormat *format = images[0]->format;
+	SDL_Surface *sheet = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, format->BitsPerPixel, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+	if (sheet == NULL) return false;
+	// Gaps between frames are the colour key, like the transparent parts of the frames
+	Uint32 key = SDL_MapRGB(sheet->format, 255, 0, 255);
+	SDL_FillRect(sheet, NULL, key);
+	SDL_SetColorKey(sheet, SDL_SRCCOLORKEY, key);
+	double start = precise_ticks();
+	for (unsigned int i = 0; i < s.frames.size(); i++)
+	{
+		Sprite_Frame &f = s.frames[i];
+		SDL_Surface *ready = f.turn != 0 ? cooked_frame(set, f, images[i]) : NULL;
+		if (ready != NULL)
 		{
-			int projX = (int)(cos(rad) * 30);
-			int projY = (int)(sin(rad) * 30); 
-			if (!proj.active()) proj.shoot(box.x + (shipSize/2), box.y + (shipSize/2), projX, projY); 
+			// Copied with its colour key pixels, which are the gaps' colour
+			SDL_SetColorKey(ready, 0, 0);
+			SDL_Rect place = f.place;
+			SDL_BlitSurface(ready, NULL, sheet, &place);
+			SDL_FreeSurface(ready);
+			cooked++;
+			continue;
 		}
-		// Slow ship if breaking
-		if (breaking == 1)
+		if (f.turn != 0)
 		{
-			xVel = 0;
-			yVel = 0;
-			xDrift -= xDrift / 10;
-			yDrift -= yDrift / 10;
+			rotate_image(images[i], f.turn, sheet, f.place);
+			turned++;
+			continue;
 		}
-		// Move forward if player is pressing 'up'
-		if (moving == 1)
+		SDL_Rect place = f.place;
+		SDL_BlitSurface(images[i], NULL, sheet, &place);
+	}
+	turn_ms += precise_ticks() - start;
+	SDL_SetColorKey(sheet, SDL_RLEACCEL | SDL_SRCCOLORKEY, key);
+	
+	char name[32];
+	sprintf(name, "atlas %d", set);
+	s.atlas = assets.adopt(name, s.group, sheet);
+	assets.release(s.textures);
+	return true;
+}
+bool Sprite_Cache::build_frames(int set)
+{
+	Sprite_Set &s = sets[set];
+	bool ok = true;
+	for (unsigned int i = 0; i < s.frames.size(); i++)
+	{
+		Sprite_Frame &f = s.frames[i];
+		if (f.turn == 0) continue;
+		SDL_Surface *image = assets.surface(s.textures[f.source]);
+		if (image == NULL)
 		{
-			xVel = lastX;
-			yVel = lastY;
-			// Cancel drift as quickly as acceleration is being applied to prevent 'boost'
-			if (xDrift == 0.0){}
-			else if (xDrift < 0.0) xDrift ++;
-			else xDrift --;
-			if (yDrift == 0.0){}
-			else if (yDrift < 0.0) yDrift ++;
-			else yDrift --;
+			ok = false;
+			continue;
 		}
-		else
+		char name[32];
+		sprintf(name, "frame %d.%d", set, (int)i);
+		SDL_Surface *ready = cooked_frame(set, f, image);
+		if (ready != NULL)
 		{
-			// Calculate and apply drift
-			if (xDrift == 0.0){}
-			else if (xDrift < 0.0) xDrift += 0.2;
-			else xDrift -= 0.2;
-			if (yDrift == 0.0){}
-			else if (yDrift < 0.0) yDrift += 0.2;
-			else yDrift -= 0.2;
-		}
-		//If the Ship will go off the universe by moving in any direction, dont move in that direction
-		if ((box.x + xVel + xDrift) < 0 || (box.x + xVel + xDrift + box.w) > LEVEL_WIDTH){}
-		else 
-		{	
-			box.x += xVel + (Sint16)xDrift;
-			circle.x = box.x + shipSize/2;
-
+			f.own = assets.adopt(name, s.group, ready);
+			cooked++;
+			continue;
 		}
-		if ((box.y + yVel + yDrift) < 0 || (box.y + yVel + yDrift + box.h) > LEVEL_HEIGHT){}
-		else 
+		SDL_PixelFormat *format = image->format;
+		SDL_Surface *copy = SDL_CreateRGBSurface(SDL_SWSURFACE, image->w, image->h, format->BitsPerPixel, format->Rmask, format->Gmask, format->Bmask, format->Amask);
+		if (copy == NULL)
 		{
-			box.y += yVel + (Sint16)yDrift;
-			circle.y = box.y + shipSize/2;
-
+			ok = false;
+			continue;
 		}
+		Uint32 key = SDL_MapRGB(copy->format, 255, 0, 255);
+		SDL_SetColorKey(copy, SDL_SRCCOLORKEY, key);
+		SDL_Rect place = { 0, 0, (Uint16)image->w, (Uint16)image->h };
+		double start = precise_ticks();
+		rotate_image(image, f.turn, copy, place);
+		turn_ms += precise_ticks() - start;
+		turned++;
+		SDL_SetColorKey(copy, SDL_RLEACCEL | SDL_SRCCOLORKEY, key);
+		f.own = assets.adopt(name, s.group, copy);
 	}
-	
+	return ok;
+}
+std::string Sprite_Cache::turned_name(int set, const Sprite_Frame &f)
+{
+	// The heading count is part of the name, so a pack cooked for another count isn't used
+	char name[256];
+	sprintf(name, "%.200s turned %d/%d", assets.path(sets[set].textures[f.source]), f.turn, HEADINGS);
+	return name;
+}
+SDL_Surface *Sprite_Cache::cooked_frame(int set, const Sprite_Frame &f, SDL_Surface *image)
+{
+	SDL_Surface *ready = assets.cooked(turned_name(set, f).c_str());
+	if (ready != NULL && (ready->w != image->w || ready->h != image->h))
+	{
+		SDL_FreeSurface(ready);
+		return NULL;
+	}
+	return ready;
+}
+void Sprite_Cache::queue_turned(Asset_Loader &out)
+{
+	for (int i = 0; i < SPRITE_SETS; i++)
+	{
+		for (unsigned int k = 0; k < sets[i].frames.size(); k++)
+		{
+			Sprite_Frame &f = sets[i].frames[k];
+			if (f.turn == 0) continue;
+			out.add_turned(assets.path(sets[i].textures[f.source]), f.turn, turned_name(i, f));
+		}
+	}
+}
+void Sprite_Cache::trim()
+{
+	while (assets.resident() > budget)
+	{
+		int oldest = -1;
+		for (int i = 0; i < SPRITE_SETS; i++)
+		{
+			Sprite_Set &s = sets[i];
+			if (!s.loaded || s.pinned || s.held || s.last_used >= frame) continue;
+			if (oldest < 0 || s.last_used < sets[oldest].last_used) oldest = i;
+		}
+		if (oldest < 0) return;
+		evict(oldest);
+	}
+}
+bool Sprite_Cache::use(int set)
+{
+	Sprite_Set &s = sets[set];
+	s.last_used = frame;
+	if (!s.loaded)
+	{
+		load(set);
+		trim();
+	}
+	if (s.atlas != NO_TEXTURE) return true;
+	return !s.textures.empty() && assets.surface(s.textures[0]) != NULL;
+}
+void Sprite_Cache::prefetch(int set)
+{
+	if (sets[set].loaded) return;
+	load(set);
+	// Count it as used now so the budget doesn't throw it straight back out
+	sets[set].last_used = frame;
+	trim();
+}
+void Sprite_Cache::load_pinned()
+{
+	for (int i = 0; i < SPRITE_SETS; i++)
+	{
+		if (sets[i].pinned && !sets[i].loaded) load(i);
+	}
+}
+void Sprite_Cache::next_frame()
+{
+	frame++;
+}
+void Sprite_Cache::draw(int layer, int x, int y, const Sprite &sprite)
+{
+	Sprite_Set &s = sets[sprite.set];
+	Sprite_Frame &f = s.frames[sprite.frame];
+	if (s.atlas != NO_TEXTURE) render_queue.add(layer, x, y, assets.surface(s.atlas), f.place);
+	else render_queue.add(layer, x, y, assets.surface(f.own));
+}
+bool Sprite_Cache::frame_size(const Sprite &sprite, int &w, int &h)
+{
+	Sprite_Frame &f = sets[sprite.set].frames[sprite.frame];
+	if (f.w == 0) return false;
+	w = f.w;
+	h = f.h;
+	return true;
+}
+void Sprite_Cache::reload()
+{
+	assets.reload();
+	// Atlases and turned frames are made from the files, so make them again
+	for (int i = 0; i < SPRITE_SETS; i++)
+	{
+		if (!sets[i].packed || !sets[i].loaded) continue;
+		evict(i);
+		load(i);
+	}
+}
+void Sprite_Cache::clear()
+{
+	for (int i = 0; i < SPRITE_SETS; i++)
+	{
+		if (sets[i].loaded) evict(i);
+	}
+}
+void Sprite_Cache::report(FILE *out)
+{
+	int loaded = 0, packed = 0;
+	long atlas_bytes = 0, frame_bytes = 0;
+	for (int i = 0; i < SPRITE_SETS; i++)
+	{
+		if (sets[i].loaded) loaded++;
+		if (sets[i].atlas == NO_TEXTURE) continue;
+		packed++;
+		atlas_bytes += assets.bytes(sets[i].atlas);
+		frame_bytes += sets[i].frame_bytes;
+	}
+	fprintf(out, "sprite sets: %d of %d loaded, textures %ld of %ld kB, %d loads, %d evictions\n", loaded, SPRITE_SETS, assets.resident() / 1024, budget / 1024, loads, evictions);
+	if (packed > 0) fprintf(out, "atlases: %d sets in %ld kB, %ld kB as separate frames\n", packed, atlas_bytes / 1024, frame_bytes / 1024);
+#ifdef ROTATE_SSE2
+	const char *rotator = "SSE2";
+#else
+	const char *rotator = "scalar";
+#endif
+	if (turned > 0) fprintf(out, "turned %d frames (%d headings, %s) in %.2f ms, %.3f ms each\n", turned, HEADINGS, rotator, turn_ms, turn_ms / turned);
+	if (cooked > 0) fprintf(out, "took %d turned frames from the pack\n", cooked);
+	fflush(out);
+}
+
+// Every texture the game draws, loaded as it is needed
+Sprite_Cache sprites;
+
+/************************************ TILEMAP CLASS ****************************************/
+/*
+ The level's background tiles. A map file holds a header page naming the image
+ of each tile type, then the tile types in chunks of CHUNK_TILES x CHUNK_TILES,
+ one byte per tile, so each chunk fills exactly one page:
+
+   "CMAP", version, columns, rows, types, then types x MAP_NAME image paths
+   chunk 0, chunk 1, ... in row order, each chunk's tiles in row order
+
+ The file is memory mapped rather than read, so opening a map costs the same
+ however big it is. Chunks near the camera or a ship are asked for ahead of
+ use and the rest are given back, so only those stay resident.
+ The tiles form a regular grid, so the ones in view are worked out from the
+ camera instead of testing every tile.
+*/
+const int CHUNK_TILES = 64;
+const int CHUNK_BYTES = CHUNK_TILES * CHUNK_TILES;
+const int MAP_PAGE = 4096;
+const int MAP_NAME = 64;
+const int MAP_MAX_TYPES = 32;
+const int MAP_VERSION = 1;
+
+struct Map_Header
+{
+	char magic[4];
+	int version;
+	int columns, rows;
+	int types;
+};
+
+class Tilemap
+{
+	private:
+	int columns, rows;
+	// Chunks in each row of chunks
+	int chunks_across;
+	// Image of each tile type, each holding a reference in the registry
+	std::vector<Texture> images;
+	// The mapped file (or a copy in memory), and where its chunks start
+	Uint8 *base;
+	long size;
+	bool mapped;
+	std::vector<Uint8> memory;
+	// Chunks currently asked to be resident, in order
+	std::vector<int> resident;
+	
+	void close();
+	// Hints that a chunk is about to be used or is no longer needed
+	void advise(int chunk, bool needed);
+	
+	public:
+	Tilemap();
+	~Tilemap();
+	// Lays out a grid of tiles showing the same image
+	bool create(int columns, int rows, Texture image);
+	// Maps a map file and loads its tile images
+	bool open(const char *name);
+	// Writes a map whose tiles are picked from the given images by a hash of their position
+	static bool write(const char *name, int columns, int rows, std::vector<const char*> &names);
+	// Tile type at a column and row
+	int type_at(int column, int row);
+	// Range of tiles (inclusive) that overlap an area, false if there are none
+	bool visible(SDL_Rect &area, int &x1, int &y1, int &x2, int &y2);
+	// Keeps the chunks under these areas resident and lets the rest go
+	void page(std::vector<SDL_Rect> &areas);
+	// Draws an area of the level onto a surface, its top left corner at x, y
+	void draw( SDL_Surface *target, SDL_Rect area, int x, int y );
+};
+
+Tilemap::Tilemap()
+{
+	columns = 0;
+	rows = 0;
+	chunks_across = 0;
+	base = NULL;
+	size = 0;
+	mapped = false;
+}
+Tilemap::~Tilemap()
+{
+	close();
+}
+void Tilemap::close()
+{
+	if (mapped)
+	{
+#ifdef WIN32
+		UnmapViewOfFile(base);
+#else
+		munmap(base, size);
+#endif
+	}
+	assets.release(images);
+	images.clear();
+	memory.clear();
+	resident.clear();
+	base = NULL;
+	mapped = false;
+}
+bool Tilemap::create(int c, int r, Texture image)
+{
+	close();
+	assets.acquire(image);
+	if (assets.surface(image) == NULL)
+	{
+		assets.release(image);
+		return false;
+	}
+	columns = c;
+	rows = r;
+	chunks_across = (columns + CHUNK_TILES - 1) / CHUNK_TILES;
+	int chunks = chunks_across * ((rows + CHUNK_TILES - 1) / CHUNK_TILES);
+	memory.assign(MAP_PAGE + chunks * CHUNK_BYTES, 0);
+	base = &memory[0];
+	size = (long)memory.size();
+	images.push_back(image);
+	return true;
+}
+bool Tilemap::open(const char *name)
+{
+	close();
+#ifdef WIN32
+	HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	size = (long)GetFileSize(file, NULL);
+	if (size < MAP_PAGE)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL) return false;
+	base = (Uint8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (base == NULL) return false;
+#else
+	int file = ::open(name, O_RDONLY);
+	if (file < 0) return false;
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size < MAP_PAGE)
+	{
+		::close(file);
+		return false;
+	}
+	size = (long)info.st_size;
+	void *view = mmap(NULL, size, PROT_READ, MAP_SHARED, file, 0);
+	::close(file);
+	if (view == MAP_FAILED) return false;
+	base = (Uint8*)view;
+#endif
+	mapped = true;
+	
+	// Check the header and that every chunk it describes is in the file
+	Map_Header header;
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, "CMAP", 4) != 0 || header.version != MAP_VERSION || header.columns <= 0 || header.rows <= 0 || header.types <= 0 || header.types > MAP_MAX_TYPES)
+	{
+		close();
+		return false;
+	}
+	columns = header.columns;
+	rows = header.rows;
+	chunks_across = (columns + CHUNK_TILES - 1) / CHUNK_TILES;
+	long chunks = (long)chunks_across * ((rows + CHUNK_TILES - 1) / CHUNK_TILES);
+	if (size < MAP_PAGE + chunks * CHUNK_BYTES)
+	{
+		close();
+		return false;
+	}
+	
+	for (int i = 0; i < header.types; i++)
+	{
+		char path[MAP_NAME + 1];
+		memcpy(path, base + sizeof(header) + i * MAP_NAME, MAP_NAME);
+		path[MAP_NAME] = 0;
+		images.push_back(assets.find(path, ASSET_BACKGROUND, -1));
+	}
+	assets.acquire(images);
+	for (unsigned int i = 0; i < images.size(); i++)
+	{
+		if (assets.surface(images[i]) == NULL)
+		{
+			close();
+			return false;
+		}
+	}
+	return true;
+}
+bool Tilemap::write(const char *name, int columns, int rows, std::vector<const char*> &names)
+{
+	if (columns <= 0 || rows <= 0 || names.empty() || (int)names.size() > MAP_MAX_TYPES) return false;
+	FILE *file = fopen(name, "wb");
+	if (file == NULL) return false;
+	
+	std::vector<char> page(MAP_PAGE, 0);
+	Map_Header header;
+	memcpy(header.magic, "CMAP", 4);
+	header.version = MAP_VERSION;
+	header.columns = columns;
+	header.rows = rows;
+	header.types = (int)names.size();
+	memcpy(&page[0], &header, sizeof(header));
+	for (unsigned int i = 0; i < names.size(); i++)
+	{
+		strncpy(&page[sizeof(header) + i * MAP_NAME], names[i], MAP_NAME);
+	}
+	fwrite(&page[0], 1, MAP_PAGE, file);
+	
+	// One chunk at a time, so writing a huge map needs no more memory than a small one
+	int across = (columns + CHUNK_TILES - 1) / CHUNK_TILES;
+	int down = (rows + CHUNK_TILES - 1) / CHUNK_TILES;
+	for (int chunk_y = 0; chunk_y < down; chunk_y++)
+	{
+		for (int chunk_x = 0; chunk_x < across; chunk_x++)
+		{
+			for (int i = 0; i < CHUNK_BYTES; i++)
+			{
+				int column = chunk_x * CHUNK_TILES + i % CHUNK_TILES;
+				int row = chunk_y * CHUNK_TILES + i / CHUNK_TILES;
+				Uint32 h = hash_int(hash_int(2166136261u, column), row);
+				page[i] = 0;
+				if (column < columns && row < rows) page[i] = (char)(h % names.size());
+			}
+			fwrite(&page[0], 1, CHUNK_BYTES, file);
+		}
+	}
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	return ok;
+}
+int Tilemap::type_at(int column, int row)
+{
+	int chunk = (row / CHUNK_TILES) * chunks_across + column / CHUNK_TILES;
+	int type = base[MAP_PAGE + chunk * CHUNK_BYTES + (row % CHUNK_TILES) * CHUNK_TILES + column % CHUNK_TILES];
+	if (type >= (int)images.size()) return 0;
+	return type;
+}
+bool Tilemap::visible(SDL_Rect &area, int &x1, int &y1, int &x2, int &y2)
+{
+	x1 = std::max(0, (int)area.x / TILE_WIDTH);
+	y1 = std::max(0, (int)area.y / TILE_HEIGHT);
+	x2 = std::min(columns - 1, (area.x + area.w - 1) / TILE_WIDTH);
+	y2 = std::min(rows - 1, (area.y + area.h - 1) / TILE_HEIGHT);
+	return x1 <= x2 && y1 <= y2;
+}
+void Tilemap::advise(int chunk, bool needed)
+{
+#ifndef WIN32
+	// Maps held in memory are always resident
+	if (!mapped) return;
+	madvise(base + MAP_PAGE + chunk * CHUNK_BYTES, CHUNK_BYTES, needed ? MADV_WILLNEED : MADV_DONTNEED);
+#endif
+}
+void Tilemap::page(std::vector<SDL_Rect> &areas)
+{
+	std::vector<int> wanted;
+	for (unsigned int a = 0; a < areas.size(); a++)
+	{
+		int x1, y1, x2, y2;
+		if (!visible(areas[a], x1, y1, x2, y2)) continue;
+		for (int chunk_y = y1 / CHUNK_TILES; chunk_y <= y2 / CHUNK_TILES; chunk_y++)
+		{
+			for (int chunk_x = x1 / CHUNK_TILES; chunk_x <= x2 / CHUNK_TILES; chunk_x++)
+			{
+				wanted.push_back(chunk_y * chunks_across + chunk_x);
+			}
+		}
+	}
+	std::sort(wanted.begin(), wanted.end());
+	wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+	
+	// Both lists are sorted, so walk them together
+	unsigned int w = 0, r = 0;
+	while (w < wanted.size() || r < resident.size())
+	{
+		if (r == resident.size() || (w < wanted.size() && wanted[w] < resident[r])) advise(wanted[w++], true);
+		else if (w == wanted.size() || resident[r] < wanted[w]) advise(resident[r++], false);
+		else
+		{
+			w++;
+			r++;
+		}
+	}
+	resident.swap(wanted);
+}
+void Tilemap::draw( SDL_Surface *target, SDL_Rect area, int x, int y )
+{
+	int x1, y1, x2, y2;
+	if (!visible(area, x1, y1, x2, y2)) return;
+	for (int row = y1; row <= y2; row++)
+	{
+		for (int column = x1; column <= x2; column++)
+		{
+			apply_surface(column * TILE_WIDTH - area.x + x, row * TILE_HEIGHT - area.y + y, assets.surface(images[type_at(column, row)]), target);
+		}
+	}
+}
+
+/*********************************** BACKGROUND LAYER CLASS ***************************************/
+/*
+ A screen-sized picture of one background layer kept between frames. When the
+ camera scrolls, the picture is shifted and only the strips that came into view
+ are painted; while the camera is still nothing is painted at all. Each layer
+ scrolls at its own percentage of the camera's speed to give parallax.
+ The layers are composited into one picture, which is only done again when one
+ of them changed, and that picture is the render queue's backdrop.
+*/
+
+// Paints an area of a layer (in layer coordinates) onto a surface with its top left corner at x, y
+typedef void (*Layer_Painter)(void *source, SDL_Surface *target, SDL_Rect area, int x, int y);
+
+class Background_Layer
+{
+	private:
+	// The picture, and a second surface to shift it into
+	SDL_Surface *cache, *spare;
+	Layer_Painter painter;
+	void *source;
+	// Percentage of the camera's movement the layer follows
+	int speed;
+	// Colour left see-through on layers drawn over others
+	bool keyed;
+	Uint32 key;
+	// Layer coordinates of the cached picture
+	int view_x, view_y;
+	bool valid;
+	
+	// Paints part of the picture afresh
+	void paint(SDL_Surface *target, int x, int y, int w, int h);
+	
+	public:
+	Background_Layer();
+	~Background_Layer();
+	bool create(Layer_Painter p, void *data, int scroll_speed, bool see_through);
+	// Forces the whole layer to be painted again on the next frame
+	void invalidate();
+	// Brings the picture up to date with the camera, returning whether it changed
+	bool update();
+	SDL_Surface *get_picture();
+};
+
+Background_Layer::Background_Layer()
+{
+	cache = NULL;
+	spare = NULL;
+	painter = NULL;
+	source = NULL;
+	speed = 100;
+	keyed = false;
+	key = 0;
+	view_x = 0;
+	view_y = 0;
+	valid = false;
+}
+Background_Layer::~Background_Layer()
+{
+	SDL_FreeSurface(cache);
+	SDL_FreeSurface(spare);
+}
+bool Background_Layer::create(Layer_Painter p, void *data, int scroll_speed, bool see_through)
+{
+	painter = p;
+	source = data;
+	speed = scroll_speed;
+	keyed = see_through;
+	
+	SDL_Surface *surfaces[2];
+	for (int i = 0; i < 2; i++)
+	{
+		SDL_Surface *temp = SDL_CreateRGBSurface(SDL_SWSURFACE, screen_width, screen_height, screen_bpp, 0, 0, 0, 0);
+		if (temp == NULL) return false;
+		surfaces[i] = SDL_DisplayFormat(temp);
+		SDL_FreeSurface(temp);
+		if (surfaces[i] == NULL) return false;
+	}
+	cache = surfaces[0];
+	spare = surfaces[1];
+	if (keyed)
+	{
+		key = SDL_MapRGB(cache->format, 0xFF, 0, 0xFF);
+		SDL_SetColorKey(cache, SDL_SRCCOLORKEY, key);
+		SDL_SetColorKey(spare, SDL_SRCCOLORKEY, key);
+	}
+	valid = false;
+	return true;
+}
+void Background_Layer::invalidate()
+{
+	valid = false;
+}
+void Background_Layer::paint(SDL_Surface *target, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0) return;
+	SDL_Rect clip = { (Sint16)x, (Sint16)y, (Uint16)w, (Uint16)h };
+	SDL_SetClipRect(target, &clip);
+	if (keyed) SDL_FillRect(target, &clip, key);
+	SDL_Rect area = { (Sint16)(view_x + x), (Sint16)(view_y + y), (Uint16)w, (Uint16)h };
+	painter(source, target, area, x, y);
+	SDL_SetClipRect(target, NULL);
+}
+bool Background_Layer::update()
+{
+	if (cache == NULL) return false;
+	int x = camera.x * speed / 100;
+	int y = camera.y * speed / 100;
+	int dx = x - view_x;
+	int dy = y - view_y;
+	
+	if (!valid || abs(dx) >= screen_width || abs(dy) >= screen_height)
+	{
+		view_x = x;
+		view_y = y;
+		paint(cache, 0, 0, screen_width, screen_height);
+		valid = true;
+		return true;
+	}
+	else if (dx != 0 || dy != 0)
+	{
+		// Move what is still in view, then paint the strips that came into view
+		if (keyed) SDL_SetColorKey(cache, 0, key);
+		SDL_Rect offset = { (Sint16)-dx, (Sint16)-dy, 0, 0 };
+		SDL_BlitSurface(cache, NULL, spare, &offset);
+		if (keyed) SDL_SetColorKey(cache, SDL_SRCCOLORKEY, key);
+		view_x = x;
+		view_y = y;
+		if (dx > 0) paint(spare, screen_width - dx, 0, dx, screen_height);
+		else paint(spare, 0, 0, -dx, screen_height);
+		if (dy > 0) paint(spare, 0, screen_height - dy, screen_width, dy);
+		else paint(spare, 0, 0, screen_width, -dy);
+		
+		SDL_Surface *temp = cache;
+		cache = spare;
+		spare = temp;
+		return true;
+	}
+	return false;
+}
+SDL_Surface *Background_Layer::get_picture()
+{
+	return cache;
+}
+
+const int MAX_BACKGROUND_LAYERS = 4;
+
+// The background layers, bottom first, composited into one picture
+class Background
+{
+	private:
+	Background_Layer layers[MAX_BACKGROUND_LAYERS];
+	int count;
+	SDL_Surface *picture;
+	
+	public:
+	Background();
+	~Background();
+	// Adds a layer over the ones added before, which is see-through unless it's the first
+	bool add_layer(Layer_Painter p, void *data, int scroll_speed);
+	// Composites the layers again if any of them changed, and makes the picture the backdrop
+	void show();
+};
+
+Background::Background()
+{
+	count = 0;
+	picture = NULL;
+}
+Background::~Background()
+{
+	SDL_FreeSurface(picture);
+}
+bool Background::add_layer(Layer_Painter p, void *data, int scroll_speed)
+{
+	if (count == MAX_BACKGROUND_LAYERS) return false;
+	if (picture == NULL)
+	{
+		SDL_Surface *temp = SDL_CreateRGBSurface(SDL_SWSURFACE, screen_width, screen_height, screen_bpp, 0, 0, 0, 0);
+		if (temp == NULL) return false;
+		picture = SDL_DisplayFormat(temp);
+		SDL_FreeSurface(temp);
+		if (picture == NULL) return false;
+	}
+	if (!layers[count].create(p, data, scroll_speed, count > 0)) return false;
+	count++;
+	return true;
+}
+void Background::show()
+{
+	bool changed = false;
+	for (int i = 0; i < count; i++)
+	{
+		if (layers[i].update()) changed = true;
+	}
+	if (changed)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			apply_surface(0, 0, layers[i].get_picture(), picture);
+		}
+		render_queue.redraw(picture);
+	}
+	render_queue.set_backdrop(picture);
+}
+
+// Layer painter for the level's tiles
+void paint_tiles(void *source, SDL_Surface *target, SDL_Rect area, int x, int y)
+{
+	((Tilemap*)source)->draw(target, area, x, y);
+}
+
+// Layer painter for a star field. Each STAR_CELL square of the layer holds
+// one star whose place and brightness come from hashing the square's position.
+const int STAR_CELL = 96;
+void paint_stars(void *, SDL_Surface *target, SDL_Rect area, int x, int y)
+{
+	int x1 = area.x / STAR_CELL;
+	int y1 = area.y / STAR_CELL;
+	int x2 = (area.x + area.w - 1) / STAR_CELL;
+	int y2 = (area.y + area.h - 1) / STAR_CELL;
+	for (int row = y1; row <= y2; row++)
+	{
+		for (int column = x1; column <= x2; column++)
+		{
+			Uint32 h = hash_int(hash_int(2166136261u, column), row);
+			Uint8 shade = 96 + (h >> 24) % 128;
+			SDL_Rect star;
+			star.x = column * STAR_CELL + h % STAR_CELL - area.x + x;
+			star.y = row * STAR_CELL + (h >> 8) % STAR_CELL - area.y + y;
+			star.w = 1 + (h >> 16) % 2;
+			star.h = star.w;
+			SDL_FillRect(target, &star, SDL_MapRGB(target->format, shade, shade, shade));
+		}
+	}
+}
+
+
+
+
+
+
+/********************************************** PLANET CLASS **************************************/
+/*
+ * Defines the planets used in the game
+*/
+class Planet
+{
+	private:
+	//Holds coordinates and dimensions of the collision box
+	SDL_Rect box;
+	Circle circle;
+	//Number of resource points remaining
+	int capture_time;
+	// Type of planet
+	int type;
+	
+	int owner;
+	// X and Y Velocity
+	int red_team, blue_team;
+	
+	public:
+	Planet();
+	// Displays planet on screen
+	void show();
+	void create(int type, int x, int y);
+	void capture(int strength, int team);
+	void init(int i);
+	int get_owner();
+	SDL_Rect get_coords();
+	Circle get_circle();
+	// Folds the planet's state into a hash
+	Uint32 hash(Uint32 h);
+};
+
+Planet::Planet()
+{
+}
+
+int Planet::get_owner()
+{
+	return owner;
+}
+SDL_Rect Planet::get_coords()
+{
+	return box;
+}
+Circle Planet::get_circle()
+{
+	return circle;
+}
+Uint32 Planet::hash(Uint32 h)
+{
+	h = hash_int(h, type);
+	h = hash_int(h, box.x);
+	h = hash_int(h, box.y);
+	h = hash_int(h, owner);
+	h = hash_int(h, red_team);
+	h = hash_int(h, blue_team);
+	return h;
+}
+void Planet::show()
+{    
+    //Show the planet
+	if (type > -1)
+	{
+		render_queue.add( LAYER_PLANETS, box.x - camera.x, box.y - camera.y, assets.surface(planetTex[type]) );
+	}
+}
+
+// Start planet in a rand location on screen with a rand velocity
+void Planet::init(int i)
+{
+	type = i;
+	red_team = 0;
+	blue_team = 0;
+	owner = 0;
+	circle.x = box.x;
+	circle.y = box.y;
+	circle.r = box.w/2;
+}
+
+// Create planet to given type specifications
+void Planet::create(int i, int x, int y)
+{
+	if (i == 0)
+	{
+		capture_time = 900;
+		box.w = 366;
+		box.h = 366;
+		box.x = x;
+		box.y = y;
+		init(i);
+	}
+	if (i == 1)
+	{
+		capture_time = 1200;
+		box.w = 409;
+		box.h = 403;
+		box.x = x;
+		box.y = y;
+		init(i);
+
+	}
+
+	if (i == 2)
+	{
+		capture_time = 900;
+		box.w = 360;
+		box.h = 360;
+		box.x = x;
+		box.y = y;
+		init(i);
+
+	}
+	if (i == 3)
+	{
+		capture_time = 900;
+		box.w = 360;
+		box.h = 366;
+		box.x = x;
+		box.y = y;
+		init(i);
+
+	}
+}
+
+// Drain resources to a given value
+void Planet::capture(int strength, int team)
+{
+	if (team == 1)
+	{
+		if (blue_team < capture_time) blue_team += strength;
+		if (red_team > 0) red_team -= strength;
+	}
+	if (team == 2)
+	{
+		if (red_team < capture_time) red_team += strength;
+		if (blue_team > 0 ) blue_team -= strength;
+	}
+	if (red_team >= capture_time) 
+	{
+		owner = 2;
+	}
+	if (blue_team >= capture_time) 
+	{
+		owner = 1;
+	}
+	
+}
+
+
+
+/***************************************** PROJECTILE POOL CLASS **************************************/
+/*
+  Every shot in flight in a match, stored as one array per field so a tick moves
+  them all in a single pass. A ship may have several shots out at once; how often
+  it can fire is set by its type. Slots are allocated once for the whole match
+  and reused, with live shots packed at the front, so firing never allocates.
+*/
+const int PROJECTILE_SIZE = 20;
+// Ticks a shot flies for before it fades
+const int PROJECTILE_RANGE = 5;
+
+class Projectile_Pool
+{
+	private:
+	int capacity, live;
+	
+	public:
+	// Position and velocity of each shot, the ticks it has flown, and who fired it
+	std::vector<int> x, y, xVel, yVel, ticks;
+	std::vector<int> owner, team, damage;
+	
+	Projectile_Pool();
+	// Allocates room for count shots in flight and removes any current ones
+	void reserve(int count);
+	// Sets a shot away from x, y. Returns false if every slot is in use.
+	bool fire(int ship, int side, int power, int x, int y, int velX, int velY);
+	// Moves every shot on a tick, retiring the ones that have flown their range
+	void move();
+	// Removes a shot. The last live shot takes its slot.
+	void retire(int shot);
+	SDL_Rect get_coords(int shot);
+	// The area the shot passed through on its last move
+	SDL_Rect get_sweep(int shot);
+	void show(int shot);
+	int size();
+	void clear();
+	Uint32 hash(Uint32 h);
+};
+
+Projectile_Pool::Projectile_Pool()
+{
+	capacity = 0;
+	live = 0;
+}
+void Projectile_Pool::reserve(int count)
+{
+	capacity = count;
+	live = 0;
+	x.assign(count, 0);
+	y.assign(count, 0);
+	xVel.assign(count, 0);
+	yVel.assign(count, 0);
+	ticks.assign(count, 0);
+	owner.assign(count, 0);
+	team.assign(count, 0);
+	damage.assign(count, 0);
+}
+bool Projectile_Pool::fire(int ship, int side, int power, int startX, int startY, int velX, int velY)
+{
+	if (live == capacity) return false;
+	int s = live++;
+	x[s] = startX;
+	y[s] = startY;
+	xVel[s] = velX*3;
+	yVel[s] = velY*3;
+	ticks[s] = 0;
+	owner[s] = ship;
+	team[s] = side;
+	damage[s] = power;
+	return true;
+}
+void Projectile_Pool::move()
+{
+	int s = 0;
+	while (s < live)
+	{
+		if (ticks[s] >= PROJECTILE_RANGE)
+		{
+			retire(s);
+			continue;
+		}
+		x[s] += xVel[s];
+		y[s] += yVel[s];
+		ticks[s]++;
+		s++;
+	}
+}
+void Projectile_Pool::retire(int shot)
+{
+	int last = --live;
+	x[shot] = x[last];
+	y[shot] = y[last];
+	xVel[shot] = xVel[last];
+	yVel[shot] = yVel[last];
+	ticks[shot] = ticks[last];
+	owner[shot] = owner[last];
+	team[shot] = team[last];
+	damage[shot] = damage[last];
+}
+SDL_Rect Projectile_Pool::get_coords(int shot)
+{
+	SDL_Rect box = { (Sint16)x[shot], (Sint16)y[shot], PROJECTILE_SIZE, PROJECTILE_SIZE };
+	return box;
+}
+SDL_Rect Projectile_Pool::get_sweep(int shot)
+{
+	SDL_Rect box = get_coords(shot);
+	if (ticks[shot] == 0) return box;
+	int fromX = x[shot] - xVel[shot];
+	int fromY = y[shot] - yVel[shot];
+	box.x = (Sint16)std::min(fromX, x[shot]);
+	box.y = (Sint16)std::min(fromY, y[shot]);
+	box.w = (Uint16)(abs(xVel[shot]) + PROJECTILE_SIZE);
+	box.h = (Uint16)(abs(yVel[shot]) + PROJECTILE_SIZE);
+	return box;
+}
+void Projectile_Pool::show(int shot)
+{
+	render_queue.add( LAYER_PROJECTILES, x[shot] - camera.x, y[shot] - camera.y, assets.surface(laser) );
+}
+int Projectile_Pool::size()
+{
+	return live;
+}
+void Projectile_Pool::clear()
+{
+	live = 0;
+}
+Uint32 Projectile_Pool::hash(Uint32 h)
+{
+	h = hash_int(h, live);
+	for (int s = 0; s < live; s++)
+	{
+		h = hash_int(h, x[s]);
+		h = hash_int(h, y[s]);
+		h = hash_int(h, ticks[s]);
+		h = hash_int(h, owner[s]);
+	}
+	return h;
+}
+
+/****************************************** ANIMATION POOL CLASS ***************************************/
+/*
+  Every explosion in play, kept in one fixed block so starting and retiring one never
+  allocates. Animations are timed in simulation ticks rather than draw calls, so an
+  explosion off screen still finishes on time and is only drawn when the camera sees it.
+*/
+const int MAX_ANIMATIONS = 512;
+const int EXPLOSION_FRAMES = 8;
+// Ticks each explosion frame is held for
+const int EXPLOSION_TICKS = 1;
+
+struct Animation
+{
+	// Where the frames are drawn and the most they cover, which is more than the wreck
+	SDL_Rect box;
+	// Row of explosion textures and the tick the animation started on
+	int kind, start;
+};
+
+class Animation_Pool
+{
+	private:
+	Animation animations[MAX_ANIMATIONS];
+	// Live animations are packed at the front of the block
+	int live;
+	
+	public:
+	Animation_Pool();
+	// Starts the explosion of a ship type over its box. Returns false if the pool is full.
+	bool spawn(SDL_Rect box, int type, int tick);
+	// Retires every animation that has played out by this tick
+	void update(int tick);
+	// Queues the frame of each animation inside the camera, counting the rest as culled
+	void show(int tick, int &drawn, int &culled);
+	int size();
+	void clear();
+};
+
+Animation_Pool::Animation_Pool()
+{
+	live = 0;
+}
+bool Animation_Pool::spawn(SDL_Rect box, int type, int tick)
+{
+	if (live == MAX_ANIMATIONS) return false;
+	Animation &a = animations[live++];
+	a.box = box;
+	a.kind = type > 2 ? type - 3 : type;
+	a.start = tick;
+	// Sets are loaded when a match starts, so their frame sizes are known by the first explosion
+	for (int i = 0; i < EXPLOSION_FRAMES; i++)
+	{
+		int w, h;
+		if (!sprites.frame_size(explosion[a.kind][i], w, h)) continue;
+		a.box.w = (Uint16)std::max((int)a.box.w, w);
+		a.box.h = (Uint16)std::max((int)a.box.h, h);
+	}
+	return true;
+}
+void Animation_Pool::update(int tick)
+{
+	int i = 0;
+	while (i < live)
+	{
+		// Swap the last live animation into the finished one's place
+		if ((tick - animations[i].start) / EXPLOSION_TICKS >= EXPLOSION_FRAMES) animations[i] = animations[--live];
+		else i++;
+	}
+}
+void Animation_Pool::show(int tick, int &drawn, int &culled)
+{
+	for (int i = 0; i < live; i++)
+	{
+		Animation &a = animations[i];
+		if (!collision(camera, a.box))
+		{
+			culled++;
+			continue;
+		}
+		int frame = (tick - a.start) / EXPLOSION_TICKS;
+		sprites.use( SET_EXPLOSIONS + a.kind );
+		sprites.draw( LAYER_EFFECTS, a.box.x - camera.x, a.box.y - camera.y, explosion[a.kind][frame] );
+		drawn++;
+	}
+}
+int Animation_Pool::size()
+{
+	return live;
+}
+void Animation_Pool::clear()
+{
+	live = 0;
+}
+
+
+/***************************************** ESCAPE POD CLASS ************************************/
+/*
+  Escape pod created when a ship is destroyed
+*/
+
+//The Pod that will move around on the screen
+class Pod
+{
+    private:
+
+    //The Pod's collision box
+	Circle circle;
+    int xVel, yVel, speed, team, angle, desired_angle, think;
+	// The match the pod is in
+	World *world;
+	public:
+
+	Pod();
+	void set_world(World *w);
+	void set_team(int t);
+	Circle get_coords();
+	
+	// Spawns the Pod with re-initialised settings
+	void spawn(int x, int y);
+	void destroy();
+	void move();
+	void show();
+	void reset();
+	void set_angle(Circle one, Circle two);
+	int get_distance(Circle one, Circle two);
+};
+
+Pod::Pod()
+{
+	
+	circle.x = 0;
+	circle.y = 0;
+	circle.r = 0;
+	speed = 60;
+	think = 0;
+	angle = 0;
+	desired_angle = 0;
+	team = 1;
+	world = NULL;
+}
+void Pod::set_world(World *w)
+{
+	world = w;
+}
+int Pod::get_distance(Circle one, Circle two)
+{
+	int x = 0;
+	int y = 0;
+	Circle a = one;
+	Circle b = two;
+	
+	// if a < b, subtract it from b, else vice versa
+	if (a.x < b.x) x = b.x - a.x;
+	else x = a.x - b.x;
+	
+	if (a.y < b.y) y = b.y - a.y;
+	else y = a.y - b.y;
+	
+	return x + y;
+}
+void Pod::set_team(int t)
+{
+	if (t < 3) {team = 1;}
+	else team = 2;
+	
+	circle.x = 0;
+	circle.y = 0;
+}
+Circle Pod::get_coords()
+{
+	return circle;
+}
+void Pod::set_angle(Circle one, Circle two)
+{
+	if(one.x == two.x && one.y == two.y){}
+	else desired_angle = heading_between(one.x, one.y, two.x, two.y);
+}
+void Pod::move()
+{
+	Circle temp;
+	int mship;
+	if (team == 1) mship = world->blue_mother;
+	else mship = world->red_mother;
+	temp.x = world->mothership[mship].x + (world->mothership[mship].w/2);
+	temp.y = world->mothership[mship].y + (world->mothership[mship].h/2);
+	temp.r = 10;
+	if (think < 0) think++;
+	else 
+	{
+		think = -5;
+		set_angle(circle, temp);
+	}
+	int rotate = 0;
+	if (angle != desired_angle)
+	{
+		if (angle < desired_angle) rotate = 1;
+		else rotate = -1;
+		
+	}
+	else rotate = 0;
+	// Rotate to meet desired angle
+	if (rotate == -1)
+	{
+		if (angle-1 > -1) angle -= 1;
+		else angle = HEADINGS - 1;
+	}
+	if (rotate == 1)
+	{
+		if (angle+1 < HEADINGS) angle += 1;
+		else angle = 0;
+	}
+	circle.x += heading_x(angle) * speed / 1024;
+	circle.y += heading_y(angle) * speed / 1024; 
+	if (get_distance(temp, circle) < 70) destroy();
+}
+void Pod::show()
+{
+	if (angle < 0 || angle >= HEADINGS) angle = 0;
+	sprites.draw( LAYER_PODS, circle.x - camera.x, circle.y - camera.y, pod[angle] );
+}
+void Pod::spawn(int x, int y)
+{
+	circle.x = x;
+	circle.y = y;
+	circle.r = 90;
+}
+
+void Pod::destroy()
+{
+	circle.r = 0;
+}
+
+
+
+/*********************************************** SHIP CLASS *******************************************/
+/*
+ Representation of a player's ship
+*/
+
+//The Ship that will move around on the screen
+class Ship
+{
+    private:
+
+    //The Ship's collision box
+	SDL_Rect box;
+	Circle circle;
+    
+	Pod pod;
+	// Index of the ship in its match, which owns the shots it fires
+	int id;
+	
+    //The movement components of the Ship
+    int rotate, moving, angle, lastX, lastY, breaking;
+
+	
+	// Signals the state of the ship
+	bool render;
+	
+	// The dimensions of the ship's collision box.
+	int shipSize, speed, damage;
+	
+	// Signals the state of the shield
+	int showShield;
+	bool shield_visible;
+	int recharge;
+	
+	bool shoot;
+	// Ticks between shots, and until the next one can be fired
+	int fire_delay, cooldown;
+	
+	// Keys held now, and the input applied on the last tick
+	Uint8 keys, input;
+	
+	// Ship stats (type = light, heavy or mothership = 1-3)
+	int shield, health, type, max_shield, reveal;
+
+	// Drift calculations (drift is in 1/DRIFT_SCALE pixels)
+    int xDrift, yDrift, accelerating;
+	
+	// Variables dealing with AI
+	bool ai, ai_shoot;
+	int personality, desired_angle, ai_think;
+	Circle target;
+	
+	// The match the ship is in
+	World *world;
+
+	
+	public:
+
+	Ship();
+	
+	// Places the ship (and its pod) in a match as ship number index
+	void set_world(World *w, int index);
+	
+	int xVel, yVel;
+	
+	// Sets the type of the ship
+	void set_type(int type);
+	
+	// Spawns the ship with re-initialised settings
+	void spawn();
+	
+	//Sets the camera over the Ship
+    void set_camera();
+	
+	// Returns the area of the level the camera would show over the Ship
+	SDL_Rect get_view();
+	
+	// Returns true if render = 1
+	bool do_render();
+	
+	// Returns the ship's current type
+	int get_type();
+	
+	//Handles the input from the keyboard (held keys are applied once per tick)
+    void handle_input( SDL_Event &event );
+	Uint8 get_keys();
+	
+	// Applies one tick of input flags
+	void apply_input( Uint8 next );
+    
+    //Moves the Ship after each loop repetition
+    void move(Planet planets[], Ship players[]);
+	
+    
+	//Advances the projectile, pod and wreck after each loop repetition.
+	//Returns true on the tick the ship is wrecked.
+	bool update();
+    
+	//Moves the ship's shield flash on a frame, whether or not the ship is on screen.
+	void animate();
+	
+	// Returns where the engine's exhaust leaves the ship and which way, false if the engine is off
+	bool get_exhaust(int &x, int &y, int &xDir, int &yDir);
+	
+    //Shows the Ship on the screen, returning false if none of it was inside the camera
+    bool show();
+	
+	//Displays the health and shield respresentation
+	void show_health();
+		
+	int get_damage();
+	
+	//Called when a ship takes damage
+    void hurt(int damage);
+	
+	//Called to destroy ship
+	void destroy();
+	
+	//Called to show the shield if it has power
+	void show_shield();
+	
+	// Recharges the shield if i=1
+	void recharge_shield(int i);
+	
+	// Returns the ship's box dimensions and coordinates
+	SDL_Rect get_coords();
+	Circle get_circle();
+	Circle get_pod();
+	// Returns where the ship's explosion is drawn
+	SDL_Rect get_wreck();
+	
+	// Fires a shot along the ship's heading if its guns are ready
+	void fire();
+	void reveal_ship();
+	void ai_move(Planet planets[], Ship players[]);
+	int get_nearest(Planet planets[]);
+	int get_nearest(Ship players[]);
+	int get_team();
+	bool enemyVisible(Ship players[]);
+	int enemyInRange(Ship players[]);
+	bool revealed();
+	
+	int get_distance(Circle one, Circle two);
+	void get_heading();
+	void set_angle(Circle one, Circle two);
+	bool isOverPlanet(Planet planets[]);
+	void ai_on();
+	void ai_off();
+	
+	// Folds the ship's simulation state into a hash
+	Uint32 hash(Uint32 h);
+	
+};
+
+Ship::Ship()
+{
+
+	render = false;
+	recharge = 0;
+	breaking = 0;
+	ai = false;
+	reveal = 0;
+	ai_shoot = false;
+	shoot = false;
+	fire_delay = PROJECTILE_RANGE;
+	cooldown = 0;
+	id = 0;
+	ai_think = 1;
+	desired_angle = 0;
+	keys = 0;
+	input = 0;
+	world = NULL;
+}
+void Ship::set_world(World *w, int index)
+{
+	world = w;
+	id = index;
+	pod.set_world(w);
+}
+void Ship::ai_off()
+{
+	ai = false;
+}
+void Ship::ai_on()
+{
+	ai = true;
+	
+	
+	if (type == 2 || type == 5)
+	{
+		personality = 3;
+	}
+	else
+	{
+		personality = world->rng.next(3);
+	}
+}
+void Ship::set_type(int t)
+{
+	type = t;
+	if (type == 0)
+	{
+		shipSize = 110;
+		max_shield = 100;
+		shield = 200;
+		health = 100;
+		speed = 40;
+		type = 0;
+		damage = 5;
+		fire_delay = 3;
+		render = true;
+		spawn();
+	}
+	else if (type == 1)
+	{
+
+		shipSize = 150;
+		type = 1;
+		max_shield = 200;
+		shield = 200;
+		health = 200;
+		damage = 10;
+		fire_delay = 4;
+		speed = 30;
+		render = true;
+		spawn();
+	}
+	else if (type == 2)
+	{
+
+		shipSize = 470;
+		type = 2;
+		max_shield = 2000 *(MAX_PLAYERS/10); // Mothership's health is determined by number of potential enemies
+		shield = 2000 *(MAX_PLAYERS/10);
+		speed = 20;
+		damage = 30;
+		fire_delay = 5;
+		health = 2000 *(MAX_PLAYERS/10);
+		render = true;
+		spawn();
+	}
+	else if (type == 3)
+	{
+
+		shipSize = 110;
+		type = 3;
+		max_shield = 100;
+		shield = 200;
+		health = 100;
+		speed = 40;
+		damage = 5;
+		fire_delay = 3;
+		render = true;
+		spawn();
+	}
+	else if (type == 4)
+	{
+
+		shipSize = 150;
+		type = 4;
+		max_shield = 200;
+		shield = 200;
+		health = 200;
+		speed =30;
+		damage = 10;
+		fire_delay = 4;
+		render = true;
+		spawn();
+	}
+	else if (type == 5)
+	{
+
+		shipSize = 470;
+		type = 5;
+		max_shield = 2000 *(MAX_PLAYERS/10);
+		shield = 2000 *(MAX_PLAYERS/10);
+		speed = 20;
+		health = 2000 *(MAX_PLAYERS/10);
+		damage = 30;
+		fire_delay = 5;
+		render = true;
+		spawn();
+	}
+
+}
+
+// Re-initialises variables to starting values
+void Ship::spawn()
+{
+	angle = 0;
+	rotate = 0;
+	moving = 0;
+	xVel = 0;
+	yVel = 0;
+	xDrift = 0;
+	yDrift = 0;
+	shoot = false;
+
+	box.w = shipSize;
+	box.h = shipSize; 
+	// both motherships have been placed
+	if (world->mothership[0].x > 0 && world->mothership[1].x > 0)
+	{
+		// if ship = 0 or 1
+		if (type < 2)
+		{
+			// Spawn near mothership
+			box.x = world->mothership[world->blue_mother].x + world->rng.next(world->mothership[world->blue_mother].w)/2;
+			box.y = world->mothership[world->blue_mother].y + world->rng.next(world->mothership[world->blue_mother].w)/2;
+		}
+		// if ship == 3 or 4
+		else if (type > 2 && type < 5)
+		{
+			box.x = world->mothership[world->red_mother].x + world->rng.next(world->mothership[world->red_mother].w)/2;
+			box.y = world->mothership[world->red_mother].y + world->rng.next(world->mothership[world->red_mother].w)/2;
+		}
+		// If ship = 2 or 5
+		else
+		{
+			// Spawn at rand
+			box.x =  world->rng.next(15000);
+			while (box.x + box.w > LEVEL_WIDTH) 
+			{
+				box.x = world->rng.next(15000);
+			}
+			
+			box.y =  world->rng.next(15000);
+			while (box.y + box.h > LEVEL_HEIGHT)
+			{
+				box.y = world->rng.next(15000);
+			}
+		}
+	}	
+	else
+	{
+		// Spawn motherships at rand
+		box.x =  world->rng.next(15000);
+		while (box.x + box.w > LEVEL_WIDTH) 
+		{
+			box.x = world->rng.next(15000);
+		}
+		
+		box.y =  world->rng.next(15000);
+		while (box.y + box.h > LEVEL_HEIGHT)
+		{
+			box.y = world->rng.next(15000);
+		}
+	}
+	circle.x = box.x + shipSize/2;
+	circle.y = box.y + shipSize/2;
+	circle.r = shipSize/2;
+	showShield = 0;
+	shield_visible = false;
+	
+	accelerating = 0;	
+	pod.set_team(type);	
+
+}
+int Ship::get_damage()
+{
+	return damage;
+}
+void Ship::set_camera()
+{
+	world->camera = get_view();
+}
+
+SDL_Rect Ship::get_view()
+{
+	SDL_Rect view = { 0, 0, (Uint16)screen_width, (Uint16)screen_height };
+	
+	view.x = ( box.x + box.w / 2 ) - screen_width / 2;
+	view.y = ( box.y + box.h / 2 ) - screen_height / 2;
+    
+    //Keep the view in bounds.
+    if( view.x < 0 )
+    {
+        view.x = 0;    
+    }
+    if( view.y < 0 )
+    {
+        view.y = 0;    
+    }
+    if( view.x > LEVEL_WIDTH - view.w )
+    {
+        view.x = LEVEL_WIDTH - view.w;    
+    }
+    if( view.y > LEVEL_HEIGHT - view.h )
+    {
+        view.y = LEVEL_HEIGHT - view.h;    
+    }
+	return view;
+}
+
+bool Ship::do_render()
+{
+	if (render) return true;
+	else return false;
+}
+
+int Ship::get_type()
+{
+	return type;
+}
+
+void Ship::handle_input( SDL_Event &event )
+{
+	Uint8 flag = 0;
+	if( event.type == SDL_KEYDOWN || event.type == SDL_KEYUP )
+	{
+		switch( event.key.keysym.sym )
+		{
+			case SDLK_UP: flag = INPUT_UP; break;
+			case SDLK_LEFT: flag = INPUT_LEFT; break;
+			case SDLK_RIGHT: flag = INPUT_RIGHT; break;
+			case SDLK_DOWN: flag = INPUT_DOWN; break;
+			case SDLK_SPACE: flag = INPUT_FIRE; break;
+			case SDLK_1: flag = INPUT_LIGHT; break;
+			case SDLK_2: flag = INPUT_HEAVY; break;
+			default: break;
+		}
+	}
+	//Record the key as held or released until the next tick
+	if( event.type == SDL_KEYDOWN ) keys |= flag;
+	else if( event.type == SDL_KEYUP ) keys &= ~flag;
+}
+
+Uint8 Ship::get_keys()
+{
+	return keys;
+}
+
+void Ship::apply_input( Uint8 next )
+{
+	//Work out which keys went down and which came up since the last tick
+	Uint8 pressed = next & ~input;
+	Uint8 released = input & ~next;
+	input = next;
+	
+	// Respawn keys work only while dead, once the pod is home and the mothership lives
+	if( (pressed & (INPUT_LIGHT | INPUT_HEAVY)) && !render && pod.get_coords().r == 0 && world->mothership[get_team()-1].w != 0 )
+	{
+		int t = 0;
+		if (pressed & INPUT_HEAVY) t = 1;
+		if (get_team() == 2) t += 3;
+		set_type(t);
+		return;
+	}
+	if( !render ) return;
+	
+	// If up, move in current direction
+	if( pressed & INPUT_UP ) moving = 1;
+	// If left, begin rotating anti-clockwise
+	if( pressed & INPUT_LEFT ) rotate = -1;
+	// If right, begin rotating clockwise
+	if( pressed & INPUT_RIGHT ) rotate = 1;
+	// If down, decelerate ship
+	if( pressed & INPUT_DOWN ) breaking = 1;
+	// If spacebar is pressed, fire a shot in the direction the ship is currently facing
+	if( pressed & INPUT_FIRE ) shoot = true;
+	
+	// If up, stop moving and begin drifting
+	if( released & INPUT_UP )
+	{
+		moving = 0;
+		yDrift += yVel * DRIFT_SCALE;
+		xDrift += xVel * DRIFT_SCALE;
+		yVel = 0;
+		xVel = 0;
+		accelerating = 0;
+	}
+	// If left or right, stop rotating
+	if( released & (INPUT_LEFT | INPUT_RIGHT) ) rotate = 0;
+	// If down, stop breaking
+	if( released & INPUT_DOWN ) breaking = 0;
+	// If space, stop shooting
+	if( released & INPUT_FIRE ) shoot = false;
+}
+
+void Ship::move(Planet planets[], Ship players[])
+{
+	// If ai is active, switch to AI move
+	if(ai){ai_move(planets, players);}
+	else
+	{
+		// If ship is revealed, decrement time to be revealed
+		if (reveal > 0)
+		{
+			reveal --;
+		}
+		// Recharge shield if necessary
+		if (type == 2 || type == 5) recharge = 1;
+		if (recharge == 1)
+		{
+			if (shield < max_shield) shield ++;
+			recharge = 0;
+		}
+		
+		// Update angle
+		if (rotate == -1)
+		{
+			if (angle-1 > -1) angle -= 1;
+			else angle = HEADINGS - 1;
+		}
+		if (rotate == 1)
+		{
+			if (angle+1 < HEADINGS) angle += 1;
+			else angle = 0;
+		}	
+		
+		// Record current heading of ship and velocities
+		if (accelerating < speed && moving == 1) accelerating ++;
+		lastX = heading_x(angle) * accelerating / 1024;
+		lastY = heading_y(angle) * accelerating / 1024; 
+		
+		// Shoot if pressed
+		if (shoot) fire();
+		// Slow ship if breaking
+		if (breaking == 1)
+		{
+			xVel = 0;
+			yVel = 0;
+			xDrift -= xDrift / 10;
+			yDrift -= yDrift / 10;
+		}
+		// Move forward if player is pressing 'up'
+		if (moving == 1)
+		{
+			xVel = lastX;
+			yVel = lastY;
+			// Cancel drift as quickly as acceleration is being applied to prevent 'boost'
+			xDrift = approach_zero(xDrift, DRIFT_SCALE);
+			yDrift = approach_zero(yDrift, DRIFT_SCALE);
+		}
+		else
+		{
+			// Calculate and apply drift
+			xDrift = approach_zero(xDrift, DRIFT_SCALE / 5);
+			yDrift = approach_zero(yDrift, DRIFT_SCALE / 5);
+		}
+		//If the Ship will go off the universe by moving in any direction, dont move in that direction
+		int xStep = xVel + xDrift / DRIFT_SCALE;
+		int yStep = yVel + yDrift / DRIFT_SCALE;
+		if ((box.x + xStep) < 0 || (box.x + xStep + box.w) > LEVEL_WIDTH){}
+		else 
+		{	
+			box.x += xStep;
+			circle.x = box.x + shipSize/2;
+
+		}
+		if ((box.y + yStep) < 0 || (box.y + yStep + box.h) > LEVEL_HEIGHT){}
+		else 
+		{
+			box.y += yStep;
+			circle.y = box.y + shipSize/2;
+
+		}
+	}
+	
+}
+
+
+
+// Advances the parts of the ship that move by themselves (projectile, pod, wreck)
+bool Ship::update()
+{
+	bool wrecked = false;
+	// Reload the guns
+	if (cooldown > 0) cooldown--;
+	// Move pod if mothership exists and pod exists
+	if (pod.get_coords().r == 0 || world->mothership[get_team()-1].w == 0){}
+	else
+	{
+		pod.move();
+		box.x = pod.get_coords().x;
+		box.y = pod.get_coords().y;
+	}
+	if (render && health > 0){}
+	else
+	{
+		// The box is only still sized on the tick the ship dies
+		wrecked = box.w != 0;
+		// If type is fighter not mothership and mothership exists, spawn escape pod
+		if (type != 2 && type != 5)
+		{
+			box.w = 0;
+			box.h = 0;
+			xDrift = 0;
+			yDrift = 0;
+			shoot = false;
+			render = false;
+			if (world->mothership[get_team()-1].w == 0){}
+			else
+			{
+				if (pod.get_coords().x == 0 && pod.get_coords().y == 0)
+				{
+					pod.spawn(box.x,box.y);
+				}
+				if (pod.get_coords().r == 0 && !render && world->mothership[get_team()-1].w != 0)
+				{
+					if (ai)
+					{
+						set_type(type);
+					}
+					
+				}
+			}
+			
+		}
+		else
+		{
+			box.w = 0;
+			box.h = 0;
+			xDrift = 0;
+			yDrift = 0;
+			render = false;
+		}
+		
+	}
+	if (reveal > 0) reveal --;
+	return wrecked;
+}
+
+void Ship::animate()
+{
+	// The shield shows for a few frames after a hit
+	shield_visible = shield > 0 && showShield > 0;
+	if (shield_visible) showShield --;
+}
+bool Ship::get_exhaust(int &x, int &y, int &xDir, int &yDir)
+{
+	if (!render || health <= 0 || moving != 1) return false;
+	// Straight out of the back of the ship (headings are x1024)
+	xDir = -heading_x(angle);
+	yDir = -heading_y(angle);
+	x = circle.x + xDir * shipSize / 2048;
+	y = circle.y + yDir * shipSize / 2048;
+	return true;
+}
+
+bool Ship::show()
+{    
+	bool shown = false;
+	// Display pod if mothership exists and pod exists
+	if (pod.get_coords().r == 0 || world->mothership[get_team()-1].w == 0){}
+	else
+	{
+		Circle place = pod.get_coords();
+		SDL_Rect reach = { (Sint16)place.x, (Sint16)place.y, (Uint16)place.r, (Uint16)place.r };
+		if (collision(camera, reach))
+		{
+			pod.show();
+			shown = true;
+		}
+	}
+	//Show the Ship if it still exists on screen
+	if (render && health > 0 && collision(camera, box))
+	{
+		int layer = LAYER_SHIPS;
+		if (type == 2 || type == 5) layer = LAYER_MOTHERSHIPS;
+		sprites.use( SET_SHIPS + type );
+		sprites.draw( layer, box.x - camera.x, box.y - camera.y, ships[type][angle][moving] );
+		shown = true;
+	}
+	// Display shield if it needs to be displayed and has energy left; it's bigger than the ship
+	SDL_Surface *shield_image = assets.surface(shieldTexture[type]);
+	if (shield_visible && shield_image != NULL)
+	{
+		SDL_Rect reach = { box.x, box.y, (Uint16)shield_image->w, (Uint16)shield_image->h };
+		if (collision(camera, reach))
+		{
+			render_queue.add( LAYER_EFFECTS, box.x - camera.x, box.y - camera.y, shield_image );
+			shown = true;
+		}
+	}
+	return shown;
+}
+Circle Ship::get_pod()
+{
+	return pod.get_coords();
+}
+SDL_Rect Ship::get_wreck()
+{
+	SDL_Rect wreck = { box.x, box.y, (Uint16)shipSize, (Uint16)shipSize };
+	return wreck;
+}
+// Display health bar on screen
+void Ship::show_health()
+{
+	int display_width = screen_width - 170;
+	if (type < 3) render_queue.add( LAYER_HUD, display_width, 0, assets.surface(displaybar[0]) );
+	else render_queue.add( LAYER_HUD, display_width, 0, assets.surface(displaybar[1]) );
+
+	// The bars fade as they run down
+	int alpha = 200;
+	if (health < 100) alpha = health*2;
+	render_queue.add( LAYER_HUD, display_width+10, 0, assets.surface(healthbar[type]), alpha );
+	alpha = 200;
+	if (shield < 100) alpha = shield*2;
+	render_queue.add( LAYER_HUD, display_width+10, 0, assets.surface(shieldbar), alpha );
+}
+void Ship::hurt(int damage)
+{
+	show_shield();
+	// If the shield is stronger than the damage, subtract damage from shield
+	if (shield > damage)
+	{
+		shield -= damage;
+	}
+	// If shield has power left, subtract remainder from health and remove shield
+	else if (shield > 0)
+	{
+		int newDamage = damage - shield;
+		shield = 0;
+		health -= newDamage;
+	}
+	// Otherwise, remove damage from health and destroy health <= 0
+	else
+	{
+		if (health > damage) {health -= damage;}
+		else destroy();
+	}
+	reveal_ship();
+}
+
+void Ship::destroy()
+{
+	render = false;
+	health = 0;
+	moving = 0;
+
+	xVel = 0;
+	yVel = 0;
+	xDrift = 0;
+	yDrift = 0;
+	shield = 0;
+}
+
+void Ship::show_shield()
+{
+	showShield = 3;
+}
+
+void Ship::recharge_shield(int i)
+{
+	if (i == 0)
+	{
+		// If ship is not mothership, stop recharging
+		if (type != 2 || type != 5)
+		{
+			recharge = 0;
+		}
+	}
+	else recharge = 1;
+}
+
+SDL_Rect Ship::get_coords()
+{
+	return box;
+}
+Circle Ship::get_circle()
+{
+	return circle;
+}
+void Ship::fire()
+{
+	if (cooldown > 0) return;
+	int projX = heading_x(angle) * 30 / 1024;
+	int projY = heading_y(angle) * 30 / 1024; 
+	if (world->projectiles->fire(id, get_team(), damage, box.x + (shipSize/2), box.y + (shipSize/2), projX, projY)) cooldown = fire_delay;
+}
+Uint32 Ship::hash(Uint32 h)
+{
+	h = hash_int(h, type);
+	h = hash_int(h, render);
+	h = hash_int(h, box.x);
+	h = hash_int(h, box.y);
+	h = hash_int(h, box.w);
+	h = hash_int(h, angle);
+	h = hash_int(h, desired_angle);
+	h = hash_int(h, moving);
+	h = hash_int(h, rotate);
+	h = hash_int(h, breaking);
+	h = hash_int(h, xVel);
+	h = hash_int(h, yVel);
+	h = hash_int(h, xDrift);
+	h = hash_int(h, yDrift);
+	h = hash_int(h, accelerating);
+	h = hash_int(h, health);
+	h = hash_int(h, shield);
+	h = hash_int(h, reveal);
+	h = hash_int(h, ai_think);
+	h = hash_int(h, cooldown);
+	h = hash_int(h, pod.get_coords().x);
+	h = hash_int(h, pod.get_coords().y);
+	h = hash_int(h, pod.get_coords().r);
+	return h;
+}
+
+//// --- CODE RELATING TO ARTIFICIAL INTELLIGENCE FUNCTIONS --- ///
+// AI-Move, called if ai is active.
+void Ship::ai_move(Planet planets[], Ship players[])
+{	
+	if (ai_think >= 1 && render)
+	{
+		// If ship is a hunter
+		if (personality == HUNTER)
+		{
+			// If there are any enemies on the radar, set target as nearest visible enemy
+			if (enemyVisible(players))
+			{
+				int t =  get_nearest(players);
+				target = (Circle&)(Circle const&)players[t].get_circle();
+			}
+			// Otherwise, set the target as the nearest planet that needs to be captured
+			else
+			{
+
+				int p = get_nearest(planets);
+				target = (Circle&)(Circle const&)planets[p].get_circle();
+				target.x += planets[p].get_circle().r + world->rng.next(planets[p].get_circle().r) - world->rng.next(planets[p].get_circle().r);
+				target.y += planets[p].get_circle().r + world->rng.next(planets[p].get_circle().r) - world->rng.next(planets[p].get_circle().r);				
+			}
+			// If an enemy is in-range, shoot at enemy
+			if (enemyInRange(players) > -1)
+			{
+				int t = enemyInRange(players);
+				target = (Circle&)(Circle const&)players[t].get_circle();
+				ai_shoot = true;
+
+			}
+			else ai_shoot = false;
+		}
+		else if (personality == MOTHERSHIP)
+		{
+			// Target is nearest uncaptured planet
+			int p = get_nearest(planets);
+			target = (Circle&)(Circle const&)planets[p].get_circle();
+			target.x += planets[p].get_circle().r;
+			target.y += planets[p].get_circle().r;
+		}
+		else if (personality == GUARDIAN)
+		{
+			// Target is mothership
+			target = (Circle&)(Circle const&)players[get_team()].get_circle();
+			if (enemyInRange(players) > -1)
+			{
+				int t = enemyInRange(players);
+				target = (Circle&)(Circle const&)players[t].get_circle();
+				ai_shoot = true;
+			}
+			else ai_shoot = false;
+		}
+		else if (personality == SCOUT)
+		{
+			// Target is nearest uncaptured planet
+			int p = get_nearest(planets);
+			target = (Circle&)(Circle const&)planets[p].get_circle();
+			target.x += planets[p].get_circle().r;
+			target.y += planets[p].get_circle().r;
+		
+			if (enemyInRange(players) > -1 && isOverPlanet(planets))
+			{
+				int t = enemyInRange(players);
+				target = (Circle&)(Circle const&)players[t].get_circle();
+				ai_shoot = true;
+			}
+			else ai_shoot = false;
+		}
+	// Recreate delay on thinking
+	ai_think = -3;
+	set_angle(circle, target);
+	}
+	else ai_think++;
+	
+	if (angle != desired_angle)
+	{
+		if (angle < desired_angle) rotate = 1;
+		else rotate = -1;
+		
+	}
+	else rotate = 0;
+	
+	// Rotate to meet desired angle
+	if (rotate == -1)
+	{
+		if (angle-1 > -1) angle -= 1;
+		else angle = HEADINGS - 1;
+	}
+	if (rotate == 1)
+	{
+		if (angle+1 < HEADINGS) angle += 1;
+		else angle = 0;
+	}
+	
+	// Set movement variables
+	if (get_distance(circle, target) > target.r)
+	{
+		breaking = 0;
+		moving = 1; 
+	}
+	else 
+	{
+		breaking = 1;
+	}
+	if (breaking == 1 && moving == 1)
+	{
+		xDrift = xVel * DRIFT_SCALE;
+		yDrift = yVel * DRIFT_SCALE;
+		moving = 0;
+		accelerating = 0;
+		xVel = 0;
+		yVel = 0;
+	}
+	if (breaking == 1)
+	{
+		xDrift -= xDrift / 2;
+		yDrift -= yDrift / 2;
+	}
+	// Move forward
+	if (moving == 1)
+	{
+		// Calculate velocities
+		if (accelerating < speed) accelerating ++;
+		lastX = heading_x(angle) * accelerating / 1024;
+		lastY = heading_y(angle) * accelerating / 1024; 
+		xVel = lastX;
+		yVel = lastY;
+		// Calculate and apply drift
+		xDrift = approach_zero(xDrift, DRIFT_SCALE);
+		yDrift = approach_zero(yDrift, DRIFT_SCALE);
+	}
+	else
+	{
+		// Calculate normal drift
+		xDrift = approach_zero(xDrift, DRIFT_SCALE / 5);
+		yDrift = approach_zero(yDrift, DRIFT_SCALE / 5);
+	}
+	if (ai_shoot) fire();
+	int xStep = xVel + xDrift / DRIFT_SCALE;
+	int yStep = yVel + yDrift / DRIFT_SCALE;
+	if ((box.x + xStep) < 0 || (box.x + xStep + box.w) > LEVEL_WIDTH){}
+	else 
+	{	
+		box.x += xStep;
+		circle.x = box.x + shipSize/2;
+
+	}
+	if ((box.y + yStep) < 0 || (box.y + yStep + box.h) > LEVEL_HEIGHT){}
+	else 
+	{
+		box.y += yStep;
+		circle.y = box.y + shipSize/2;
+
+	}
+}
+// Calculate the angle the ship should be facing given the target location and the ship's current location
+// A Circle holds an x,y location and a radius (r).
+// Circle 1 = ships location. Circle 2 = target location
+void Ship::set_angle(Circle one, Circle two)
+{
+	if(one.x == two.x && one.y == two.y) desired_angle = angle;
+	else desired_angle = heading_between(one.x, one.y, two.x, two.y);
+}
+void Ship::get_heading()
+{
+	set_angle(circle, target);
+	if (accelerating < speed && moving == 1) accelerating ++;
+	lastX = heading_x(angle) * accelerating / 1024;
+	lastY = heading_y(angle) * accelerating / 1024; 
+}
+bool Ship::isOverPlanet(Planet planets[])
+{
+	for (int i = 0; i < MAX_PLANETS; i++)
+	{
+		if (get_distance((Circle&)(Circle const&)planets[i].get_circle(), (Circle&)(Circle const&)circle) <= planets[i].get_circle().r) return true;
+	}
+	return false;
+}
+bool Ship::enemyVisible(Ship players[])
+{
+	for (int i = 0; i < world->player_count; i++)
+	{
+		if (players[i].get_team() != get_team())
+		{
+			if (players[i].revealed())
+			{
+				return true;
+			}
+		}
+	}
+	return false;
+}
+int Ship::enemyInRange(Ship players[])
+{
+	for (int i = 0; i < world->player_count; i++)
+	{
+		if (players[i].get_team() != get_team() && get_distance(players[i].get_circle(), circle) < 750 && players[i].do_render())
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+bool Ship::revealed()
+{
+	if (reveal > 0) return true;
+	else return false;
+}
+void Ship::reveal_ship()
+{
+	reveal = 200;
+}
+int Ship::get_nearest(Planet planets[])
+{
+	
+	int nearest = -1;
+	int count = 0;
+	// Set nearest planet not owned by team
+	while (nearest == -1)
+	{
+		if (planets[count].get_owner() != get_team()) 
+		{
+			nearest = count;
+		}
+		else count ++;
+	}
+	
+	// Find planet closer than nearest until all planets are searched
+	// For the cases where the owner is not team and i is not = nearest
+	for (int i = 0; i < MAX_PLANETS; i++)
+	{
+		if(planets[i].get_owner() != get_team() && nearest != i)
+		{
+			if( get_distance((Circle&)(Circle const&)planets[i].get_circle(), (Circle&)(Circle const&)circle) < get_distance((Circle&)(Circle const&)planets[nearest].get_circle(),(Circle&)(Circle const&)circle))
+			{
+				nearest = i;
+			}
+		}
+	}
+	return nearest;
+}
+int Ship::get_nearest(Ship players[])
+{
+	
+	int nearest = -1;
+	int count = 0;
+	// Set nearest player not on same team
+	while (nearest == -1)
+	{
+		if (players[count].get_team() != get_team()) 
+		{
+			nearest = count;
+		}
+		else count ++;
+	}
+	
+	// Find player closer than nearest until all planets are searched
+	// For the cases where the team is not same and i is not = nearest
+	for (int i = 0; i < world->player_count; i++)
+	{
+		if(players[i].get_team() != get_team() && nearest != i)
+		{
+			if( get_distance((Circle&)(Circle const&)players[i].get_circle(), (Circle&)(Circle const&)circle) < get_distance((Circle&)(Circle const&)players[nearest].get_circle(),(Circle&)(Circle const&)circle))
+			{
+				nearest = i;
+			}
+		}
+	}
+	return nearest;
 }
 
-
-
-void Ship::show( SDL_Surface *screen )
-{    
-	// Display projectile if it has been fired
-	if (proj.active() && pod.get_coords().r == 0 && render)
+int Ship::get_team()
+{
+	if (type < 3) return 1;
+	else return 2;
+}
+int Ship::get_distance(Circle one, Circle two)
+{
+	int x = 0;
+	int y = 0;
+	Circle a = one;
+	Circle b = two;
+	
+	// if a < b, subtract it from b, else vice versa
+	if (a.x < b.x) x = b.x - a.x;
+	else x = a.x - b.x;
+	
+	if (a.y < b.y) y = b.y - a.y;
+	else y = a.y - b.y;
+	
+	return x + y;
+}
+
+
+/******************************************** SPATIAL GRID CLASS ***************************************/
+/*
+ Buckets entity boxes by the level cells they overlap so that area queries
+ only look at nearby entities instead of everything in the level
+*/
+class Spatial_Grid
+{
+	private:
+	// Entity ids stored in each cell, in [row * GRID_COLUMNS + column] order
+	std::vector<int> cells[GRID_COLUMNS * GRID_ROWS];
+	// Box of each inserted entity, indexed by id
+	std::vector<SDL_Rect> boxes;
+	// Last query each entity was reported in (stops duplicates across cells)
+	std::vector<int> stamp;
+	int query_count;
+	
+	void cell_range(SDL_Rect &box, int &x1, int &y1, int &x2, int &y2);
+	
+	public:
+	Spatial_Grid();
+	// Empties every cell
+	void clear();
+	// Adds entity 'id' to the cells its box overlaps
+	void insert(int id, SDL_Rect box);
+	// Appends the ids of all entities whose boxes overlap the area
+	void query(SDL_Rect area, std::vector<int> &found);
+};
+
+Spatial_Grid::Spatial_Grid()
+{
+	query_count = 0;
+}
+void Spatial_Grid::cell_range(SDL_Rect &box, int &x1, int &y1, int &x2, int &y2)
+{
+	x1 = box.x / GRID_CELL;
+	y1 = box.y / GRID_CELL;
+	x2 = (box.x + box.w) / GRID_CELL;
+	y2 = (box.y + box.h) / GRID_CELL;
+	
+	// Keep the range inside the level
+	if (x1 < 0) x1 = 0;
+	if (y1 < 0) y1 = 0;
+	if (x2 > GRID_COLUMNS - 1) x2 = GRID_COLUMNS - 1;
+	if (y2 > GRID_ROWS - 1) y2 = GRID_ROWS - 1;
+}
+void Spatial_Grid::clear()
+{
+	for (int i = 0; i < GRID_COLUMNS * GRID_ROWS; i++)
 	{
-		proj.move();
-		proj.show();
-		
+		cells[i].clear();
 	}
-	// Display pod if mothership exists and pod exists
-	if (pod.get_coords().r == 0 || mothership[get_team()-1].w == 0){}
-	else
+}
+void Spatial_Grid::insert(int id, SDL_Rect box)
+{
+	if (id >= (int)boxes.size())
 	{
-		pod.move();
-		box.x = pod.get_coords().x;
-		box.y = pod.get_coords().y;
-		pod.show(screen);
+		boxes.resize(id + 1);
+		stamp.resize(id + 1, 0);
 	}
-	//Show the Ship if it still exists on screen
-	if (render && health > 0)
+	boxes[id] = box;
+	
+	int x1, y1, x2, y2;
+	cell_range(box, x1, y1, x2, y2);
+	for (int y = y1; y <= y2; y++)
 	{
-		apply_surface( box.x - camera.x, box.y - camera.y, ships[type][angle][moving], screen);
+		for (int x = x1; x <= x2; x++)
+		{
+			cells[y * GRID_COLUMNS + x].push_back(id);
+		}
 	}
-	else
+}
+void Spatial_Grid::query(SDL_Rect area, std::vector<int> &found)
+{
+	query_count++;
+	
+	int x1, y1, x2, y2;
+	cell_range(area, x1, y1, x2, y2);
+	for (int y = y1; y <= y2; y++)
 	{
-		// If type is fighter not mothership and mothership exists, spawn escape pod
-		if (type != 2 && type != 5)
+		for (int x = x1; x <= x2; x++)
 		{
-			explosion.show(box.x, box.y, type);
-		
-			box.w = 0;
-			box.h = 0;
-			xDrift = 0;
-			yDrift = 0;
-			shoot = false;
-			render = false;
-			if (mothership[get_team()-1].w == 0){}
-			else
+			std::vector<int> &cell = cells[y * GRID_COLUMNS + x];
+			for (unsigned int i = 0; i < cell.size(); i++)
 			{
-				if (pod.get_coords().x == 0 && pod.get_coords().y == 0)
-				{
-					pod.spawn(box.x,box.y);
-				}
-				if (pod.get_coords().r == 0 && !render && mothership[get_team()-1].w != 0)
+				int id = cell[i];
+				// Only report each entity once, and only if it really overlaps
+				if (stamp[id] != query_count)
 				{
-					if (ai)
-					{
-						set_type(type);
-					}
-					
+					stamp[id] = query_count;
+					if (collision(area, boxes[id])) found.push_back(id);
 				}
 			}
-			
 		}
-		else
+	}
+}
+
+/******************************************** WORLD INDEX CLASS ****************************************/
+/*
+ Spatial grids over the live ships, projectiles and pods, rebuilt every tick.
+ Projectile ids are slots in the projectile pool; pod ids are the index of the
+ ship that owns them.
+*/
+// How far right and down of its box anything drawn for a ship reaches
+// (shields are drawn from the ship's corner and are up to 20 pixels bigger than it)
+const int SPRITE_REACH = 20;
+
+class World_Index
+{
+	public:
+	Spatial_Grid ships;
+	Spatial_Grid projectiles;
+	Spatial_Grid pods;
+	
+	void build(Ship players[], int count, Projectile_Pool &shots);
+	// Indexes of the ships or pods that may draw something inside an area, in order
+	void visible(SDL_Rect area, std::vector<int> &found);
+};
+
+void World_Index::build(Ship players[], int count, Projectile_Pool &shots)
+{
+	ships.clear();
+	projectiles.clear();
+	pods.clear();
+	
+	for (int i = 0; i < count; i++)
+	{
+		if (players[i].do_render())
 		{
-			explosion.show(box.x, box.y, type);
-			box.w = 0;
-			box.h = 0;
-			xDrift = 0;
-			yDrift = 0;
-			render = false;
+			ships.insert(i, players[i].get_coords());
+		}
+		if (players[i].get_pod().r != 0)
+		{
+			// The pod circle holds the top left of the sprite and its size
+			SDL_Rect box;
+			box.x = players[i].get_pod().x;
+			box.y = players[i].get_pod().y;
+			box.w = players[i].get_pod().r;
+			box.h = players[i].get_pod().r;
+			pods.insert(i, box);
+		}
+	}
+	for (int s = 0; s < shots.size(); s++)
+	{
+		projectiles.insert(s, shots.get_coords(s));
+	}
+}
+void World_Index::visible(SDL_Rect area, std::vector<int> &found)
+{
+	found.clear();
+	area.x -= SPRITE_REACH;
+	area.y -= SPRITE_REACH;
+	area.w += SPRITE_REACH;
+	area.h += SPRITE_REACH;
+	ships.query(area, found);
+	pods.query(area, found);
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+}
+
+/******************************************** INTEREST CLASS *******************************************/
+/*
+ The set of entities one viewer needs each tick: everything inside their camera,
+ plus what their radar shows (allies always, enemies only while revealed) and
+ any planets that have changed owner since the viewer last saw them.
+ Hidden enemies outside the camera are never included.
+*/
+class Interest
+{
+	private:
+	// Ship index of the viewer
+	int viewer;
+	// Planet owners as last reported to the viewer
+	int known_owner[MAX_PLANETS];
+	
+	public:
+	// Ship indexes on screen
+	std::vector<int> ships;
+	// Ship indexes shown on the radar
+	std::vector<int> radar;
+	// Projectile pool slots on screen, and indexes of the ships whose pods are
+	std::vector<int> projectiles;
+	std::vector<int> pods;
+	// Planets whose owner changed this tick
+	std::vector<int> owner_changes;
+	
+	Interest();
+	// Sets the viewer and forgets what they have been told
+	void set_viewer(int v);
+	// Rebuilds the interest lists for the current tick
+	void update(Ship players[], int count, Planet planets[], World_Index &index);
+};
+
+Interest::Interest()
+{
+	set_viewer(0);
+}
+void Interest::set_viewer(int v)
+{
+	viewer = v;
+	// Force every planet owner to be reported on the next update
+	for (int i = 0; i < MAX_PLANETS; i++)
+	{
+		known_owner[i] = -1;
+	}
+}
+void Interest::update(Ship players[], int count, Planet planets[], World_Index &index)
+{
+	ships.clear();
+	radar.clear();
+	projectiles.clear();
+	pods.clear();
+	owner_changes.clear();
+	
+	// Everything inside the viewer's camera
+	SDL_Rect view = players[viewer].get_view();
+	index.ships.query(view, ships);
+	index.projectiles.query(view, projectiles);
+	index.pods.query(view, pods);
+	
+	// Radar: allies always, enemies only while revealed
+	for (int i = 0; i < count; i++)
+	{
+		if (!players[i].do_render()) continue;
+		if (players[i].get_team() == players[viewer].get_team() || players[i].revealed())
+		{
+			radar.push_back(i);
+		}
+	}
+	
+	// Planet ownership changes
+	for (int i = 0; i < MAX_PLANETS; i++)
+	{
+		if (planets[i].get_owner() != known_owner[i])
+		{
+			known_owner[i] = planets[i].get_owner();
+			owner_changes.push_back(i);
+		}
+	}
+}
+
+
+/******************************************** RADAR CLASS *******************************************/
+/*
+ The radar minimap. Dots are written straight into a small cached surface,
+ which is redrawn every RADAR_FRAMES frames and otherwise reused, so each frame
+ costs two blits however many ships there are. With more than RADAR_HEATMAP
+ ships the radar switches to a heatmap of how many of each team's ships are in
+ every RADAR_CELL square. Ships are only drawn if the viewer's interest set puts
+ them on the radar (allies always, enemies while revealed).
+*/
+const int RADAR_FRAMES = 4;
+const int RADAR_HEATMAP = 150;
+const int RADAR_CELL = 4;
+// Ships in a heatmap cell for full brightness
+const int RADAR_HEAT_MAX = 6;
+// Radar dot for each ship type, and for the viewer's own ship
+const int RADAR_TYPE_DOT[6] = { 0, 0, 3, 1, 1, 4 };
+const int RADAR_SELF_DOT = 2;
+// Planets use dot 5 + owner
+
+// One opaque pixel of a radar dot image
+struct Radar_Pixel
+{
+	int x, y;
+	Uint32 colour;
+};
+
+class Radar
+{
+	private:
+	SDL_Surface *cache;
+	Uint32 key;
+	// The opaque pixels of each dot image, in the cache's format
+	std::vector<Radar_Pixel> dots[8];
+	// Team colours for the heatmap
+	Uint8 team_colour[2][3];
+	int frame;
+	// Ships of each team in each heatmap cell
+	std::vector<int> heat[2];
+	
+	// Writes a dot image into the cache with its top left corner at x, y
+	void plot(int dot, int x, int y);
+	void draw_heatmap(Ship players[], std::vector<int> &shown, int viewer);
+	
+	public:
+	Radar();
+	~Radar();
+	// Builds the cache and reads the dot images (after the images are loaded)
+	bool create();
+	// Redraws the radar if it is due and queues it for drawing
+	void show(Ship players[], std::vector<int> &shown, Planet planets[], int viewer);
+};
+
+Radar::Radar()
+{
+	cache = NULL;
+	key = 0;
+	frame = 0;
+}
+Radar::~Radar()
+{
+	SDL_FreeSurface(cache);
+}
+bool Radar::create()
+{
+	int w = LEVEL_WIDTH / 100 + 14;
+	int h = LEVEL_HEIGHT / 100 + 14;
+	SDL_Surface *screen = assets.surface(radar_screen[0]);
+	if (screen != NULL)
+	{
+		w = screen->w;
+		h = screen->h;
+	}
+	// In the screen's format, so the sprite blitter can draw it
+	SDL_Surface *temp = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0);
+	if (temp == NULL) return false;
+	cache = SDL_DisplayFormat(temp);
+	SDL_FreeSurface(temp);
+	if (cache == NULL) return false;
+	key = SDL_MapRGB(cache->format, 0xFF, 0, 0xFF);
+	SDL_SetColorKey(cache, SDL_SRCCOLORKEY, key);
+	
+	for (int d = 0; d < 8; d++)
+	{
+		SDL_Surface *image = assets.surface(radar_dot[d]);
+		dots[d].clear();
+		if (image == NULL) continue;
+		SDL_LockSurface(image);
+		for (int y = 0; y < image->h; y++)
+		{
+			for (int x = 0; x < image->w; x++)
+			{
+				Uint32 pixel = get_pixel(image, x, y);
+				if ((image->flags & SDL_SRCCOLORKEY) && pixel == image->format->colorkey) continue;
+				Uint8 r, g, b;
+				SDL_GetRGB(pixel, image->format, &r, &g, &b);
+				Radar_Pixel dot = { x, y, SDL_MapRGB(cache->format, r, g, b) };
+				dots[d].push_back(dot);
+			}
 		}
-		
+		SDL_UnlockSurface(image);
 	}
-	// Display shield if it needs to be displayed and has energy left
-	if (shield > 0 && showShield > 0)
+	
+	// Heatmap cells take the colour of each team's fighter dot
+	for (int t = 0; t < 2; t++)
 	{
-		apply_surface( box.x - camera.x, box.y - camera.y, shieldTexture[type], screen);
-		showShield --;
+		team_colour[t][0] = team_colour[t][1] = team_colour[t][2] = 255;
+		if (!dots[t].empty())
+		{
+			Radar_Pixel &middle = dots[t][dots[t].size() / 2];
+			SDL_GetRGB(middle.colour, cache->format, &team_colour[t][0], &team_colour[t][1], &team_colour[t][2]);
+		}
+		heat[t].assign((w / RADAR_CELL + 1) * (h / RADAR_CELL + 1), 0);
 	}
-	
-	if (reveal > 0) reveal --;
-}
-Circle Ship::get_pod()
-{
-	return pod.get_coords();
+	frame = 0;
+	return true;
 }
-// Display health bar on screen
-void Ship::show_health( SDL_Surface *screen)
+void Radar::plot(int dot, int x, int y)
 {
-	int display_width = SCREEN_WIDTH - 170;
-	if (type < 3) apply_surface( display_width, 0, displaybar[0], screen);
-	else apply_surface(display_width, 0, displaybar[1], screen);
-
-	if (health < 100)
+	Uint8 *pixels = (Uint8*)cache->pixels;
+	int bpp = cache->format->BytesPerPixel;
+	for (unsigned int i = 0; i < dots[dot].size(); i++)
 	{
-		SDL_SetAlpha(healthbar[type], SDL_SRCALPHA, health*2);
+		int px = x + dots[dot][i].x;
+		int py = y + dots[dot][i].y;
+		if (px < 0 || py < 0 || px >= cache->w || py >= cache->h) continue;
+		put_pixel(pixels + py * cache->pitch + px * bpp, dots[dot][i].colour, bpp);
 	}
-	else
+}
+void Radar::draw_heatmap(Ship players[], std::vector<int> &shown, int viewer)
+{
+	int columns = cache->w / RADAR_CELL + 1;
+	for (int t = 0; t < 2; t++)
 	{
-		SDL_SetAlpha(healthbar[type], SDL_SRCALPHA, 200);
+		std::fill(heat[t].begin(), heat[t].end(), 0);
 	}
-	apply_surface( display_width+10, 0, healthbar[type], screen);
-	if (shield < 100)
+	for (unsigned int s = 0; s < shown.size(); s++)
 	{
-		SDL_SetAlpha(shieldbar, SDL_SRCALPHA, shield*2);
+		int i = shown[s];
+		if (i == viewer) continue;
+		int x = (players[i].get_coords().x / 100 + 7) / RADAR_CELL;
+		int y = (players[i].get_coords().y / 100 + 7) / RADAR_CELL;
+		if (x < columns && y * columns + x < (int)heat[0].size()) heat[players[i].get_team() - 1][y * columns + x]++;
 	}
-	else
+	
+	Uint8 *pixels = (Uint8*)cache->pixels;
+	int bpp = cache->format->BytesPerPixel;
+	for (unsigned int c = 0; c < heat[0].size(); c++)
 	{
-		SDL_SetAlpha(shieldbar, SDL_SRCALPHA, 200);
+		int blue = std::min(heat[0][c], RADAR_HEAT_MAX);
+		int red = std::min(heat[1][c], RADAR_HEAT_MAX);
+		if (blue == 0 && red == 0) continue;
+		// Mix the team colours by their share of the cell, brighter the more ships there are
+		int total = blue + red;
+		int bright = 96 + 159 * std::min(total, RADAR_HEAT_MAX) / RADAR_HEAT_MAX;
+		Uint8 rgb[3];
+		for (int k = 0; k < 3; k++)
+		{
+			rgb[k] = (Uint8)((team_colour[0][k] * blue + team_colour[1][k] * red) / total * bright / 255);
+		}
+		Uint32 colour = SDL_MapRGB(cache->format, rgb[0], rgb[1], rgb[2]);
+		if (colour == key) colour ^= 1;
+		int x1 = (c % columns) * RADAR_CELL;
+		int y1 = (c / columns) * RADAR_CELL;
+		for (int y = y1; y < y1 + RADAR_CELL && y < cache->h; y++)
+		{
+			for (int x = x1; x < x1 + RADAR_CELL && x < cache->w; x++)
+			{
+				put_pixel(pixels + y * cache->pitch + x * bpp, colour, bpp);
+			}
+		}
 	}
-	apply_surface( display_width+10, 0, shieldbar, screen);
 }
-void Ship::hurt(int damage)
+void Radar::show(Ship players[], std::vector<int> &shown, Planet planets[], int viewer)
 {
-	show_shield();
-	// If the shield is stronger than the damage, subtract damage from shield
-	if (shield > damage)
+	if (players[viewer].get_type() < 3) render_queue.add( LAYER_RADAR, 0, 0, assets.surface(radar_screen[0]) );
+	else render_queue.add( LAYER_RADAR, 0, 0, assets.surface(radar_screen[1]) );
+	if (cache == NULL) return;
+	
+	if (frame % RADAR_FRAMES == 0)
 	{
-		shield -= damage;
+		SDL_FillRect(cache, NULL, key);
+		SDL_LockSurface(cache);
+		for (int i = 0; i < MAX_PLANETS; i++)
+		{
+			plot(5 + planets[i].get_owner(), (planets[i].get_coords().x / 100)+7, (planets[i].get_coords().y / 100)+7);
+		}
+		if ((int)shown.size() > RADAR_HEATMAP) draw_heatmap(players, shown, viewer);
+		else
+		{
+			for (unsigned int s = 0; s < shown.size(); s++)
+			{
+				int i = shown[s];
+				if (i != viewer) plot(RADAR_TYPE_DOT[players[i].get_type()], (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7);
+			}
+		}
+		SDL_UnlockSurface(cache);
+		render_queue.redraw(cache);
 	}
-	// If shield has power left, subtract remainder from health and remove shield
-	else if (shield > 0)
+	frame++;
+	render_queue.add( LAYER_RADAR_DOTS, 0, 0, cache );
+	
+	// The player's own dot moves every frame
+	if (players[viewer].do_render()) render_queue.add( LAYER_RADAR_DOTS, (players[viewer].get_coords().x / 100)+7, (players[viewer].get_coords().y / 100)+7, assets.surface(radar_dot[RADAR_SELF_DOT]) );
+}
+
+/********************************************* MESSAGES *******************************************/
+/*
+ Length-prefixed messages over a stream socket, used between lockstep peers,
+ load test clients and the regions of a sharded match.
+*/
+#ifndef WIN32
+
+// Writes or reads exactly count bytes
+bool write_all(int fd, const char *bytes, int count)
+{
+	while (count > 0)
 	{
-		int newDamage = damage - shield;
-		shield = 0;
-		health -= newDamage;
+		int done = write(fd, bytes, count);
+		if (done <= 0) return false;
+		bytes += done;
+		count -= done;
 	}
-	// Otherwise, remove damage from health and destroy health <= 0
-	else
+	return true;
+}
+bool read_all(int fd, char *bytes, int count)
+{
+	while (count > 0)
 	{
-		if (health > damage) {health -= damage;}
-		else destroy();
+		int done = read(fd, bytes, count);
+		if (done <= 0) return false;
+		bytes += done;
+		count -= done;
 	}
-	reveal_ship();
+	return true;
 }
 
-void Ship::destroy()
+// A length-prefixed message sent over a socket
+class Message
 {
-	render = false;
-	health = 0;
-	moving = 0;
+	private:
+	std::vector<char> data;
+	unsigned int read_at;
+	
+	public:
+	Message();
+	void clear();
+	int size();
+	void put(const void *bytes, int count);
+	void put_int(int value);
+	// Reads the next count bytes, returning false if the message is too short
+	bool get(void *bytes, int count);
+	int get_int();
+	bool send(int fd);
+	bool receive(int fd);
+};
 
-	xVel = 0;
-	yVel = 0;
-	xDrift = 0;
-	yDrift = 0;
-	shield = 0;
+Message::Message()
+{
+	read_at = 0;
 }
-
-void Ship::show_shield()
+void Message::clear()
 {
-	showShield = 3;
+	data.clear();
+	read_at = 0;
 }
-
-void Ship::recharge_shield(int i)
+int Message::size()
 {
-	if (i == 0)
-	{
-		// If ship is not mothership, stop recharging
-		if (type != 2 || type != 5)
-		{
-			recharge = 0;
-		}
-	}
-	else recharge = 1;
+	return (int)data.size();
 }
-
-SDL_Rect Ship::get_coords()
+void Message::put(const void *bytes, int count)
 {
-	return box;
+	data.insert(data.end(), (const char*)bytes, (const char*)bytes + count);
 }
-Circle Ship::get_circle()
+void Message::put_int(int value)
 {
-	return circle;
+	put(&value, sizeof(value));
+}
+bool Message::get(void *bytes, int count)
+{
+	if (read_at + count > data.size()) return false;
+	memcpy(bytes, &data[read_at], count);
+	read_at += count;
+	return true;
+}
+int Message::get_int()
+{
+	int value = 0;
+	get(&value, sizeof(value));
+	return value;
 }
-Projectile Ship::get_proj()
+bool Message::send(int fd)
 {
-	return proj;
+	int length = size();
+	if (!write_all(fd, (const char*)&length, sizeof(length))) return false;
+	return length == 0 || write_all(fd, &data[0], length);
 }
-void Ship::destroy_proj()
+bool Message::receive(int fd)
 {
-	proj.destroy();
+	clear();
+	int length = 0;
+	if (!read_all(fd, (char*)&length, sizeof(length)) || length < 0) return false;
+	data.resize(length);
+	return length == 0 || read_all(fd, &data[0], length);
 }
 
-//// --- CODE RELATING TO ARTIFICIAL INTELLIGENCE FUNCTIONS --- ///
-// AI-Move, called if ai is active.
-void Ship::ai_move(Planet planets[], Ship players[])
-{	
-	if (ai_think >= 1 && render)
-	{
-		// If ship is a hunter
-		if (personality == HUNTER)
-		{
-			// If there are any enemies on the radar, set target as nearest visible enemy
-			if (enemyVisible(players))
-			{
-				int t =  get_nearest(players);
-				target = (Circle&)(Circle const&)players[t].get_circle();
-			}
-			// Otherwise, set the target as the nearest planet that needs to be captured
-			else
-			{
+#endif
 
-				int p = get_nearest(planets);
-				target = (Circle&)(Circle const&)planets[p].get_circle();
-				target.x += planets[p].get_circle().r + rand()%planets[p].get_circle().r - rand()%planets[p].get_circle().r;
-				target.y += planets[p].get_circle().r + rand()%planets[p].get_circle().r - rand()%planets[p].get_circle().r;				
-			}
-			// If an enemy is in-range, shoot at enemy
-			if (enemyInRange(players) > -1)
-			{
-				int t = enemyInRange(players);
-				target = (Circle&)(Circle const&)players[t].get_circle();
-				ai_shoot = true;
+/******************************************** LOCKSTEP CLASS *******************************************/
+/*
+ Input-only lockstep. Every peer simulates the same world from the same seed,
+ so each tick only the local player's input flags need to be exchanged, along
+ with a hash of the world so that a desync is caught on the tick it happens.
+ The peer is either a frame log (a recording session writes its frames and a
+ playback session reads them back as the remote peer and checks every hash) or
+ another running copy of the game on a Unix socket. Live peers send each other
+ their input before every tick and their world hash after it, so neither runs
+ ahead: a peer that pauses holds the other one up until it carries on.
+*/
+const int LOCKSTEP_OFF = 0;
+const int LOCKSTEP_RECORD = 1;
+const int LOCKSTEP_PLAYBACK = 2;
+const int LOCKSTEP_PEER = 3;
 
-			}
-			else ai_shoot = false;
-		}
-		else if (personality == MOTHERSHIP)
-		{
-			// Target is nearest uncaptured planet
-			int p = get_nearest(planets);
-			target = (Circle&)(Circle const&)planets[p].get_circle();
-			target.x += planets[p].get_circle().r;
-			target.y += planets[p].get_circle().r;
-		}
-		else if (personality == GUARDIAN)
-		{
-			// Target is mothership
-			target = (Circle&)(Circle const&)players[get_team()].get_circle();
-			if (enemyInRange(players) > -1)
-			{
-				int t = enemyInRange(players);
-				target = (Circle&)(Circle const&)players[t].get_circle();
-				ai_shoot = true;
-			}
-			else ai_shoot = false;
-		}
-		else if (personality == SCOUT)
-		{
-			// Target is nearest uncaptured planet
-			int p = get_nearest(planets);
-			target = (Circle&)(Circle const&)planets[p].get_circle();
-			target.x += planets[p].get_circle().r;
-			target.y += planets[p].get_circle().r;
-		
-			if (enemyInRange(players) > -1 && isOverPlanet(planets))
-			{
-				int t = enemyInRange(players);
-				target = (Circle&)(Circle const&)players[t].get_circle();
-				ai_shoot = true;
-			}
-			else ai_shoot = false;
-		}
-	// Recreate delay on thinking
-	ai_think = -3;
-	set_angle(circle, target);
-	}
-	else ai_think++;
+class Lockstep
+{
+	private:
+	FILE *file;
+	std::string filename;
+	int mode;
+	int tick;
+	// Hash the remote peer reported for the current tick
+	Uint32 remote_hash;
+	bool done;
+	// Socket to a live peer, whether this side hosts the match, and the joining peer's input this tick
+	int link;
+	bool hosting;
+	Uint8 peer_input;
 	
-	if (angle != desired_angle)
+	// Sends this side's value for the tick and reads the peer's, returning false if the peer is gone
+	bool trade(int value, int &remote);
+	
+	public:
+	// The match every peer starts from
+	Uint32 seed;
+	int player_type;
+	
+	Lockstep();
+	// Opens a frame log to write to / read from
+	bool record(const char *name);
+	bool playback(const char *name);
+	// Hosts a match on a Unix socket and waits for a peer to join it, or joins one
+	bool host(const char *path);
+	bool join(const char *path);
+	// True on the peer that joined
+	bool joined();
+	// Starts a new match (recording sessions restart the log, and a joining peer takes the host's)
+	void start(Uint32 s, int type);
+	int get_mode();
+	int get_tick();
+	// Returns the input to simulate this tick for the first ship and sends the local one
+	Uint8 exchange(Uint8 local);
+	// Input of the joining peer's ship this tick
+	Uint8 get_peer_input();
+	// Ends the tick, returning false if this world no longer matches the peer's
+	bool end_tick(Uint32 hash);
+	// True once playback has run out of frames or the live peer has left
+	bool finished();
+	void close();
+};
+
+Lockstep::Lockstep()
+{
+	file = NULL;
+	mode = LOCKSTEP_OFF;
+	tick = 0;
+	remote_hash = 0;
+	done = false;
+	link = -1;
+	hosting = false;
+	peer_input = 0;
+	seed = 0;
+	player_type = 0;
+}
+bool Lockstep::record(const char *name)
+{
+	filename = name;
+	mode = LOCKSTEP_RECORD;
+	return true;
+}
+bool Lockstep::playback(const char *name)
+{
+	file = fopen(name, "r");
+	if (file == NULL) return false;
+	
+	// Header holds the seed and player type of the match
+	if (fscanf(file, "COLONIES-LOCKSTEP %u %d\n", &seed, &player_type) != 2)
 	{
-		if (angle < desired_angle) rotate = 1;
-		else rotate = -1;
-		
+		close();
+		return false;
 	}
-	else rotate = 0;
-	
-	// Rotate to meet desired angle
-	if (rotate == -1)
+	mode = LOCKSTEP_PLAYBACK;
+	return true;
+}
+bool Lockstep::host(const char *path)
+{
+#ifdef WIN32
+	return false;
+#else
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0) return false;
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	unlink(path);
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 1) != 0)
 	{
-		if (angle-1 > -1) angle -= 1;
-		else angle = 15;
+		::close(listener);
+		return false;
 	}
-	if (rotate == 1)
+	fprintf(stderr, "Waiting for a peer on %s\n", path);
+	link = accept(listener, NULL, NULL);
+	::close(listener);
+	unlink(path);
+	if (link < 0) return false;
+	hosting = true;
+	mode = LOCKSTEP_PEER;
+	// A peer that leaves shows up as a failed write instead of stopping this process
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+#endif
+}
+bool Lockstep::join(const char *path)
+{
+#ifdef WIN32
+	return false;
+#else
+	link = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (link < 0) return false;
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	if (connect(link, (sockaddr*)&address, sizeof(address)) != 0)
 	{
-		if (angle+1 < 16) angle += 1;
-		else angle = 0;
+		::close(link);
+		link = -1;
+		return false;
 	}
-	
-	// Set movement variables
-	if (get_distance(circle, target) > target.r)
+	hosting = false;
+	mode = LOCKSTEP_PEER;
+	signal(SIGPIPE, SIG_IGN);
+	return true;
+#endif
+}
+bool Lockstep::joined()
+{
+	return mode == LOCKSTEP_PEER && !hosting;
+}
+bool Lockstep::trade(int value, int &remote)
+{
+#ifdef WIN32
+	return false;
+#else
+	Message message;
+	message.put_int(tick);
+	message.put_int(value);
+	if (!message.send(link) || !message.receive(link)) return false;
+	// Both peers are always on the same tick, so anything else means the stream is broken
+	if (message.get_int() != tick) return false;
+	remote = message.get_int();
+	return true;
+#endif
+}
+void Lockstep::start(Uint32 s, int type)
+{
+	seed = s;
+	player_type = type;
+	tick = 0;
+	if (mode == LOCKSTEP_PEER)
 	{
-		breaking = 0;
-		moving = 1; 
+		// The host picks the match and the peer that joined plays it
+		int remote_seed = 0, remote_type = 0;
+		if (!trade((int)seed, remote_seed) || !trade(player_type, remote_type)) done = true;
+		else if (!hosting)
+		{
+			seed = (Uint32)remote_seed;
+			player_type = remote_type;
+		}
 	}
-	else 
+	if (mode == LOCKSTEP_RECORD)
 	{
-		breaking = 1;
+		if (file != NULL) fclose(file);
+		file = fopen(filename.c_str(), "w");
+		if (file != NULL) fprintf(file, "COLONIES-LOCKSTEP %u %d\n", seed, player_type);
 	}
-	if (breaking == 1 && moving == 1)
+}
+int Lockstep::get_mode()
+{
+	return mode;
+}
+int Lockstep::get_tick()
+{
+	return tick;
+}
+Uint8 Lockstep::exchange(Uint8 local)
+{
+	if (mode == LOCKSTEP_PLAYBACK)
 	{
-		xDrift = xVel;
-		yDrift = yVel;
-		moving = 0;
-		accelerating = 0;
-		xVel = 0;
-		yVel = 0;
+		int t, input;
+		if (fscanf(file, "%d %d %u\n", &t, &input, &remote_hash) != 3 || t != tick)
+		{
+			done = true;
+			return 0;
+		}
+		return (Uint8)input;
 	}
-	if (breaking == 1)
+	if (mode == LOCKSTEP_PEER)
 	{
-		xDrift -= xDrift / 2;
-		yDrift -= yDrift / 2;
+		int remote = 0;
+		if (done || !trade(local, remote))
+		{
+			done = true;
+			return 0;
+		}
+		peer_input = hosting ? (Uint8)remote : local;
+		return hosting ? local : (Uint8)remote;
 	}
-	// Move forward
-	if (moving == 1)
+	if (mode == LOCKSTEP_RECORD && file != NULL)
 	{
-		// Calculate velocities
-		float rad = (float)0.392697 * (angle-4);
-		if (accelerating < speed) accelerating ++;
-		lastX = (int)(cos(rad) * accelerating);
-		lastY = (int)(sin(rad) * accelerating); 
-		xVel = lastX;
-		yVel = lastY;
-		// Calculate and apply drift
-		if (xDrift == 0.0){}
-		else if (xDrift < 0.0) xDrift ++;
-		else xDrift --;
-		if (yDrift == 0.0){}
-		else if (yDrift < 0.0) yDrift ++;
-		else yDrift --;
+		fprintf(file, "%d %d ", tick, local);
 	}
-	else
+	return local;
+}
+Uint8 Lockstep::get_peer_input()
+{
+	return peer_input;
+}
+bool Lockstep::end_tick(Uint32 hash)
+{
+	bool synced = true;
+	if (mode == LOCKSTEP_PEER && !done)
 	{
-		// Calculate normal drift
-		if (xDrift == 0.0){}
-		else if (xDrift < 0.0) xDrift += 0.2;
-		else xDrift -= 0.2;
-		if (yDrift == 0.0){}
-		else if (yDrift < 0.0) yDrift += 0.2;
-		else yDrift -= 0.2;
+		int remote = 0;
+		if (!trade((int)hash, remote)) done = true;
+		else remote_hash = (Uint32)remote;
 	}
-	if (!proj.active() && ai_shoot) 
+	if ((mode == LOCKSTEP_PLAYBACK || mode == LOCKSTEP_PEER) && !done && hash != remote_hash)
 	{
-		float rad = (float)0.39269908169872414 * (angle-4);
-		int projX = (int)(cos(rad) * 30);
-		int projY = (int)(sin(rad) * 30); 
-		proj.shoot(box.x + (shipSize/2), box.y + (shipSize/2), projX, projY);
+		fprintf(stderr, "Lockstep desync at tick %d\n", tick);
+		synced = false;
 	}
-	if ((box.x + xVel + xDrift) < 0 || (box.x + xVel + xDrift + box.w) > LEVEL_WIDTH){}
-	else 
-	{	
-		box.x +=xVel + (Sint16)xDrift;
-		circle.x = box.x + shipSize/2;
+	if (mode == LOCKSTEP_RECORD && file != NULL)
+	{
+		fprintf(file, "%u\n", hash);
+	}
+	tick++;
+	return synced;
+}
+bool Lockstep::finished()
+{
+	return done;
+}
+void Lockstep::close()
+{
+	if (file != NULL) fclose(file);
+	file = NULL;
+#ifndef WIN32
+	if (link >= 0) ::close(link);
+#endif
+	link = -1;
+	mode = LOCKSTEP_OFF;
+}
+
+/******************************************** ROOM CLASS *******************************************/
+/*
+ One match: its world state, planets and ships. A process can run many rooms
+ at once because nothing in a match lives outside its room.
+*/
 
-	}
-	if ((box.y + yVel + yDrift) < 0 || (box.y + yVel + yDrift + box.h) > LEVEL_HEIGHT){}
-	else 
-	{
-		box.y +=yVel + (Sint16)yDrift;
-		circle.y = box.y + shipSize/2;
+// How a region of a sharded match holds each ship
+const Uint8 SHIP_LOCAL = 0; // Simulated here
+const Uint8 SHIP_GHOST = 1; // Read-only copy of a ship near this region, fresh this tick
+const Uint8 SHIP_REMOTE = 2; // Owned by another region, last known state
 
-	}
-}
-// Calculate the angle the ship should be facing given the target location and the ship's current location
-// A Circle holds an x,y location and a radius (r).
-// Circle 1 = ships location. Circle 2 = target location
-void Ship::set_angle(Circle one, Circle two)
+// Damage done to a ship that is simulated elsewhere
+struct Hit
+{
+	int ship, damage;
+};
+// Capture progress made on a planet
+struct Capture
+{
+	int planet, strength, team;
+};
+// A ship wrecked during a tick, for the explosion to be played over
+struct Blast
+{
+	SDL_Rect box;
+	int type;
+};
+
+class Room
 {
-	int x;
-	int y;
-	if (one.x < two.x) x = two.x - one.x;
-	else x = one.x - two.x;
-	if (one.y < two.y) y = two.y - one.y;
-	else y = one.y - two.y;
+	private:
+	// Rooms own their ships and can't be copied
+	Room(const Room &);
+	Room &operator=(const Room &);
 	
-	if(one.x == two.x && one.y == two.y) desired_angle = angle;
-	else if(one.x == two.x && one.y > two.y) desired_angle = 0;
-	else if (one.x < two.x && one.y == two.y) desired_angle = 4;
-	else if (one.x == two.x && one.y < two.y) desired_angle = 8;
-	else if (one.x > two.x && one.y == two.y) desired_angle = 12;
-	else
-	{
-		float radians = atan((float)x/(float)y);		
-		if (one.x < two.x && one.y > two.y){} //  add 0
-		else if (one.x < two.x && one.y < two.y) radians += (float)1.57079633; // add 90
-		else if (one.x > two.x && one.y < two.y) radians += (float)3.14159265; // add 180
-		else if (one.x > two.x && one.y > two.y) radians = (float)6.28318531 - radians;// 4.71238898; // add 270
-		
-		desired_angle = (int)((float)radians / 0.392697);
-	}	
-}
-void Ship::get_heading()
+	public:
+	World world;
+	Planet planets[MAX_PLANETS];
+	Ship *players;
+	Projectile_Pool projectiles;
+	
+	// Spatial index of the level and the entities relevant to the player
+	World_Index world_index;
+	Interest interest;
+	
+	// Scheduling: ticks per second, when the next tick is due and whether a worker has the room
+	int id;
+	int tick_rate;
+	double next_tick;
+	bool busy;
+	bool closing;
+	// Tick cost since the last report (milliseconds)
+	double cost_total, cost_max;
+	int cost_ticks;
+	
+	// Set when the room is one region of a sharded match: how each ship is held,
+	// and the effects on ships and planets this region does not own
+	std::vector<Uint8> presence;
+	std::vector<Hit> hits;
+	std::vector<Capture> captures;
+	
+	// Ticks run since the world was created, and the ships wrecked on the last one
+	int ticks;
+	std::vector<Blast> blasts;
+	// Ships found near a projectile, reused every tick
+	std::vector<int> nearby;
+	
+	Room(int count, int rate);
+	~Room();
+	void create_world(int type, Uint32 seed);
+	void tick();
+	// Updates one ship, recording a blast if it was wrecked this tick
+	void advance(int ship);
+	// Hash of everything the simulation depends on
+	Uint32 hash();
+	// True if this room simulates the ship / can see its current state
+	bool owns(int ship);
+	bool sees(int ship);
+};
+
+Room::Room(int count, int rate)
 {
-	set_angle(circle, target);
-	float rad = (float)0.392697 * (angle-4);
-	if (accelerating < speed && moving == 1) accelerating ++;
-	lastX = (int)(cos(rad) * accelerating);
-	lastY = (int)(sin(rad) * accelerating); 
+	players = new Ship[count];
+	// A ship can have at most one shot per tick of range in flight
+	projectiles.reserve(count * PROJECTILE_RANGE);
+	world.projectiles = &projectiles;
+	world.player_count = count;
+	world.this_mothership = 1;
+	world.enemy_mothership = 2;
+	world.blue_mother = 0;
+	world.red_mother = 1;
+	world.mothership[0].x = 0;
+	world.mothership[1].x = 0;
+	world.camera.x = 0;
+	world.camera.y = 0;
+	world.camera.w = screen_width;
+	world.camera.h = screen_height;
+	world.paused = true;
+	ticks = 0;
+	
+	id = 0;
+	tick_rate = rate;
+	next_tick = 0;
+	busy = false;
+	closing = false;
+	cost_total = 0;
+	cost_max = 0;
+	cost_ticks = 0;
 }
-bool Ship::isOverPlanet(Planet planets[])
+Room::~Room()
 {
-	for (int i = 0; i < MAX_PLANETS; i++)
-	{
-		if (get_distance((Circle&)(Circle const&)planets[i].get_circle(), (Circle&)(Circle const&)circle) <= planets[i].get_circle().r) return true;
-	}
-	return false;
+	delete [] players;
 }
-bool Ship::enemyVisible(Ship players[])
+Uint32 Room::hash()
 {
-	for (int i = 0; i < MAX_PLAYERS; i++)
+	Uint32 h = 2166136261u;
+	for (int i = 0; i < MAX_PLANETS; i++)
 	{
-		if (players[i].get_team() != get_team())
-		{
-			if (players[i].revealed())
-			{
-				return true;
-			}
-		}
+		h = planets[i].hash(h);
 	}
-	return false;
-}
-int Ship::enemyInRange(Ship players[])
-{
-	for (int i = 0; i < MAX_PLAYERS; i++)
+	for (int i = 0; i < world.player_count; i++)
 	{
-		if (players[i].get_team() != get_team() && get_distance(players[i].get_circle(), circle) < 750 && players[i].do_render())
-		{
-			return i;
-		}
+		h = players[i].hash(h);
 	}
-	return -1;
+	return projectiles.hash(h);
 }
-bool Ship::revealed()
+bool Room::owns(int ship)
 {
-	if (reveal > 0) return true;
-	else return false;
+	return presence.empty() || presence[ship] == SHIP_LOCAL;
 }
-void Ship::reveal_ship()
+bool Room::sees(int ship)
 {
-	reveal = 200;
+	return presence.empty() || presence[ship] != SHIP_REMOTE;
 }
-int Ship::get_nearest(Planet planets[])
+// Creates a new match from a seed. The same seed and player type always give the same world.
+void Room::create_world(int type, Uint32 seed)
 {
+	world.rng.seed(seed);
+	ticks = 0;
+	blasts.clear();
+	projectiles.clear();
 	
-	int nearest = -1;
+	// Start every ship from scratch
+	for (int i = 0; i < world.player_count; i++)
+	{
+		players[i] = Ship();
+		players[i].set_world(&world, i);
+	}
+	world.mothership[0].x = 0;
+	world.mothership[1].x = 0;
+	
+	// Create planets, keeping them apart
 	int count = 0;
-	// Set nearest planet not owned by team
-	while (nearest == -1)
+	while (count < MAX_PLANETS)
 	{
-		if (planets[count].get_owner() != get_team()) 
+		int kind = world.rng.next(4);
+		Circle temp;
+		temp.x = world.rng.next(14200);
+		temp.y = world.rng.next(14200);
+		for (int i = 0; i < count; i++)
 		{
-			nearest = count;
+			if (get_distance(temp, planets[i].get_circle()) < 1200)
+			{
+				temp.x = world.rng.next(14200);
+				temp.y = world.rng.next(14200);
+				i = -1;
+			}
 		}
-		else count ++;
+		planets[count].create(kind, temp.x, temp.y);
+		count++;
+	}
+	// Set motherships
+	players[1].set_type(2);
+	players[2].set_type(5);
+	// Make motherships distance further apart if necessary
+	while (get_distance(players[1].get_circle(), players[2].get_circle()) < 10000)
+	{
+		players[2].set_type(5);
 	}
 	
-	// Find planet closer than nearest until all planets are searched
-	// For the cases where the owner is not team and i is not = nearest
-	for (int i = 0; i < MAX_PLANETS; i++)
+	// The player's team decides which mothership is theirs
+	if (type < 3) 
 	{
-		if(planets[i].get_owner() != get_team() && nearest != i)
+		world.this_mothership = 1;
+		world.blue_mother = 0;
+		world.red_mother = 1;
+		world.enemy_mothership = 2;
+	}
+	else 
+	{
+		world.this_mothership = 2;
+		world.blue_mother = 1;
+		world.red_mother = 0;
+		world.enemy_mothership = 1;
+	}
+	// Set reference boxes
+	world.mothership[0] = players[world.this_mothership].get_coords();
+	world.mothership[1] = players[world.enemy_mothership].get_coords();
+	players[0].set_type(type);
+	
+	// init AI
+	players[1].ai_on();
+	players[2].ai_on();
+
+	// init other players and distribute equally between both teams
+	for (int i = 3; i < (world.player_count/2)+1; i++)
+	{
+		int kind = world.rng.next(2);
+		players[i].set_type(kind);
+		players[i].ai_on(); 
+	}
+	for (int i = (world.player_count/2)+1; i < world.player_count; i++)
+	{
+		int kind = world.rng.next(5);
+		while (kind < 3)
 		{
-			if( get_distance((Circle&)(Circle const&)planets[i].get_circle(), (Circle&)(Circle const&)circle) < get_distance((Circle&)(Circle const&)planets[nearest].get_circle(),(Circle&)(Circle const&)circle))
-			{
-				nearest = i;
-			}
+			kind = world.rng.next(5);
 		}
+		players[i].set_type(kind);
+		players[i].ai_on();
 	}
-	return nearest;
+	world_index.build(players, world.player_count, projectiles);
 }
-int Ship::get_nearest(Ship players[])
+
+// Runs one tick of the simulation: collisions, planet capture and movement.
+// A region of a sharded match only runs its own ships and records what they do to the rest.
+void Room::tick()
 {
-	
-	int nearest = -1;
-	int count = 0;
-	// Set nearest player not on same team
-	while (nearest == -1)
+	ticks++;
+	blasts.clear();
+	// Check collision between ships 
+	// Check all players for collisions
+	for(int i= 0 ; i < world.player_count; i++)
 	{
-		if (players[count].get_team() != get_team()) 
+		if (!owns(i)) continue;
+		for (int c = 0; c < world.player_count; c++)
 		{
-			nearest = count;
+			// Check that the two players are not the same and are both alive
+			if( i!= c && sees(c) && players[i].do_render() && players[c].do_render())
+			{	
+				// Check each player for a colision
+				if (check_collision((Circle&)(Circle const&)players[i].get_circle(), (Circle&)(Circle const&)players[c].get_circle()) == true)			
+				{
+					// If player is on team one and is colliding with mothership, recharge shield
+					if (players[i].get_team() == 1 && players[c].get_type() == 2)
+					{
+						players[i].recharge_shield(1);
+					}
+					// Above for team 2
+					else if (players[i].get_team() == 2 && players[c].get_type() == 5)
+					{
+						players[i].recharge_shield(1);
+					}
+					// NOTE: Collision detection between ships was removed to enhance gameplay, as the 'bounce' function made the gameplay frustrating
+				}
+			}
+			
 		}
-		else count ++;
 	}
-	
-	// Find player closer than nearest until all planets are searched
-	// For the cases where the team is not same and i is not = nearest
-	for (int i = 0; i < MAX_PLAYERS; i++)
+	// Check each projectile against the ships around it. A region's shots stay with
+	// it until they fade, even if the ship that fired them has migrated.
+	// Shots travel further than a light ship is wide in one tick, so the whole path
+	// of the last move is tested, not just where the shot ended up.
+	int s = 0;
+	while (s < projectiles.size())
 	{
-		if(players[i].get_team() != get_team() && nearest != i)
+		nearby.clear();
+		world_index.ships.query(projectiles.get_sweep(s), nearby);
+		int half = PROJECTILE_SIZE / 2;
+		int toX = projectiles.x[s] + half;
+		int toY = projectiles.y[s] + half;
+		int fromX = toX;
+		int fromY = toY;
+		if (projectiles.ticks[s] > 0)
 		{
-			if( get_distance((Circle&)(Circle const&)players[i].get_circle(), (Circle&)(Circle const&)circle) < get_distance((Circle&)(Circle const&)players[nearest].get_circle(),(Circle&)(Circle const&)circle))
+			fromX -= projectiles.xVel[s];
+			fromY -= projectiles.yVel[s];
+		}
+		// The nearest ship along the path is the one hit
+		int target = -1;
+		Sint64 nearest = 0;
+		for (unsigned int n = 0; n < nearby.size(); n++)
+		{
+			int c = nearby[n];
+			// Do not allow friendly fire
+			if (c == projectiles.owner[s] || !sees(c) || !players[c].do_render() || players[c].get_team() == projectiles.team[s]) continue;
+			Circle body = players[c].get_circle();
+			body.r += half;
+			if (!check_sweep(fromX, fromY, toX, toY, body)) continue;
+			Sint64 along = (Sint64)(body.x - fromX) * (toX - fromX) + (Sint64)(body.y - fromY) * (toY - fromY);
+			if (target < 0 || along < nearest || (along == nearest && c < target))
 			{
-				nearest = i;
+				target = c;
+				nearest = along;
 			}
 		}
+		if (target < 0)
+		{
+			s++;
+			continue;
+		}
+		if (owns(target)) players[target].hurt(projectiles.damage[s]);
+		else
+		{
+			Hit hit = { target, projectiles.damage[s] };
+			hits.push_back(hit);
+		}
+		projectiles.retire(s);
 	}
-	return nearest;
-}
-
-int Ship::get_team()
-{
-	if (type < 3) return 1;
-	else return 2;
-}
-int Ship::get_distance(Circle one, Circle two)
-{
-	int x = 0;
-	int y = 0;
-	Circle a = one;
-	Circle b = two;
-	
-	// if a < b, subtract it from b, else vice versa
-	if (a.x < b.x) x = b.x - a.x;
-	else x = a.x - b.x;
+	for (int i = 0; i< MAX_PLANETS; i++)
+	{
+		for (int c = 0; c < world.player_count; c++)
+		{	
+			// if player collides with planet - begin capture
+			if (owns(c) && collision((SDL_Rect&)(SDL_Rect const&)planets[i].get_coords(), (SDL_Rect&)(SDL_Rect const&)players[c].get_coords()) == true && players[c].do_render())
+			{
+				Capture capture = { i, players[c].get_damage()/2, 2 };
+				if (players[c].get_type() < 3) capture.team = 1;
+				// Planets of a sharded match are kept by the coordinator
+				if (presence.empty()) planets[i].capture(capture.strength, capture.team);
+				else captures.push_back(capture);
+			}
+		}
 	
-	if (a.y < b.y) y = b.y - a.y;
-	else y = a.y - b.y;
+	}
+
+	for (int i = 0; i < world.player_count; i++)
+	{
+		if (owns(i)) players[i].move(planets, players);
+	}
+	// Advance projectiles, pods and wrecks, motherships first
+	if (owns(world.this_mothership)) advance(world.this_mothership);
+	if (owns(world.enemy_mothership)) advance(world.enemy_mothership);
+	for (int i = 0; i < world.player_count; i++)
+	{
+		if (i == world.this_mothership || i == world.enemy_mothership || !owns(i)) {}
+		else advance(i);
+	}
+	if (owns(world.this_mothership)) world.mothership[0] = players[world.this_mothership].get_coords();
+	if (owns(world.enemy_mothership)) world.mothership[1] = players[world.enemy_mothership].get_coords();
+	projectiles.move();
 	
-	return x + y;
+	// Work out what the player needs to see this tick
+	world_index.build(players, world.player_count, projectiles);
+	interest.update(players, world.player_count, planets, world_index);
 }
 
+void Room::advance(int ship)
+{
+	if (players[ship].update())
+	{
+		Blast blast = { players[ship].get_wreck(), players[ship].get_type() };
+		blasts.push_back(blast);
+	}
+}
 
 /******************************************** TIMER CLASS *******************************************/
 //The timer class
@@ -1818,41 +6179,22 @@ bool Timer::is_paused()
     return paused;    
 }
 
-/*************************************************** LOAD IMAGE METHOD ***********************************/
-SDL_Surface *load_image( std::string filename ) 
+// Returns the time in milliseconds with sub-millisecond precision (used for profiling)
+double precise_ticks()
 {
-    //Temporary storage for the image that's loaded
-    SDL_Surface* loadedImage = NULL;
-    
-    //The optimized image that will be used
-    SDL_Surface* optimizedImage = NULL;
-    
-    //Load the image
-    loadedImage = IMG_Load( filename.c_str() );
-    
-    //If nothing went wrong in loading the image
-    if( loadedImage != NULL )
-    {
-        //Create an optimized image
-        optimizedImage = SDL_DisplayFormat( loadedImage );
-        
-        //Free the old image
-        SDL_FreeSurface( loadedImage );
-        
-        //If the image was optimized just fine
-        if( optimizedImage != NULL )
-        {
-            //Set all pixels of color 0x00FFFF to be transparent
-	    Uint32 colorkey = SDL_MapRGB( optimizedImage->format, 255, 0, 255 );
-            SDL_SetColorKey( optimizedImage, SDL_RLEACCEL | SDL_SRCCOLORKEY, colorkey );
-        }
-    }
-    
-    //Return the optimized image
-    return optimizedImage;
+#ifdef WIN32
+	LARGE_INTEGER now, frequency;
+	QueryPerformanceCounter(&now);
+	QueryPerformanceFrequency(&frequency);
+	return (double)now.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000.0 + now.tv_usec / 1000.0;
+#endif
 }
 
-
+/*************************************************** LOAD IMAGE METHOD ***********************************/
 bool init()
 {
     //Initialize all SDL sub systems
@@ -1862,8 +6204,8 @@ bool init()
     }
     
     //Set up the screen
-	if (FULL_SCREEN_MODE == 1) screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SDL_FULLSCREEN );
-    else screen = SDL_SetVideoMode( SCREEN_WIDTH, SCREEN_HEIGHT, SCREEN_BPP, SDL_SWSURFACE );
+	if (FULL_SCREEN_MODE == 1) screen = SDL_SetVideoMode( screen_width, screen_height, screen_bpp, SDL_FULLSCREEN );
+    else screen = SDL_SetVideoMode( screen_width, screen_height, screen_bpp, SDL_SWSURFACE );
     //If there was in error in setting up the screen
     if( screen == NULL )
     {
@@ -1877,367 +6219,157 @@ bool init()
     return true;
 }
 
-bool load_files()
-{
-    //Load the ship image
-	// Light 1 Textures
-	ships[0][0][1] = load_image( "light1on/1.gif");
-	ships[0][1][1] = load_image( "light1on/2.gif");
-	ships[0][2][1] = load_image( "light1on/3.gif");
-	ships[0][3][1] = load_image( "light1on/4.gif");
-	ships[0][4][1] = load_image( "light1on/5.gif");
-	ships[0][5][1] = load_image( "light1on/6.gif");
-	ships[0][6][1] = load_image( "light1on/7.gif");
-	ships[0][7][1] = load_image( "light1on/8.gif");
-	ships[0][8][1] = load_image( "light1on/9.gif");
-	ships[0][9][1] = load_image( "light1on/10.gif");
-	ships[0][10][1] = load_image( "light1on/11.gif");
-	ships[0][11][1] = load_image( "light1on/12.gif");
-	ships[0][12][1] = load_image( "light1on/13.gif");
-	ships[0][13][1] = load_image( "light1on/14.gif");
-	ships[0][14][1] = load_image( "light1on/15.gif");
-	ships[0][15][1] = load_image( "light1on/16.gif");
-	
-    ships[0][0][0] = load_image( "light1off/1.gif");
-	ships[0][1][0] = load_image( "light1off/2.gif");
-	ships[0][2][0] = load_image( "light1off/3.gif");
-	ships[0][3][0] = load_image( "light1off/4.gif");
-	ships[0][4][0] = load_image( "light1off/5.gif");
-	ships[0][5][0] = load_image( "light1off/6.gif");
-	ships[0][6][0] = load_image( "light1off/7.gif");
-	ships[0][7][0] = load_image( "light1off/8.gif");
-	ships[0][8][0] = load_image( "light1off/9.gif");
-	ships[0][9][0] = load_image( "light1off/10.gif");
-	ships[0][10][0] = load_image( "light1off/11.gif");
-	ships[0][11][0] = load_image( "light1off/12.gif");
-	ships[0][12][0] = load_image( "light1off/13.gif");
-	ships[0][13][0] = load_image( "light1off/14.gif");
-	ships[0][14][0] = load_image( "light1off/15.gif");
-	ships[0][15][0] = load_image( "light1off/16.gif");
-	
-	// Heavy 1 textures
-	ships[1][0][0] = load_image( "heavy1off/1.gif");
-	ships[1][1][0] = load_image( "heavy1off/2.gif");
-	ships[1][2][0] = load_image( "heavy1off/3.gif");
-	ships[1][3][0] = load_image( "heavy1off/4.gif");
-	ships[1][4][0] = load_image( "heavy1off/5.gif");
-	ships[1][5][0] = load_image( "heavy1off/6.gif");
-	ships[1][6][0] = load_image( "heavy1off/7.gif");
-	ships[1][7][0] = load_image( "heavy1off/8.gif");
-	ships[1][8][0] = load_image( "heavy1off/9.gif");
-	ships[1][9][0] = load_image( "heavy1off/10.gif");
-	ships[1][10][0] = load_image( "heavy1off/11.gif");
-	ships[1][11][0] = load_image( "heavy1off/12.gif");
-	ships[1][12][0] = load_image( "heavy1off/13.gif");
-	ships[1][13][0] = load_image( "heavy1off/14.gif");
-	ships[1][14][0] = load_image( "heavy1off/15.gif");
-	ships[1][15][0] = load_image( "heavy1off/16.gif");
-	
-	ships[1][0][1] = load_image( "heavy1on/1.gif");
-	ships[1][1][1] = load_image( "heavy1on/2.gif");
-	ships[1][2][1] = load_image( "heavy1on/3.gif");
-	ships[1][3][1] = load_image( "heavy1on/4.gif");
-	ships[1][4][1] = load_image( "heavy1on/5.gif");
-	ships[1][5][1] = load_image( "heavy1on/6.gif");
-	ships[1][6][1] = load_image( "heavy1on/7.gif");
-	ships[1][7][1] = load_image( "heavy1on/8.gif");
-	ships[1][8][1] = load_image( "heavy1on/9.gif");
-	ships[1][9][1] = load_image( "heavy1on/10.gif");
-	ships[1][10][1] = load_image( "heavy1on/11.gif");
-	ships[1][11][1] = load_image( "heavy1on/12.gif");
-	ships[1][12][1] = load_image( "heavy1on/13.gif");
-	ships[1][13][1] = load_image( "heavy1on/14.gif");
-	ships[1][14][1] = load_image( "heavy1on/15.gif");
-	ships[1][15][1] = load_image( "heavy1on/16.gif");
-
-	// Mothership 1 textures
-	ships[2][0][0] = load_image( "mother1off/1.gif");
-	ships[2][1][0] = load_image( "mother1off/2.gif");
-	ships[2][2][0] = load_image( "mother1off/3.gif");
-	ships[2][3][0] = load_image( "mother1off/4.gif");
-	ships[2][4][0] = load_image( "mother1off/5.gif");
-	ships[2][5][0] = load_image( "mother1off/6.gif");
-	ships[2][6][0] = load_image( "mother1off/7.gif");
-	ships[2][7][0] = load_image( "mother1off/8.gif");
-	ships[2][8][0] = load_image( "mother1off/9.gif");
-	ships[2][9][0] = load_image( "mother1off/10.gif");
-	ships[2][10][0] = load_image( "mother1off/11.gif");
-	ships[2][11][0] = load_image( "mother1off/12.gif");
-	ships[2][12][0] = load_image( "mother1off/13.gif");
-	ships[2][13][0] = load_image( "mother1off/14.gif");
-	ships[2][14][0] = load_image( "mother1off/15.gif");
-	ships[2][15][0] = load_image( "mother1off/16.gif");
-	
-	ships[2][0][1] = load_image( "mother1on/1.gif");
-	ships[2][1][1] = load_image( "mother1on/2.gif");
-	ships[2][2][1] = load_image( "mother1on/3.gif");
-	ships[2][3][1] = load_image( "mother1on/4.gif");
-	ships[2][4][1] = load_image( "mother1on/5.gif");
-	ships[2][5][1] = load_image( "mother1on/6.gif");
-	ships[2][6][1] = load_image( "mother1on/7.gif");
-	ships[2][7][1] = load_image( "mother1on/8.gif");
-	ships[2][8][1] = load_image( "mother1on/9.gif");
-	ships[2][9][1] = load_image( "mother1on/10.gif");
-	ships[2][10][1] = load_image( "mother1on/11.gif");
-	ships[2][11][1] = load_image( "mother1on/12.gif");
-	ships[2][12][1] = load_image( "mother1on/13.gif");
-	ships[2][13][1] = load_image( "mother1on/14.gif");
-	ships[2][14][1] = load_image( "mother1on/15.gif");
-	ships[2][15][1] = load_image( "mother1on/16.gif");
-
-	// Light 2 Textures
-	ships[3][0][1] = load_image( "light2on/1.gif");
-	ships[3][1][1] = load_image( "light2on/2.gif");
-	ships[3][2][1] = load_image( "light2on/3.gif");
-	ships[3][3][1] = load_image( "light2on/4.gif");
-	ships[3][4][1] = load_image( "light2on/5.gif");
-	ships[3][5][1] = load_image( "light2on/6.gif");
-	ships[3][6][1] = load_image( "light2on/7.gif");
-	ships[3][7][1] = load_image( "light2on/8.gif");
-	ships[3][8][1] = load_image( "light2on/9.gif");
-	ships[3][9][1] = load_image( "light2on/10.gif");
-	ships[3][10][1] = load_image( "light2on/11.gif");
-	ships[3][11][1] = load_image( "light2on/12.gif");
-	ships[3][12][1] = load_image( "light2on/13.gif");
-	ships[3][13][1] = load_image( "light2on/14.gif");
-	ships[3][14][1] = load_image( "light2on/15.gif");
-	ships[3][15][1] = load_image( "light2on/16.gif");
-	
-
-    ships[3][0][0] = load_image( "light2off/1.gif");
-	ships[3][1][0] = load_image( "light2off/2.gif");
-	ships[3][2][0] = load_image( "light2off/3.gif");
-	ships[3][3][0] = load_image( "light2off/4.gif");
-	ships[3][4][0] = load_image( "light2off/5.gif");
-	ships[3][5][0] = load_image( "light2off/6.gif");
-	ships[3][6][0] = load_image( "light2off/7.gif");
-	ships[3][7][0] = load_image( "light2off/8.gif");
-	ships[3][8][0] = load_image( "light2off/9.gif");
-	ships[3][9][0] = load_image( "light2off/10.gif");
-	ships[3][10][0] = load_image( "light2off/11.gif");
-	ships[3][11][0] = load_image( "light2off/12.gif");
-	ships[3][12][0] = load_image( "light2off/13.gif");
-	ships[3][13][0] = load_image( "light2off/14.gif");
-	ships[3][14][0] = load_image( "light2off/15.gif");
-	ships[3][15][0] = load_image( "light2off/16.gif");
-	
-	// Heavy 2 Textures
-	ships[4][0][0] = load_image( "heavy2off/1.gif");
-	ships[4][1][0] = load_image( "heavy2off/2.gif");
-	ships[4][2][0] = load_image( "heavy2off/3.gif");
-	ships[4][3][0] = load_image( "heavy2off/4.gif");
-	ships[4][4][0] = load_image( "heavy2off/5.gif");
-	ships[4][5][0] = load_image( "heavy2off/6.gif");
-	ships[4][6][0] = load_image( "heavy2off/7.gif");
-	ships[4][7][0] = load_image( "heavy2off/8.gif");
-	ships[4][8][0] = load_image( "heavy2off/9.gif");
-	ships[4][9][0] = load_image( "heavy2off/10.gif");
-	ships[4][10][0] = load_image( "heavy2off/11.gif");
-	ships[4][11][0] = load_image( "heavy2off/12.gif");
-	ships[4][12][0] = load_image( "heavy2off/13.gif");
-	ships[4][13][0] = load_image( "heavy2off/14.gif");
-	ships[4][14][0] = load_image( "heavy2off/15.gif");
-	ships[4][15][0] = load_image( "heavy2off/16.gif");
-	
-	ships[4][0][1] = load_image( "heavy2on/1.gif");
-	ships[4][1][1] = load_image( "heavy2on/2.gif");
-	ships[4][2][1] = load_image( "heavy2on/3.gif");
-	ships[4][3][1] = load_image( "heavy2on/4.gif");
-	ships[4][4][1] = load_image( "heavy2on/5.gif");
-	ships[4][5][1] = load_image( "heavy2on/6.gif");
-	ships[4][6][1] = load_image( "heavy2on/7.gif");
-	ships[4][7][1] = load_image( "heavy2on/8.gif");
-	ships[4][8][1] = load_image( "heavy2on/9.gif");
-	ships[4][9][1] = load_image( "heavy2on/10.gif");
-	ships[4][10][1] = load_image( "heavy2on/11.gif");
-	ships[4][11][1] = load_image( "heavy2on/12.gif");
-	ships[4][12][1] = load_image( "heavy2on/13.gif");
-	ships[4][13][1] = load_image( "heavy2on/14.gif");
-	ships[4][14][1] = load_image( "heavy2on/15.gif");
-	ships[4][15][1] = load_image( "heavy2on/16.gif");
-	
-	// Mothership 2 Textures
-	
-	ships[5][0][0] = load_image( "mother2off/1.gif");
-	ships[5][1][0] = load_image( "mother2off/2.gif");
-	ships[5][2][0] = load_image( "mother2off/3.gif");
-	ships[5][3][0] = load_image( "mother2off/4.gif");
-	ships[5][4][0] = load_image( "mother2off/5.gif");
-	ships[5][5][0] = load_image( "mother2off/6.gif");
-	ships[5][6][0] = load_image( "mother2off/7.gif");
-	ships[5][7][0] = load_image( "mother2off/8.gif");
-	ships[5][8][0] = load_image( "mother2off/9.gif");
-	ships[5][9][0] = load_image( "mother2off/10.gif");
-	ships[5][10][0] = load_image( "mother2off/11.gif");
-	ships[5][11][0] = load_image( "mother2off/12.gif");
-	ships[5][12][0] = load_image( "mother2off/13.gif");
-	ships[5][13][0] = load_image( "mother2off/14.gif");
-	ships[5][14][0] = load_image( "mother2off/15.gif");
-	ships[5][15][0] = load_image( "mother2off/16.gif");
-	
-	ships[5][0][1] = load_image( "mother2on/1.gif");
-	ships[5][1][1] = load_image( "mother2on/2.gif");
-	ships[5][2][1] = load_image( "mother2on/3.gif");
-	ships[5][3][1] = load_image( "mother2on/4.gif");
-	ships[5][4][1] = load_image( "mother2on/5.gif");
-	ships[5][5][1] = load_image( "mother2on/6.gif");
-	ships[5][6][1] = load_image( "mother2on/7.gif");
-	ships[5][7][1] = load_image( "mother2on/8.gif");
-	ships[5][8][1] = load_image( "mother2on/9.gif");
-	ships[5][9][1] = load_image( "mother2on/10.gif");
-	ships[5][10][1] = load_image( "mother2on/11.gif");
-	ships[5][11][1] = load_image( "mother2on/12.gif");
-	ships[5][12][1] = load_image( "mother2on/13.gif");
-	ships[5][13][1] = load_image( "mother2on/14.gif");
-	ships[5][14][1] = load_image( "mother2on/15.gif");
-	ships[5][15][1] = load_image( "mother2on/16.gif");
-
-	// Button textures
-	button[0][0] = load_image("menu/new_game_button0.gif");
-	button[0][1] = load_image("menu/new_game_button1.gif");
-	button[1][0] = load_image("menu/how_to_play_button0.gif");
-	button[1][1] = load_image("menu/how_to_play_button1.gif");
-	button[2][0] = load_image("menu/quit_game_button0.gif");
-	button[3][0] = load_image("planets/blue.gif");
-	button[4][0] = load_image("planets/red.gif");
-	button[5][0] = load_image("menu/light1.gif");
-	button[6][0] = load_image("menu/light2.gif");
-	button[7][0] = load_image("menu/heavy1.gif");
-	button[8][0] = load_image("menu/heavy2.gif");
-
-	// Planet Textures
-	planetTex[0] = load_image("planets/1.gif");
-	planetTex[1] = load_image("planets/2.gif");
-	planetTex[2] = load_image("planets/3.gif");
-	planetTex[3] = load_image("planets/4.gif");
-
-	// Health / Shield bar textures
-	healthbar[0] = load_image("healthbars/light1health.gif");
-	healthbar[1] = load_image("healthbars/heavy1health.gif");
-	healthbar[2] = load_image("healthbars/mother1health.gif");
-	healthbar[3] = load_image("healthbars/light2health.gif");
-	healthbar[4] = load_image("healthbars/heavy2health.gif");
-	healthbar[5] = load_image("healthbars/mother2health.gif");
-	shieldbar = load_image("healthbars/shieldbar.gif");
+// Sorts every texture the game uses into the sprite cache's sets
+void queue_assets( Sprite_Cache &cache )
+{
+	char path[64];
+	
+	// Ship frames, in [type][angle][moving] order. Each is the nearest hand-drawn heading
+	// at or before it, turned the rest of the way.
+	const char *ship_names[6] = { "light1", "heavy1", "mother1", "light2", "heavy2", "mother2" };
+	for (int type = 0; type < 6; type++)
+	{
+		for (int angle = 0; angle < HEADINGS; angle++)
+		{
+			int drawn = angle * DRAWN_HEADINGS / HEADINGS;
+			int turn = angle - drawn * HEADINGS / DRAWN_HEADINGS;
+			sprintf(path, "%soff/%d.gif", ship_names[type], drawn + 1);
+			ships[type][angle][0] = cache.add_frame(SET_SHIPS + type, path, ASSET_SHIPS, turn);
+			sprintf(path, "%son/%d.gif", ship_names[type], drawn + 1);
+			ships[type][angle][1] = cache.add_frame(SET_SHIPS + type, path, ASSET_SHIPS, turn);
+		}
+	}
 	
 	// Explosion Textures
-	explosion[0][0] = load_image("explosions/0/1.gif");
-	explosion[0][1] = load_image("explosions/0/2.gif");
-	explosion[0][2] = load_image("explosions/0/3.gif");
-	explosion[0][3] = load_image("explosions/0/4.gif");
-	explosion[0][4] = load_image("explosions/0/5.gif");
-	explosion[0][5] = load_image("explosions/0/6.gif");
-	explosion[0][6] = load_image("explosions/0/7.gif");
-	explosion[0][7] = load_image("explosions/0/8.gif");
-	explosion[0][8] = load_image("explosions/0/9.gif");
-	explosion[0][9] = load_image("explosions/0/10.gif");
-	explosion[0][10] = load_image("explosions/0/11.gif");
-	
-	explosion[1][0] = load_image("explosions/1/1.gif");
-	explosion[1][1] = load_image("explosions/1/2.gif");
-	explosion[1][2] = load_image("explosions/1/3.gif");
-	explosion[1][3] = load_image("explosions/1/4.gif");
-	explosion[1][4] = load_image("explosions/1/5.gif");
-	explosion[1][5] = load_image("explosions/1/6.gif");
-	explosion[1][6] = load_image("explosions/1/7.gif");
-	explosion[1][7] = load_image("explosions/1/8.gif");
-	explosion[1][8] = load_image("explosions/1/9.gif");
-	explosion[1][9] = load_image("explosions/1/10.gif");
-	explosion[1][10] = load_image("explosions/1/11.gif");
-	
-	explosion[2][0] = load_image("explosions/2/1.gif");
-	explosion[2][1] = load_image("explosions/2/2.gif");
-	explosion[2][2] = load_image("explosions/2/3.gif");
-	explosion[2][3] = load_image("explosions/2/4.gif");
-	explosion[2][4] = load_image("explosions/2/5.gif");
-	explosion[2][5] = load_image("explosions/2/6.gif");
-	explosion[2][6] = load_image("explosions/2/7.gif");
-	explosion[2][7] = load_image("explosions/2/8.gif");
-	explosion[2][8] = load_image("explosions/2/9.gif");
-	explosion[2][9] = load_image("explosions/2/10.gif");
-	explosion[2][10] = load_image("explosions/2/11.gif");
-
-	// Radar Textures
-	radar_screen[0] = load_image("radar/blue_screen.gif");
-	radar_screen[1] = load_image("radar/red_screen.gif");
-	
-	radar_dot[0] = load_image("radar/blue.gif");
-	radar_dot[1] = load_image("radar/red.gif");
-	radar_dot[2] = load_image("radar/yellow.gif");
-	radar_dot[3] = load_image("radar/lrg_blue.gif");
-	radar_dot[4] = load_image("radar/lrg_red.gif");
-	radar_dot[5] = load_image("radar/planet_g.gif");
-	radar_dot[6] = load_image("radar/planet_b.gif");
-	radar_dot[7] = load_image("radar/planet_r.gif");
-	
-	displaybar[0] = load_image("healthbars/bluebar.gif");
-	displaybar[1] = load_image("healthbars/redbar.gif");
-	SDL_SetAlpha(radar_screen[0], SDL_SRCALPHA, 200);
-	SDL_SetAlpha(radar_screen[1], SDL_SRCALPHA, 200);
-
-	SDL_SetAlpha(displaybar[0], SDL_SRCALPHA, 200);
-	SDL_SetAlpha(displaybar[1], SDL_SRCALPHA, 200);
-	shooting_star = load_image("shooting_star.gif");
-
-	// Planet owner logos
-	planet_owner[0] = load_image("planets/blue.gif");
-	planet_owner[1] = load_image("planets/red.gif");
-	SDL_SetAlpha(planet_owner[0], SDL_SRCALPHA, 100);
-	SDL_SetAlpha(planet_owner[1], SDL_SRCALPHA, 100);
-
-	// pod textures
-	pod[0] = load_image("pod/1.gif");
-	pod[1] = load_image("pod/2.gif");
-	pod[2] = load_image("pod/3.gif");
-	pod[3] = load_image("pod/4.gif");
-	pod[4] = load_image("pod/5.gif");
-	pod[5] = load_image("pod/6.gif");
-	pod[6] = load_image("pod/7.gif");
-	pod[7] = load_image("pod/8.gif");
-	pod[8] = load_image("pod/9.gif");
-	pod[9] = load_image("pod/10.gif");
-	pod[10] = load_image("pod/11.gif");
-	pod[11] = load_image("pod/12.gif");
-	pod[12] = load_image("pod/13.gif");
-	pod[13] = load_image("pod/14.gif");
-	pod[14] = load_image("pod/15.gif");
-	pod[15] = load_image("pod/16.gif");
-
-	// Menu
-	menu[0] = load_image("menu/home.gif");
-	SDL_SetAlpha(menu[0], SDL_SRCALPHA, 200);
-	menu[1] = load_image("menu/how_to_play.gif");
-	SDL_SetAlpha(menu[1], SDL_SRCALPHA, 200);
-	menu[2] = load_image("menu/you_loose.gif");
-	menu[3] = load_image("menu/you_win.gif");
-    
-    //Load the tile image
-    tileSheet = load_image( "background.gif" );
-	// Laser
-    laser = load_image("laser/1.gif");
-	
-	// Shield Textures
-	shieldTexture[0] = load_image("shield_light.gif");
-	SDL_SetAlpha(shieldTexture[0], SDL_SRCALPHA, 100);
-	shieldTexture[1] = load_image("shield_heavy.gif");
-	SDL_SetAlpha(shieldTexture[1], SDL_SRCALPHA, 100);
-	shieldTexture[2] = load_image("shield_mother.gif");
-	SDL_SetAlpha(shieldTexture[2], SDL_SRCALPHA, 100);
-	shieldTexture[3] = load_image("shield_light.gif");
-	SDL_SetAlpha(shieldTexture[3], SDL_SRCALPHA, 100);
-	shieldTexture[4] = load_image("shield_heavy.gif");
-	SDL_SetAlpha(shieldTexture[4], SDL_SRCALPHA, 100);
-	shieldTexture[5] = load_image("shield_mother.gif");
-	SDL_SetAlpha(shieldTexture[5], SDL_SRCALPHA, 100);
-
-    //If there was a problem in loading the textures (assuming all textures are present if one is)
-    if( tileSheet == NULL )
-    {
-        return false;    
-    }
-    
-    //If everything loaded fine
-    return true;
+	for (int type = 0; type < 3; type++)
+	{
+		for (int frame = 0; frame < 11; frame++)
+		{
+			sprintf(path, "explosions/%d/%d.gif", type, frame + 1);
+			explosion[type][frame] = cache.add_frame(SET_EXPLOSIONS + type, path, ASSET_EXPLOSIONS);
+		}
+	}
+	
+	// pod frames
+	for (int angle = 0; angle < HEADINGS; angle++)
+	{
+		int drawn = angle * DRAWN_HEADINGS / HEADINGS;
+		sprintf(path, "pod/%d.gif", drawn + 1);
+		pod[angle] = cache.add_frame(SET_PODS, path, ASSET_PODS, angle - drawn * HEADINGS / DRAWN_HEADINGS);
+	}
+	
+	// Planet Textures and owner logos
+	for (int kind = 0; kind < 4; kind++)
+	{
+		sprintf(path, "planets/%d.gif", kind + 1);
+		planetTex[kind] = cache.add(SET_PLANETS, path, ASSET_PLANETS, -1);
+	}
+	planet_owner[0] = cache.add(SET_PLANETS, "planets/blue.gif", ASSET_PLANETS, 100);
+	planet_owner[1] = cache.add(SET_PLANETS, "planets/red.gif", ASSET_PLANETS, 100);
+	
+	// Health / Shield bar, radar, laser and shield textures
+	for (int type = 0; type < 6; type++)
+	{
+		sprintf(path, "healthbars/%shealth.gif", ship_names[type]);
+		healthbar[type] = cache.add(SET_HUD, path, ASSET_HUD, -1);
+	}
+	shieldbar = cache.add(SET_HUD, "healthbars/shieldbar.gif", ASSET_HUD, -1);
+	displaybar[0] = cache.add(SET_HUD, "healthbars/bluebar.gif", ASSET_HUD, 200);
+	displaybar[1] = cache.add(SET_HUD, "healthbars/redbar.gif", ASSET_HUD, 200);
+	radar_screen[0] = cache.add(SET_HUD, "radar/blue_screen.gif", ASSET_HUD, 200);
+	radar_screen[1] = cache.add(SET_HUD, "radar/red_screen.gif", ASSET_HUD, 200);
+	const char *dot_names[8] = { "blue", "red", "yellow", "lrg_blue", "lrg_red", "planet_g", "planet_b", "planet_r" };
+	for (int dot = 0; dot < 8; dot++)
+	{
+		sprintf(path, "radar/%s.gif", dot_names[dot]);
+		radar_dot[dot] = cache.add(SET_HUD, path, ASSET_HUD, -1);
+	}
+	laser = cache.add(SET_HUD, "laser/1.gif", ASSET_HUD, -1);
+	const char *shield_names[3] = { "shield_light.gif", "shield_heavy.gif", "shield_mother.gif" };
+	for (int type = 0; type < 6; type++)
+	{
+		shieldTexture[type] = cache.add(SET_HUD, shield_names[type % 3], ASSET_HUD, 100);
+	}
+	
+	// Menu and button textures
+	menu[0] = cache.add(SET_MENU, "menu/home.gif", ASSET_MENU, 200);
+	menu[1] = cache.add(SET_MENU, "menu/how_to_play.gif", ASSET_MENU, 200);
+	menu[2] = cache.add(SET_MENU, "menu/you_loose.gif", ASSET_MENU, -1);
+	menu[3] = cache.add(SET_MENU, "menu/you_win.gif", ASSET_MENU, -1);
+	button[0][0] = cache.add(SET_MENU, "menu/new_game_button0.gif", ASSET_MENU, -1);
+	button[0][1] = cache.add(SET_MENU, "menu/new_game_button1.gif", ASSET_MENU, -1);
+	button[1][0] = cache.add(SET_MENU, "menu/how_to_play_button0.gif", ASSET_MENU, -1);
+	button[1][1] = cache.add(SET_MENU, "menu/how_to_play_button1.gif", ASSET_MENU, -1);
+	button[2][0] = cache.add(SET_MENU, "menu/quit_game_button0.gif", ASSET_MENU, -1);
+	button[3][0] = cache.add(SET_MENU, "planets/blue.gif", ASSET_MENU, -1);
+	button[4][0] = cache.add(SET_MENU, "planets/red.gif", ASSET_MENU, -1);
+	button[5][0] = cache.add(SET_MENU, "menu/light1.gif", ASSET_MENU, -1);
+	button[6][0] = cache.add(SET_MENU, "menu/light2.gif", ASSET_MENU, -1);
+	button[7][0] = cache.add(SET_MENU, "menu/heavy1.gif", ASSET_MENU, -1);
+	button[8][0] = cache.add(SET_MENU, "menu/heavy2.gif", ASSET_MENU, -1);
+	
+	//Load the tile image and the shooting star
+	tileSheet = cache.add(SET_BACKGROUND, "background.gif", ASSET_BACKGROUND, -1);
+	shooting_star = cache.add(SET_BACKGROUND, "shooting_star.gif", ASSET_BACKGROUND, -1);
+	
+	// Drawn on every frame of a match, or read once at startup
+	cache.pin(SET_PODS);
+	cache.pin(SET_PLANETS);
+	cache.pin(SET_HUD);
+	cache.pin(SET_BACKGROUND);
+}
+
+// Writes every texture the game uses to a pack file
+bool cook_assets( const char *name )
+{
+	Asset_Loader loader;
+	queue_assets( sprites );
+	assets.queue_all( loader );
+	sprites.queue_turned( loader );
+	return loader.cook( name );
+}
+
+// Loads the sprites of every ship type in a match, and their explosions, before it starts,
+// holding them for the match and letting the last match's go
+void prefetch_sprites( Room &room )
+{
+	for (int set = SET_SHIPS; set < SET_PODS; set++)
+	{
+		sprites.hold( set, false );
+	}
+	// All of them are held before any loads, so loading one can't let another go
+	for (int i = 0; i < room.world.player_count; i++)
+	{
+		int type = room.players[i].get_type();
+		sprites.hold( SET_SHIPS + type, true );
+		sprites.hold( SET_EXPLOSIONS + (type > 2 ? type - 3 : type), true );
+	}
+	for (int i = 0; i < room.world.player_count; i++)
+	{
+		int type = room.players[i].get_type();
+		sprites.prefetch( SET_SHIPS + type );
+		sprites.prefetch( SET_EXPLOSIONS + (type > 2 ? type - 3 : type) );
+	}
+}
+
+// Loads the textures needed from the start, from a pack file if one is given.
+// The rest are loaded as they are first used.
+bool load_files( const char *pack )
+{
+	queue_assets( sprites );
+	if( pack != NULL && !asset_pack.open( pack ) ) fprintf(stderr, "Could not open asset pack %s, decoding the images instead\n", pack);
+	assets.use_pack( &asset_pack );
+	sprites.load_pinned();
+	sprites.prefetch( SET_MENU );
+	
+	//If there was a problem in loading the textures (assuming all textures are present if one is)
+	if( assets.surface( tileSheet ) == NULL )
+	{
+		return false;    
+	}
+	
+	//If everything loaded fine
+	return true;
 }
 
 /*************************************** BUTTON CLASS *********************************************/
@@ -2253,8 +6385,8 @@ class Button
     //Initialize the variables
     Button( int x, int y, int w, int h, int t );
     
-    //Handles events and set the button's sprite region
-    void handle_events();
+    //Handles events and set the button's sprite region (starting a game unpauses it)
+    void handle_events( bool &paused );
     
     //Shows the button on the screen
     void show();
@@ -2275,7 +6407,7 @@ Button::Button( int x, int y, int w, int h, int t )
 	type = t;
 }
     
-void Button::handle_events()
+void Button::handle_events( bool &paused )
 {
     //The mouse offsets
     int x = 0, y = 0;
@@ -2346,303 +6478,1514 @@ void Button::handle_events()
 void Button::show()
 {
     //Show the button
-    apply_surface( box.x, box.y, button[type][state], screen);
+    render_queue.add( LAYER_MENU, box.x, box.y, assets.surface(button[type][state]) );
 }
 
 /******************************************* CLEAN UP METHOD ******************************************/
-void clean_up( Tile *tiles[] )
+void clean_up()
 {
+	//Stop the band threads
+	render_queue.set_bands(1);
     //Free the surfaces
-	for (int i = 0; i <= 5; i++)
+	sprites.clear();
+	assets.clear();
+	asset_pack.close();
+	
+    //Quit SDL
+    SDL_Quit();
+}
+bool set_tiles( Tilemap &tiles, const char *map )
+{
+    //Use the map file if one was given
+    if( map != NULL )
+    {
+        if( tiles.open( map ) ) return true;
+        fprintf( stderr, "Could not open map %s\n", map );
+        return false;
+    }
+    //Otherwise the same tile repeats over the whole level
+    return tiles.create( TILE_COLUMNS, TILE_ROWS, tileSheet );
+}
+
+/******************************************** PARTICLE SYSTEM CLASS *********************************/
+/*
+ Large numbers of small square particles (shooting stars, engine trails, debris).
+ Positions, velocities and lifetimes are kept in separate arrays so the update
+ runs four particles at a time with SSE where the compiler has it. Drawing culls
+ each particle against the camera and writes its pixels straight into the frame
+ buffer instead of blitting a sprite. Bouncing particles stay in the level
+ forever; the others die when their life runs out or they leave the level.
+*/
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define PARTICLES_SSE
+#endif
+
+const int PARTICLE_SIZE = 2;
+
+class Particle_System
+{
+	private:
+	std::vector<float> x, y, xVel, yVel, life;
+	// Pixel value of each particle in the screen's format
+	std::vector<Uint32> colour;
+	int count;
+	bool bounce;
+	
+	// Removes a particle by moving the last one into its place
+	void remove(int i);
+	
+	public:
+	Particle_System(bool bouncing);
+	void reserve(int n);
+	int size();
+	// Adds a particle that lives for the given number of frames
+	void emit(float px, float py, float vx, float vy, int frames, Uint8 r, Uint8 g, Uint8 b);
+	// Moves every particle on a frame
+	void update();
+	// Writes the particles inside the camera into a surface, clipped to its clip rectangle,
+	// returning how many were inside the camera
+	int draw(SDL_Surface *target);
+	// Works out the area of the screen the particles inside the camera cover, returning false if there are none
+	bool bounds(SDL_Rect &area);
+	void clear();
+};
+
+Particle_System::Particle_System(bool bouncing)
+{
+	count = 0;
+	bounce = bouncing;
+}
+void Particle_System::reserve(int n)
+{
+	x.reserve(n);
+	y.reserve(n);
+	xVel.reserve(n);
+	yVel.reserve(n);
+	life.reserve(n);
+	colour.reserve(n);
+}
+int Particle_System::size()
+{
+	return count;
+}
+void Particle_System::clear()
+{
+	x.clear();
+	y.clear();
+	xVel.clear();
+	yVel.clear();
+	life.clear();
+	colour.clear();
+	count = 0;
+}
+void Particle_System::emit(float px, float py, float vx, float vy, int frames, Uint8 r, Uint8 g, Uint8 b)
+{
+	x.push_back(px);
+	y.push_back(py);
+	xVel.push_back(vx);
+	yVel.push_back(vy);
+	life.push_back((float)frames);
+	colour.push_back(screen != NULL ? SDL_MapRGB(screen->format, r, g, b) : 0);
+	count++;
+}
+void Particle_System::remove(int i)
+{
+	count--;
+	x[i] = x[count];
+	y[i] = y[count];
+	xVel[i] = xVel[count];
+	yVel[i] = yVel[count];
+	life[i] = life[count];
+	colour[i] = colour[count];
+	x.pop_back();
+	y.pop_back();
+	xVel.pop_back();
+	yVel.pop_back();
+	life.pop_back();
+	colour.pop_back();
+}
+void Particle_System::update()
+{
+	const float right = (float)(LEVEL_WIDTH - PARTICLE_SIZE);
+	const float bottom = (float)(LEVEL_HEIGHT - PARTICLE_SIZE);
+	int i = 0;
+#ifdef PARTICLES_SSE
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 right4 = _mm_set1_ps(right);
+	const __m128 bottom4 = _mm_set1_ps(bottom);
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; i + 4 <= count; i += 4)
 	{
-		int count = 0;
-		while (count < 16)
-		{	
-			SDL_FreeSurface( ships[i][count][0]);
-			SDL_FreeSurface( ships[i][count][1]);
-			count++;
+		__m128 px = _mm_loadu_ps(&x[i]);
+		__m128 py = _mm_loadu_ps(&y[i]);
+		__m128 vx = _mm_loadu_ps(&xVel[i]);
+		__m128 vy = _mm_loadu_ps(&yVel[i]);
+		if (bounce)
+		{
+			// Reverse the velocity of anything about to leave the level
+			__m128 nx = _mm_add_ps(px, vx);
+			__m128 ny = _mm_add_ps(py, vy);
+			vx = _mm_xor_ps(vx, _mm_and_ps(_mm_or_ps(_mm_cmplt_ps(nx, zero), _mm_cmpgt_ps(nx, right4)), sign));
+			vy = _mm_xor_ps(vy, _mm_and_ps(_mm_or_ps(_mm_cmplt_ps(ny, zero), _mm_cmpgt_ps(ny, bottom4)), sign));
+			_mm_storeu_ps(&xVel[i], vx);
+			_mm_storeu_ps(&yVel[i], vy);
+		}
+		else _mm_storeu_ps(&life[i], _mm_sub_ps(_mm_loadu_ps(&life[i]), one));
+		_mm_storeu_ps(&x[i], _mm_add_ps(px, vx));
+		_mm_storeu_ps(&y[i], _mm_add_ps(py, vy));
+	}
+#endif
+	for (; i < count; i++)
+	{
+		if (bounce)
+		{
+			if (x[i] + xVel[i] < 0 || x[i] + xVel[i] > right) xVel[i] = -xVel[i];
+			if (y[i] + yVel[i] < 0 || y[i] + yVel[i] > bottom) yVel[i] = -yVel[i];
+		}
+		else life[i] -= 1;
+		x[i] += xVel[i];
+		y[i] += yVel[i];
+	}
+	if (bounce) return;
+	
+	// Retire dead particles
+	i = 0;
+	while (i < count)
+	{
+		if (life[i] <= 0 || x[i] < 0 || x[i] > right || y[i] < 0 || y[i] > bottom) remove(i);
+		else i++;
+	}
+}
+int Particle_System::draw(SDL_Surface *target)
+{
+	int bytes = target->format->BytesPerPixel;
+	if (bytes != 2 && bytes != 4) return 0;
+	int left = camera.x;
+	int top = camera.y;
+	int width = std::min((int)camera.w, target->w) - PARTICLE_SIZE;
+	int height = std::min((int)camera.h, target->h) - PARTICLE_SIZE;
+	const SDL_Rect &bounds = target->clip_rect;
+	int drawn = 0;
+	
+	if (SDL_MUSTLOCK(target)) SDL_LockSurface(target);
+	for (int i = 0; i < count; i++)
+	{
+		int sx = (int)x[i] - left;
+		int sy = (int)y[i] - top;
+		if (sx < 0 || sy < 0 || sx > width || sy > height) continue;
+		drawn++;
+		// Only the part inside the clip rectangle
+		int x0 = std::max(sx, (int)bounds.x), x1 = std::min(sx + PARTICLE_SIZE, bounds.x + bounds.w);
+		int y0 = std::max(sy, (int)bounds.y), y1 = std::min(sy + PARTICLE_SIZE, bounds.y + bounds.h);
+		for (int py = y0; py < y1; py++)
+		{
+			Uint8 *row = (Uint8*)target->pixels + py * target->pitch;
+			if (bytes == 4)
+			{
+				for (int px = x0; px < x1; px++) ((Uint32*)row)[px] = colour[i];
+			}
+			else
+			{
+				for (int px = x0; px < x1; px++) ((Uint16*)row)[px] = (Uint16)colour[i];
+			}
 		}
-		
 	}
-	for (int i = 0; i < 9; i++)
+	if (SDL_MUSTLOCK(target)) SDL_UnlockSurface(target);
+	return drawn;
+}
+
+bool Particle_System::bounds(SDL_Rect &area)
+{
+	int width = camera.w - PARTICLE_SIZE;
+	int height = camera.h - PARTICLE_SIZE;
+	int x0 = width, y0 = height, x1 = -1, y1 = -1;
+	for (int i = 0; i < count; i++)
 	{
-		SDL_FreeSurface(button[i][0]);
-		SDL_FreeSurface(button[i][1]);
+		int sx = (int)x[i] - camera.x;
+		int sy = (int)y[i] - camera.y;
+		if (sx < 0 || sy < 0 || sx > width || sy > height) continue;
+		x0 = std::min(x0, sx);
+		y0 = std::min(y0, sy);
+		x1 = std::max(x1, sx);
+		y1 = std::max(y1, sy);
 	}
+	if (x1 < 0) return false;
+	area.x = (Sint16)x0;
+	area.y = (Sint16)y0;
+	area.w = (Uint16)(x1 - x0 + PARTICLE_SIZE);
+	area.h = (Uint16)(y1 - y0 + PARTICLE_SIZE);
+	return true;
+}
+
+// Render pass that draws a particle system and counts what it culled
+void draw_particles(void *data, SDL_Surface *target)
+{
+	Particle_System *particles = (Particle_System*)data;
+	int drawn = particles->draw(target);
+	// Bands each draw their own rows, and only the top one counts
+	if (target->clip_rect.y == 0) render_queue.count(drawn, particles->size() - drawn);
+}
+
+// Queues a particle system's pass over the area its particles cover
+void queue_particles(int layer, Particle_System &particles)
+{
+	SDL_Rect area;
+	if (particles.bounds(area)) render_queue.add_pass(layer, draw_particles, &particles, area);
+	else render_queue.count(0, particles.size());
+}
 
-	SDL_FreeSurface( tileSheet );
-	SDL_FreeSurface( planetTex[0]);
-	SDL_FreeSurface( planetTex[1]);
-	SDL_FreeSurface( planetTex[2]);
-	SDL_FreeSurface( planetTex[3]);
+// Puffs a particle out of an engine, drifting away from the ship and fading after a few frames
+void emit_trail(Particle_System &particles, int x, int y, int xDir, int yDir)
+{
+	float vx = xDir * 4 / 1024.0f + (effects_rng.next(21) - 10) / 10.0f;
+	float vy = yDir * 4 / 1024.0f + (effects_rng.next(21) - 10) / 10.0f;
+	particles.emit((float)x, (float)y, vx, vy, 6 + effects_rng.next(6), 255, 160 + effects_rng.next(96), 64);
+}
+// Throws debris out of the middle of a wreck
+void emit_debris(Particle_System &particles, SDL_Rect wreck)
+{
+	int pieces = 20 + wreck.w / 4;
+	for (int i = 0; i < pieces; i++)
+	{
+		float vx = (effects_rng.next(401) - 200) / 20.0f;
+		float vy = (effects_rng.next(401) - 200) / 20.0f;
+		Uint8 shade = 128 + effects_rng.next(128);
+		particles.emit((float)(wreck.x + wreck.w / 2), (float)(wreck.y + wreck.h / 2), vx, vy, 10 + effects_rng.next(20), shade, shade, shade);
+	}
+}
+// Fills the level with shooting stars the colour of the middle of the shooting star image
+// (its corners are the dim edge of the glow)
+void create_shooting_stars(Particle_System &stars, int count)
+{
+	Uint8 r = 255, g = 255, b = 255;
+	SDL_Surface *star = assets.surface(shooting_star);
+	if (star != NULL)
+	{
+		SDL_LockSurface(star);
+		SDL_GetRGB(get_pixel(star, star->w / 2, star->h / 2), star->format, &r, &g, &b);
+		SDL_UnlockSurface(star);
+	}
+	stars.clear();
+	stars.reserve(count);
+	for (int i = 0; i < count; i++)
+	{
+		int tempX = effects_rng.next(40);
+		int tempY = 0;
+		if (tempX < 25)
+		{
+			while(tempY < 25)
+			{
+				tempY = effects_rng.next(40);
+			}
+		}
+		else tempY = effects_rng.next(40);
+		stars.emit((float)effects_rng.next(LEVEL_WIDTH - PARTICLE_SIZE), (float)effects_rng.next(LEVEL_HEIGHT - PARTICLE_SIZE), (float)tempX, (float)tempY, 0, r, g, b);
+	}
+}
 
-	SDL_FreeSurface(healthbar[0]);
-	SDL_FreeSurface(healthbar[1]);
-	SDL_FreeSurface(healthbar[2]);
-	SDL_FreeSurface(healthbar[3]);
-	SDL_FreeSurface(healthbar[4]);
-	SDL_FreeSurface(healthbar[5]);
+/********************************************* ROOM SCHEDULER ***************************************/
+/*
+ Ticks many rooms at their own fixed rates on a pool of worker threads.
+ Rooms can be added and destroyed while the workers are running.
+*/
+class Room_Scheduler
+{
+	private:
+	std::vector<Room*> rooms;
+	std::vector<SDL_Thread*> workers;
+	SDL_mutex *lock;
+	// Signalled whenever a worker lets go of a room
+	SDL_cond *released;
+	bool running;
+	int next_id;
 	
-	SDL_FreeSurface(shieldbar);
+	// Worker thread entry point
+	static int work(void *data);
+	// Returns the room most overdue for a tick, or NULL if none is due yet
+	Room *take_due_room(double now);
 	
+	public:
+	Room_Scheduler();
+	~Room_Scheduler();
+	void start(int threads);
+	void stop();
+	// Hands a room to the scheduler, which then owns it
+	void add(Room *room);
+	// Waits until no worker has the room, then removes and deletes it
+	void destroy(Room *room);
+	// Returns the room that has been scheduled the longest
+	Room *oldest();
+	// Prints each room's tick cost since the last report
+	void report(FILE *out);
+};
+
+Room_Scheduler::Room_Scheduler()
+{
+	lock = SDL_CreateMutex();
+	released = SDL_CreateCond();
+	running = false;
+	next_id = 1;
+}
+Room_Scheduler::~Room_Scheduler()
+{
+	stop();
+	for (unsigned int i = 0; i < rooms.size(); i++)
+	{
+		delete rooms[i];
+	}
+	SDL_DestroyCond(released);
+	SDL_DestroyMutex(lock);
+}
+void Room_Scheduler::start(int threads)
+{
+	running = true;
+	for (int i = 0; i < threads; i++)
+	{
+		workers.push_back(SDL_CreateThread(work, this));
+	}
+}
+void Room_Scheduler::stop()
+{
+	SDL_mutexP(lock);
+	running = false;
+	SDL_mutexV(lock);
+	for (unsigned int i = 0; i < workers.size(); i++)
+	{
+		SDL_WaitThread(workers[i], NULL);
+	}
+	workers.clear();
+}
+void Room_Scheduler::add(Room *room)
+{
+	SDL_mutexP(lock);
+	room->id = next_id++;
+	room->next_tick = precise_ticks();
+	rooms.push_back(room);
+	SDL_mutexV(lock);
+}
+void Room_Scheduler::destroy(Room *room)
+{
+	SDL_mutexP(lock);
+	// Stop workers picking the room up, then wait for the current tick to finish
+	room->closing = true;
+	while (room->busy)
+	{
+		SDL_CondWait(released, lock);
+	}
+	rooms.erase(std::find(rooms.begin(), rooms.end(), room));
+	SDL_mutexV(lock);
+	delete room;
+}
+Room *Room_Scheduler::oldest()
+{
+	Room *room = NULL;
+	SDL_mutexP(lock);
+	if (!rooms.empty()) room = rooms[0];
+	SDL_mutexV(lock);
+	return room;
+}
+Room *Room_Scheduler::take_due_room(double now)
+{
+	Room *due = NULL;
+	for (unsigned int i = 0; i < rooms.size(); i++)
+	{
+		Room *room = rooms[i];
+		if (room->busy || room->closing || room->next_tick > now) continue;
+		if (due == NULL || room->next_tick < due->next_tick) due = room;
+	}
+	if (due != NULL) due->busy = true;
+	return due;
+}
+int Room_Scheduler::work(void *data)
+{
+	Room_Scheduler *scheduler = (Room_Scheduler*)data;
 	
-	for (int i = 0; i < 3; i++)
+	SDL_mutexP(scheduler->lock);
+	while (scheduler->running)
 	{
-		for (int count = 0; count < 11; count++)
-		{	
-			SDL_FreeSurface( explosion[i][count]);
-			SDL_FreeSurface( explosion[i][count]);
+		Room *room = scheduler->take_due_room(precise_ticks());
+		if (room == NULL)
+		{
+			// Nothing due yet
+			SDL_mutexV(scheduler->lock);
+			SDL_Delay(1);
+			SDL_mutexP(scheduler->lock);
+			continue;
 		}
+		SDL_mutexV(scheduler->lock);
 		
+		double start = precise_ticks();
+		room->tick();
+		double took = precise_ticks() - start;
+		
+		SDL_mutexP(scheduler->lock);
+		room->cost_total += took;
+		if (took > room->cost_max) room->cost_max = took;
+		room->cost_ticks++;
+		
+		// Schedule the next tick, skipping ticks the room has fallen too far behind on
+		double period = 1000.0 / room->tick_rate;
+		room->next_tick += period;
+		if (room->next_tick < start - period) room->next_tick = start;
+		room->busy = false;
+		SDL_CondBroadcast(scheduler->released);
 	}
-	SDL_FreeSurface(radar_screen[0]);
-	SDL_FreeSurface(radar_screen[1]);
-	
-	for (int i = 0; i < 8; i++)
+	SDL_mutexV(scheduler->lock);
+	return 0;
+}
+void Room_Scheduler::report(FILE *out)
+{
+	SDL_mutexP(lock);
+	fprintf(out, "room  ticks  avg ms  max ms\n");
+	for (unsigned int i = 0; i < rooms.size(); i++)
 	{
-		SDL_FreeSurface(radar_dot[i]);
+		Room *room = rooms[i];
+		double average = 0;
+		if (room->cost_ticks > 0) average = room->cost_total / room->cost_ticks;
+		fprintf(out, "%4d  %5d  %6.3f  %6.3f\n", room->id, room->cost_ticks, average, room->cost_max);
+		room->cost_total = 0;
+		room->cost_max = 0;
+		room->cost_ticks = 0;
 	}
-	SDL_FreeSurface(displaybar[0]);
-	SDL_FreeSurface(displaybar[1]);
-	SDL_FreeSurface(shooting_star);
-	SDL_FreeSurface(planet_owner[0]);
-	SDL_FreeSurface(planet_owner[1]);
-	
-	for (int i = 0; i < 16; i++)
+	SDL_mutexV(lock);
+	fflush(out);
+}
+
+// Creates an all-AI room ready to be scheduled
+Room *create_server_room(int count, Uint32 seed)
+{
+	Room *room = new Room(count, FPS);
+	room->create_world(0, seed);
+	room->players[0].ai_on();
+	room->world.paused = false;
+	return room;
+}
+
+// Hosts many AI matches in one process, replacing the oldest match every second
+void run_server(int room_count, int seconds, int threads)
+{
+	Room_Scheduler scheduler;
+	for (int i = 0; i < room_count; i++)
 	{
-		SDL_FreeSurface(pod[i]);
+		scheduler.add(create_server_room(MAX_PLAYERS, i + 1));
 	}
-	SDL_FreeSurface(menu[0]);
-	SDL_FreeSurface(menu[1]);
+	scheduler.start(threads);
 	
-	SDL_FreeSurface( laser);
-	SDL_FreeSurface( tileSheet);
-	
-	for (int i = 0; i < 6; i++)
+	for (int s = 0; s < seconds; s++)
 	{
-		SDL_FreeSurface(shieldTexture[i]);
+		SDL_Delay(1000);
+		printf("after %d s:\n", s + 1);
+		scheduler.report(stdout);
+		
+		// Rooms come and go while the server runs
+		Room *oldest = scheduler.oldest();
+		if (oldest == NULL) continue;
+		scheduler.destroy(oldest);
+		scheduler.add(create_server_room(MAX_PLAYERS, room_count + s + 1));
 	}
+	scheduler.stop();
+}
+
+/********************************************* LOAD TEST ********************************************/
+/*
+ Headless load generator. Fills a match with bot clients and reports how long
+ the server tick takes as the number of clients grows. Half of the bots are
+ scripted remote players, the rest are driven by the AI personalities (ai_move).
+ The scripted bots run in a forked client process and talk to the server over
+ a socket each, like a remote player would: every tick the server sends each
+ bot its ship's state and waits up to INPUT_WAIT ms for the inputs to come back.
+ The time from sending the state to getting the input is the round trip, and an
+ input that misses the wait is lost: its ship keeps the keys it last had.
+*/
+#ifndef WIN32
+
+// How long the server waits for the clients' inputs each tick
+const int INPUT_WAIT = 1000 / FPS / 2;
+
+class Bot_Client
+{
+	private:
+	Random script;
+	// Keys the bot is holding and for how many more ticks
+	Uint8 held;
+	int hold_time;
 	
-	//Free the tiles
-    for( int t = 0; t < TOTAL_TILES; t++ )
-    {
-        delete tiles[ t ];    
-    }
-    
-    //Free the pointer array
-    delete []tiles;
-    
-    //Quit SDL
-    SDL_Quit();
+	public:
+	Bot_Client();
+	void seed(Uint32 s);
+	// Returns the input the bot sends for the next tick, given whether its ship is flying
+	Uint8 next_input(bool alive);
+};
+
+Bot_Client::Bot_Client()
+{
+	held = 0;
+	hold_time = 0;
 }
-bool set_tiles( Tile *tiles[] )
+void Bot_Client::seed(Uint32 s)
 {
-    //The tile offset
-    int x = 0, y = 0;
+	script.seed(s);
+}
+Uint8 Bot_Client::next_input(bool alive)
+{
+	if (hold_time <= 0)
+	{
+		// Pick a new set of keys to hold, mostly flying forward and shooting
+		held = 0;
+		if (script.next(4) > 0) held |= INPUT_UP;
+		if (script.next(2) == 0) held |= INPUT_FIRE;
+		int turn = script.next(3);
+		if (turn == 1) held |= INPUT_LEFT;
+		if (turn == 2) held |= INPUT_RIGHT;
+		if (script.next(10) == 0) held |= INPUT_DOWN;
+		hold_time = 5 + script.next(20);
+	}
+	else hold_time--;
 	
-    //Initialize the tiles
-    for( int t = 0; t < TOTAL_TILES; t++ )
-    {
+	// A wrecked ship asks to respawn, releasing the key every other tick so that it registers as a new press
+	if (!alive && hold_time % 2 != 0) return held | INPUT_LIGHT;
+	return held;
+}
+
+// Runs the scripted bots on the client side of the sockets until the server hangs up
+void run_bot_clients(std::vector<int> &sockets)
+{
+	int count = (int)sockets.size();
+	std::vector<Bot_Client> bots(count);
+	std::vector<pollfd> waiting(count);
+	for (int k = 0; k < count; k++)
+	{
+		bots[k].seed(k + 1);
+		waiting[k].fd = sockets[k];
+		waiting[k].events = POLLIN;
+	}
+	Message state, reply;
+	int open = count;
+	while (open > 0 && poll(&waiting[0], count, -1) > 0)
+	{
+		for (int k = 0; k < count; k++)
+		{
+			if (waiting[k].fd < 0 || waiting[k].revents == 0) continue;
+			if (!state.receive(waiting[k].fd))
+			{
+				waiting[k].fd = -1;
+				open--;
+				continue;
+			}
+			int tick = state.get_int();
+			bool alive = state.get_int() != 0;
+			Uint8 input = bots[k].next_input(alive);
+			reply.clear();
+			reply.put_int(tick);
+			reply.put(&input, 1);
+			reply.send(waiting[k].fd);
+		}
+	}
+}
+
+// Returns the value below which the given fraction of the samples fall
+double percentile(std::vector<double> &samples, double fraction)
+{
+	if (samples.empty()) return 0;
+	std::sort(samples.begin(), samples.end());
+	unsigned int i = (unsigned int)(fraction * (samples.size() - 1));
+	return samples[i];
+}
 
-		tiles[t] = new Tile(x,y,tileSheet);
+// Runs the tick with 10, 20, 40... clients up to max_clients
+void run_load_test(int max_clients, int ticks)
+{
+	// Both motherships and a few fighters are always needed
+	if (max_clients < 10) max_clients = 10;
+	// Clients that die show up as failed writes instead of stopping the server
+	signal(SIGPIPE, SIG_IGN);
+	
+	printf("late: ticks that took over %d ms, rtt: state to input round trip in ms, lost: inputs that missed the %d ms wait\n", 1000 / FPS, INPUT_WAIT);
+	printf("clients  p50 ms  p95 ms  p99 ms  max ms  late  rtt p50  rtt p99  lost\n");
+	for (int clients = 10; ; clients *= 2)
+	{
+		if (clients > max_clients) clients = max_clients;
+		Room room(clients, FPS);
+		Ship *players = room.players;
+		room.create_world(0, 1);
 		
-		//Move to next tile spot
-        x += TILE_WIDTH;
-        
-        //If we've gone too far
-        if( x >= LEVEL_WIDTH )
-        {
-            //Move back
-            x = 0;
-            
-            //Move to the next row
-            y += TILE_HEIGHT;    
-        }
-    }
-    
-    //If the map was loaded fine
-    return true;
+		// Every other ship (and the player's slot) is a scripted client
+		std::vector<int> scripted;
+		scripted.push_back(0);
+		for (int i = 3; i < clients; i += 2)
+		{
+			scripted.push_back(i);
+		}
+		int count = (int)scripted.size();
+		for (int k = 0; k < count; k++)
+		{
+			players[scripted[k]].ai_off();
+		}
+		
+		// One socket pair per client, with all the clients in one forked process
+		fflush(stdout);
+		std::vector<int> server_side, client_side;
+		for (int k = 0; k < count; k++)
+		{
+			int pair[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+			{
+				perror("socketpair");
+				break;
+			}
+			server_side.push_back(pair[0]);
+			client_side.push_back(pair[1]);
+		}
+		pid_t pid = (int)server_side.size() == count ? fork() : -1;
+		if (pid == 0)
+		{
+			for (unsigned int k = 0; k < server_side.size(); k++)
+			{
+				close(server_side[k]);
+			}
+			run_bot_clients(client_side);
+			_exit(0);
+		}
+		for (unsigned int k = 0; k < client_side.size(); k++)
+		{
+			close(client_side[k]);
+		}
+		if (pid < 0)
+		{
+			if ((int)server_side.size() == count) perror("fork");
+			for (unsigned int k = 0; k < server_side.size(); k++)
+			{
+				close(server_side[k]);
+			}
+			return;
+		}
+		
+		std::vector<double> samples, round_trips;
+		std::vector<double> sent(count);
+		std::vector<pollfd> waiting(count);
+		// Clients whose socket failed; their inputs are lost from then on
+		std::vector<bool> gone(count, false);
+		Message message;
+		int late = 0, lost = 0;
+		for (int t = 0; t < ticks; t++)
+		{
+			// Send every client its ship's state, then collect their inputs for this tick
+			int missing = count;
+			for (int k = 0; k < count; k++)
+			{
+				waiting[k].fd = -1;
+				waiting[k].events = POLLIN;
+				if (gone[k])
+				{
+					lost++;
+					missing--;
+					continue;
+				}
+				Ship &ship = players[scripted[k]];
+				message.clear();
+				message.put_int(t);
+				message.put_int(ship.do_render() ? 1 : 0);
+				message.put_int(ship.get_coords().x);
+				message.put_int(ship.get_coords().y);
+				message.put_int(ship.get_damage());
+				sent[k] = precise_ticks();
+				if (!message.send(server_side[k]))
+				{
+					gone[k] = true;
+					lost++;
+					missing--;
+					continue;
+				}
+				waiting[k].fd = server_side[k];
+			}
+			double deadline = precise_ticks() + INPUT_WAIT;
+			while (missing > 0)
+			{
+				int wait = (int)ceil(deadline - precise_ticks());
+				if (wait <= 0 || poll(&waiting[0], count, wait) <= 0) break;
+				for (int k = 0; k < count; k++)
+				{
+					if (waiting[k].fd < 0 || waiting[k].revents == 0) continue;
+					Uint8 input = 0;
+					if (!message.receive(waiting[k].fd))
+					{
+						gone[k] = true;
+						waiting[k].fd = -1;
+						lost++;
+						missing--;
+						continue;
+					}
+					// Inputs for earlier ticks arrived too late and were already counted as lost
+					if (message.get_int() != t || !message.get(&input, 1)) continue;
+					round_trips.push_back(precise_ticks() - sent[k]);
+					players[scripted[k]].apply_input(input);
+					waiting[k].fd = -1;
+					missing--;
+				}
+			}
+			lost += missing;
+			
+			double start = precise_ticks();
+			room.tick();
+			double took = precise_ticks() - start;
+			
+			samples.push_back(took);
+			if (took > 1000 / FPS) late++;
+		}
+		for (int k = 0; k < count; k++)
+		{
+			close(server_side[k]);
+		}
+		waitpid(pid, NULL, 0);
+		printf("%7d  %6.2f  %6.2f  %6.2f  %6.2f  %4d  %7.3f  %7.3f  %4d\n", clients, percentile(samples, 0.5), percentile(samples, 0.95), percentile(samples, 0.99), percentile(samples, 1.0), late, percentile(round_trips, 0.5), percentile(round_trips, 0.99), lost);
+		fflush(stdout);
+		
+		if (clients == max_clients) break;
+	}
+}
+
+#endif
+
+/******************************************** BLIT BENCHMARK ****************************************/
+/*
+ Times drawing the game's own sprites, from the shooting star to the biggest
+ explosion, onto a screen-sized surface: through SDL with the RLE colour key
+ the textures used to have, through SDL with a plain colour key, and through
+ the sprite blitter, then through the sprite blitter again with the sprite and
+ target in RGB565 as -bpp 16 has them. The bars are drawn translucent like the
+ HUD draws them.
+*/
+struct Bench_Sprite
+{
+	const char *name;
+	const char *path;
+	// Surface alpha to draw with, or -1 for opaque
+	int alpha;
+};
+const int BENCH_SPRITES = 12;
+const Bench_Sprite BENCH_SPRITE[BENCH_SPRITES] = {
+	{ "shooting star", "shooting_star.gif", 128 },
+	{ "laser", "laser/1.gif", -1 },
+	{ "pod", "pod/1.gif", -1 },
+	{ "light ship", "light1off/1.gif", -1 },
+	{ "heavy ship", "heavy1off/1.gif", -1 },
+	{ "health bar", "healthbars/light1health.gif", 160 },
+	{ "shield bar", "healthbars/shieldbar.gif", 160 },
+	{ "display bar", "healthbars/bluebar.gif", 200 },
+	{ "planet", "planets/1.gif", -1 },
+	{ "mothership", "mother1off/1.gif", -1 },
+	{ "explosion", "explosions/2/5.gif", -1 },
+	{ "background", "background.gif", -1 }
+};
+
+// Microseconds per blit of a sprite spread over the target, through SDL or the sprite blitter
+double time_blits(SDL_Surface *image, SDL_Surface *target, int blits, bool use_sdl)
+{
+	int across = std::max(1, target->w - image->w);
+	int down = std::max(1, target->h - image->h);
+	double start = precise_ticks();
+	for (int i = 0; i < blits; i++)
+	{
+		int x = (i * 97) % across;
+		int y = (i * 61) % down;
+		if (use_sdl)
+		{
+			SDL_Rect offset = { (Sint16)x, (Sint16)y, 0, 0 };
+			SDL_BlitSurface(image, NULL, target, &offset);
+		}
+		else blit_sprite(image, NULL, target, x, y);
+	}
+	return (precise_ticks() - start) * 1000 / blits;
+}
+
+void run_blit_bench()
+{
+#if defined(BLIT_AVX2)
+	const char *blitter = "AVX2";
+#elif defined(BLIT_SSE2)
+	const char *blitter = "SSE2";
+#else
+	const char *blitter = "scalar";
+#endif
+	SDL_Surface *target = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 32, PACK_RMASK, PACK_GMASK, PACK_BMASK, 0);
+	SDL_Surface *target16 = SDL_CreateRGBSurface(SDL_SWSURFACE, SCREEN_WIDTH, SCREEN_HEIGHT, 16, 0xF800, 0x07E0, 0x001F, 0);
+	if (target == NULL || target16 == NULL)
+	{
+		SDL_FreeSurface(target);
+		SDL_FreeSurface(target16);
+		return;
+	}
+	SDL_FillRect(target, NULL, SDL_MapRGB(target->format, 20, 20, 40));
+	SDL_FillRect(target16, NULL, SDL_MapRGB(target16->format, 20, 20, 40));
+
+	printf("sprite           size     alpha  SDL RLE us  SDL us  %s us  Mpixels/s  565 us  Mpixels/s\n", blitter);
+	for (int i = 0; i < BENCH_SPRITES; i++)
+	{
+		const Bench_Sprite &b = BENCH_SPRITE[i];
+		SDL_Surface *loaded = IMG_Load(b.path);
+		if (loaded == NULL)
+		{
+			printf("%-15s  missing %s\n", b.name, b.path);
+			continue;
+		}
+		// One copy the way the textures used to be set up, one the way the blitter takes them
+		SDL_Surface *rle = SDL_ConvertSurface(loaded, target->format, SDL_SWSURFACE);
+		SDL_Surface *plain = SDL_ConvertSurface(loaded, target->format, SDL_SWSURFACE);
+		SDL_Surface *plain16 = SDL_ConvertSurface(loaded, target16->format, SDL_SWSURFACE);
+		SDL_FreeSurface(loaded);
+		if (rle == NULL || plain == NULL || plain16 == NULL)
+		{
+			SDL_FreeSurface(rle);
+			SDL_FreeSurface(plain);
+			SDL_FreeSurface(plain16);
+			continue;
+		}
+		Uint32 key = SDL_MapRGB(plain->format, 255, 0, 255);
+		SDL_SetColorKey(rle, SDL_RLEACCEL | SDL_SRCCOLORKEY, key);
+		SDL_SetColorKey(plain, SDL_SRCCOLORKEY, key);
+		SDL_SetColorKey(plain16, SDL_SRCCOLORKEY, SDL_MapRGB(plain16->format, 255, 0, 255));
+		if (b.alpha >= 0)
+		{
+			SDL_SetAlpha(rle, SDL_SRCALPHA, (Uint8)b.alpha);
+			SDL_SetAlpha(plain, SDL_SRCALPHA, (Uint8)b.alpha);
+			SDL_SetAlpha(plain16, SDL_SRCALPHA, (Uint8)b.alpha);
+		}
+
+		// About the same number of pixels for every sprite, but enough blits to time the small ones
+		int blits = std::max(200, 100000000 / (plain->w * plain->h));
+		double rle_us = time_blits(rle, target, blits, true);
+		double sdl_us = time_blits(plain, target, blits, true);
+		double ours_us = time_blits(plain, target, blits, false);
+		double ours16_us = time_blits(plain16, target16, blits, false);
+		char size[16];
+		sprintf(size, "%dx%d", plain->w, plain->h);
+		printf("%-15s  %-7s  %5d  %10.3f  %6.3f  %7.3f  %9.0f  %6.3f  %9.0f\n", b.name, size, b.alpha, rle_us, sdl_us, ours_us, plain->w * plain->h / ours_us,
+			ours16_us, plain->w * plain->h / ours16_us);
+		fflush(stdout);
+		SDL_FreeSurface(rle);
+		SDL_FreeSurface(plain);
+		SDL_FreeSurface(plain16);
+	}
+	SDL_FreeSurface(target);
+	SDL_FreeSurface(target16);
 }
 
-/******************************************** SHOOTING STAR CLASS *********************************/
-class Shooting_Star
+/********************************************* SHARDED WORLD ****************************************/
+/*
+ Runs one large match as vertical strips of the level, each simulated by its
+ own process. The coordinator (the parent process) keeps the planets and routes
+ everything between the regions over Unix sockets once per tick:
+ - ships that leave a region's strip migrate to the region that now holds them
+ - ships near a strip edge are copied to the neighbouring regions as ghosts, so
+   collisions, enemyInRange and planet capture see across the seam. Every region
+   also gets a copy of every ship now and then for the AI's long range choices.
+ - damage done to ghosts and capture progress go back as events, landing a tick later
+ Strip edges move to the quantiles of the ships' positions every few ticks so
+ that each region keeps a similar number of ships.
+ Ships travel as raw bytes, which only works between forked copies of this program.
+*/
+#ifndef WIN32
+
+// Ships this close to a strip edge are ghosted to the neighbouring region
+// (enemyInRange reaches 750 and a projectile about 450 more, plus a mothership's size)
+const int GHOST_MARGIN = 1700;
+// How often every region gets a copy of every ship, and how often the strips are rebalanced
+const int REFRESH_TICKS = 10;
+const int REBALANCE_TICKS = 40;
+
+// A ship on its way to a region, either migrating (SHIP_LOCAL) or as a ghost
+struct Shipment
+{
+	int ship;
+	int kind;
+	int from;
+	Ship state;
+};
+void put_shipment(Message &message, int ship, int kind, Ship &state)
+{
+	message.put_int(ship);
+	message.put_int(kind);
+	message.put(&state, sizeof(Ship));
+}
+
+// One strip of a sharded match, run in its own process
+class Region
 {
 	private:
-	//Holds coordinates and dimensions of the collision box
-	SDL_Rect box;
-	// X and Y Velocity
-	int xVel, yVel;
+	Room *room;
+	int fd;
+	int left, right;
+	Message in, out;
 	
 	public:
-	Shooting_Star();
-	// Displays Shooting_Star on screen
-	void show(SDL_Surface *screen);
-	// Moves Shooting_Star
-	void move();
-	SDL_Rect get_coords();
+	Region(Room *r, int socket);
+	// Runs ticks for the coordinator until it says stop
+	void run();
 };
 
-Shooting_Star::Shooting_Star()
+Region::Region(Room *r, int socket)
+{
+	room = r;
+	fd = socket;
+	left = 0;
+	right = LEVEL_WIDTH;
+}
+void Region::run()
 {
-	box.x = rand()%LEVEL_WIDTH;
-	box.y = rand()%LEVEL_HEIGHT;
-	box.w = 2;
-	box.h = 2;
-	int tempX = rand()%40;
-	int tempY = 0;
-	if (tempX < 25)
+	Ship *players = room->players;
+	int count = room->world.player_count;
+	while (in.receive(fd))
 	{
-		while(tempY < 25)
+		int tick = in.get_int();
+		if (tick < 0) break;
+		left = in.get_int();
+		right = in.get_int();
+		in.get(room->world.mothership, sizeof(room->world.mothership));
+		in.get(room->planets, sizeof(room->planets));
+		
+		// Ghosts from the last tick are out of date unless they are sent again
+		for (int i = 0; i < count; i++)
+		{
+			if (room->presence[i] == SHIP_GHOST) room->presence[i] = SHIP_REMOTE;
+		}
+		int hits = in.get_int();
+		for (int k = 0; k < hits; k++)
+		{
+			Hit hit;
+			in.get(&hit, sizeof(hit));
+			if (room->owns(hit.ship) && players[hit.ship].do_render()) players[hit.ship].hurt(hit.damage);
+		}
+		int ships = in.get_int();
+		for (int k = 0; k < ships; k++)
+		{
+			int i = in.get_int();
+			room->presence[i] = (Uint8)in.get_int();
+			in.get(&players[i], sizeof(Ship));
+			players[i].set_world(&room->world, i);
+		}
+		// Projectiles are checked against where the ships are now, ghosts included
+		room->world_index.build(players, count, room->projectiles);
+		
+		double start = precise_ticks();
+		room->tick();
+		double cost = precise_ticks() - start;
+		
+		out.clear();
+		out.put(&cost, sizeof(cost));
+		// Where the region's ships are, for rebalancing
+		int owned = 0;
+		for (int i = 0; i < count; i++)
+		{
+			if (room->owns(i)) owned++;
+		}
+		out.put_int(owned);
+		for (int i = 0; i < count; i++)
+		{
+			if (!room->owns(i)) continue;
+			out.put_int(i);
+			out.put_int(players[i].get_coords().x);
+		}
+		out.put(room->world.mothership, sizeof(room->world.mothership));
+		out.put_int(room->owns(room->world.this_mothership));
+		out.put_int(room->owns(room->world.enemy_mothership));
+		
+		out.put_int((int)room->hits.size());
+		for (unsigned int k = 0; k < room->hits.size(); k++)
+		{
+			out.put(&room->hits[k], sizeof(Hit));
+		}
+		room->hits.clear();
+		out.put_int((int)room->captures.size());
+		for (unsigned int k = 0; k < room->captures.size(); k++)
+		{
+			out.put(&room->captures[k], sizeof(Capture));
+		}
+		room->captures.clear();
+		
+		// Hand over ships that have left the strip and ghost the ones near its edges
+		bool refresh = tick % REFRESH_TICKS == 0;
+		std::vector<int> leaving, ghosts;
+		for (int i = 0; i < count; i++)
+		{
+			if (!room->owns(i)) continue;
+			int x = players[i].get_coords().x;
+			if (x < left || x >= right) leaving.push_back(i);
+			else if (refresh || x < left + GHOST_MARGIN || x >= right - GHOST_MARGIN) ghosts.push_back(i);
+		}
+		out.put_int((int)(leaving.size() + ghosts.size()));
+		for (unsigned int k = 0; k < leaving.size(); k++)
+		{
+			put_shipment(out, leaving[k], SHIP_LOCAL, players[leaving[k]]);
+			room->presence[leaving[k]] = SHIP_REMOTE;
+		}
+		for (unsigned int k = 0; k < ghosts.size(); k++)
 		{
-			tempY = rand()%40;
+			put_shipment(out, ghosts[k], SHIP_GHOST, players[ghosts[k]]);
 		}
+		if (!out.send(fd)) break;
 	}
-	else tempY = rand()%40;
-	xVel = tempX;
-	yVel = tempY;
+	close(fd);
 }
 
-SDL_Rect Shooting_Star::get_coords()
+// Moves the strip edges so each region holds about the same number of ships
+void balance_edges(std::vector<int> &x, std::vector<int> &edges)
 {
-	return box;
+	std::vector<int> sorted(x);
+	std::sort(sorted.begin(), sorted.end());
+	int regions = (int)edges.size() - 1;
+	edges[0] = 0;
+	edges[regions] = LEVEL_WIDTH;
+	for (int k = 1; k < regions; k++)
+	{
+		edges[k] = sorted[k * sorted.size() / regions];
+		if (edges[k] < edges[k-1]) edges[k] = edges[k-1];
+	}
 }
-void Shooting_Star::show( SDL_Surface *screen )
-{    
-    //Show the Shooting Star
-	SDL_SetAlpha(shooting_star, SDL_SRCALPHA, 255);
-	apply_surface( box.x - camera.x, box.y - camera.y, shooting_star, screen);
+
+// Returns the region whose strip holds x
+int region_of(std::vector<int> &edges, int x)
+{
+	int regions = (int)edges.size() - 1;
+	for (int k = 0; k < regions - 1; k++)
+	{
+		if (x < edges[k+1]) return k;
+	}
+	return regions - 1;
 }
 
-void Shooting_Star::move()
+// Runs an all-AI match of player_count ships split across regions processes
+void run_shards(int regions, int ticks, int player_count)
 {
-	//If the Shooting_Star hits the left or right edges of the screen, reverse velocity (bounce off)
-    if ((box.x + xVel) < 0 || (box.x + xVel + box.w) > LEVEL_WIDTH)
+	if (regions < 1) regions = 1;
+	if (player_count < 10) player_count = 10;
+	// A region that dies shows up as a failed write instead of stopping the coordinator
+	signal(SIGPIPE, SIG_IGN);
+	Room *room = create_server_room(player_count, 1);
+	Ship *players = room->players;
+	
+	std::vector<int> x(player_count), owner(player_count), edges(regions + 1);
+	for (int i = 0; i < player_count; i++)
 	{
-		xVel = -xVel;
-		box.x += xVel;
+		x[i] = players[i].get_coords().x;
 	}
-	else
+	balance_edges(x, edges);
+	for (int i = 0; i < player_count; i++)
 	{
-		box.x +=xVel;
+		owner[i] = region_of(edges, x[i]);
 	}
-
-	//If the Shooting_Star hits the top or bottom of the screen, bounce off
-    if ((box.y + yVel) < 0 || (box.y + yVel + box.h) > LEVEL_HEIGHT)
+	
+	// Each region starts as a copy of the whole match that only owns its own strip
+	fflush(stdout);
+	std::vector<int> sockets;
+	std::vector<pid_t> children;
+	for (int r = 0; r < regions; r++)
+	{
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+		{
+			perror("socketpair");
+			break;
+		}
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			for (unsigned int k = 0; k < sockets.size(); k++)
+			{
+				close(sockets[k]);
+			}
+			close(pair[0]);
+			room->presence.assign(player_count, SHIP_GHOST);
+			for (int i = 0; i < player_count; i++)
+			{
+				if (owner[i] == r) room->presence[i] = SHIP_LOCAL;
+			}
+			// Regions must not repeat each other's random numbers
+			room->world.rng.seed(r + 2);
+			Region region(room, pair[1]);
+			region.run();
+			_exit(0);
+		}
+		close(pair[1]);
+		if (pid < 0)
+		{
+			perror("fork");
+			close(pair[0]);
+			break;
+		}
+		sockets.push_back(pair[0]);
+		children.push_back(pid);
+	}
+	if ((int)sockets.size() < regions)
 	{
-		yVel = -yVel;
-		box.y += yVel;
+		regions = (int)sockets.size();
+		ticks = 0;
 	}
-	else
+	
+	std::vector< std::vector<Hit> > hits(regions);
+	std::vector< std::vector<Shipment> > arriving(regions);
+	std::vector<double> cost(regions, 0);
+	// Regions whose socket still works
+	std::vector<bool> alive(regions, true);
+	Message message;
+	int migrations = 0, ghosts = 0, bytes = 0;
+	double tick_total = 0;
+	printf("regions %d, ships %d, ghost margin %d\n", regions, player_count, GHOST_MARGIN);
+	for (int t = 0; t < ticks; t++)
 	{
-		box.y +=yVel;
+		double start = precise_ticks();
+		bool failed = false;
+		for (int r = 0; r < regions; r++)
+		{
+			message.clear();
+			message.put_int(t);
+			message.put_int(edges[r]);
+			message.put_int(edges[r+1]);
+			message.put(room->world.mothership, sizeof(room->world.mothership));
+			message.put(room->planets, sizeof(room->planets));
+			message.put_int((int)hits[r].size());
+			for (unsigned int k = 0; k < hits[r].size(); k++)
+			{
+				message.put(&hits[r][k], sizeof(Hit));
+			}
+			message.put_int((int)arriving[r].size());
+			for (unsigned int k = 0; k < arriving[r].size(); k++)
+			{
+				put_shipment(message, arriving[r][k].ship, arriving[r][k].kind, arriving[r][k].state);
+			}
+			bytes += message.size();
+			if (!message.send(sockets[r]))
+			{
+				alive[r] = false;
+				failed = true;
+			}
+			hits[r].clear();
+			arriving[r].clear();
+		}
+		
+		// Collect every region's tick before routing anything
+		std::vector<Hit> new_hits;
+		std::vector<Shipment> leaving;
+		for (int r = 0; r < regions; r++)
+		{
+			if (!alive[r]) continue;
+			if (!message.receive(sockets[r]))
+			{
+				alive[r] = false;
+				failed = true;
+				continue;
+			}
+			bytes += message.size();
+			double took = 0;
+			message.get(&took, sizeof(took));
+			cost[r] += took;
+			int owned = message.get_int();
+			for (int k = 0; k < owned; k++)
+			{
+				int i = message.get_int();
+				x[i] = message.get_int();
+			}
+			SDL_Rect mothership[2];
+			message.get(mothership, sizeof(mothership));
+			if (message.get_int()) room->world.mothership[0] = mothership[0];
+			if (message.get_int()) room->world.mothership[1] = mothership[1];
+			
+			int count = message.get_int();
+			for (int k = 0; k < count; k++)
+			{
+				Hit hit;
+				message.get(&hit, sizeof(hit));
+				new_hits.push_back(hit);
+			}
+			// Captures are applied in region order so every run ends the same way
+			count = message.get_int();
+			for (int k = 0; k < count; k++)
+			{
+				Capture capture;
+				message.get(&capture, sizeof(capture));
+				room->planets[capture.planet].capture(capture.strength, capture.team);
+			}
+			count = message.get_int();
+			for (int k = 0; k < count; k++)
+			{
+				Shipment shipment;
+				shipment.ship = message.get_int();
+				shipment.kind = message.get_int();
+				shipment.from = r;
+				message.get(&shipment.state, sizeof(Ship));
+				leaving.push_back(shipment);
+			}
+		}
+		if (failed)
+		{
+			fprintf(stderr, "A region stopped at tick %d\n", t);
+			break;
+		}
+		
+		// Route migrating ships to their new owners and ghosts to every region near them
+		bool refresh = t % REFRESH_TICKS == 0;
+		for (unsigned int k = 0; k < leaving.size(); k++)
+		{
+			Shipment &shipment = leaving[k];
+			int sx = shipment.state.get_coords().x;
+			x[shipment.ship] = sx;
+			if (shipment.kind == SHIP_LOCAL)
+			{
+				owner[shipment.ship] = region_of(edges, sx);
+				arriving[owner[shipment.ship]].push_back(shipment);
+				migrations++;
+				continue;
+			}
+			for (int r = 0; r < regions; r++)
+			{
+				if (r == shipment.from) continue;
+				if (refresh || (sx >= edges[r] - GHOST_MARGIN && sx < edges[r+1] + GHOST_MARGIN))
+				{
+					arriving[r].push_back(shipment);
+					ghosts++;
+				}
+			}
+		}
+		for (unsigned int k = 0; k < new_hits.size(); k++)
+		{
+			hits[owner[new_hits[k].ship]].push_back(new_hits[k]);
+		}
+		if (t % REBALANCE_TICKS == REBALANCE_TICKS - 1) balance_edges(x, edges);
+		tick_total += precise_ticks() - start;
+		
+		// Report once per second of game time
+		if ((t + 1) % FPS == 0)
+		{
+			printf("tick %d: %.2f ms/tick, %d migrations, %d ghosts, %d kB routed\n", t + 1, tick_total / FPS, migrations, ghosts, bytes / 1024);
+			for (int r = 0; r < regions; r++)
+			{
+				int owned = 0;
+				for (int i = 0; i < player_count; i++)
+				{
+					if (owner[i] == r) owned++;
+				}
+				printf("  region %d: x %5d-%5d  %4d ships  %.2f ms/tick\n", r, edges[r], edges[r+1], owned, cost[r] / FPS);
+				cost[r] = 0;
+			}
+			fflush(stdout);
+			migrations = 0;
+			ghosts = 0;
+			bytes = 0;
+			tick_total = 0;
+		}
 	}
 	
+	// Tell the regions that are still there to stop
+	for (int r = 0; r < regions; r++)
+	{
+		message.clear();
+		message.put_int(-1);
+		if (alive[r]) message.send(sockets[r]);
+		close(sockets[r]);
+	}
+	for (unsigned int k = 0; k < children.size(); k++)
+	{
+		waitpid(children[k], NULL, 0);
+	}
+	delete room;
 }
 
-int get_distance(Circle a, Circle b)
-{
-	//return sqrt( double pow( b.x - a.x, 2 ) + double pow( b.y - a.y, 2 ) );
-	double g = pow( (double)b.x - (double)a.x, 2 );
-	double h =  pow( (double)b.y - (double)a.y, 2 );
-    return (int) sqrt(g + h);
-}
+#endif
+
 /********************************************* MAIN METHOD ******************************************/
 int main( int argc, char* args[] )
 {
-	// Set all buttons to react to screen size change
-	Button newGame( (SCREEN_WIDTH / 2) - (150/2) - 200, (SCREEN_HEIGHT / 2) - (50/2) - 120, 150, 50, 0);
-	Button howToPlay( (SCREEN_WIDTH / 2) - (150/2), (SCREEN_HEIGHT / 2) - (50/2) - 120, 150, 50, 1);
-	Button exitGame( (SCREEN_WIDTH / 2) - (150/2) + 200, (SCREEN_HEIGHT / 2) - (50/2) - 120, 150, 50, 2);
-	Button team1 ((SCREEN_WIDTH / 2) - (125/2) - 100, (SCREEN_HEIGHT / 2) - (125/2), 125, 125, 3);
-	Button team2 ((SCREEN_WIDTH / 2) - (125/2) + 100, (SCREEN_HEIGHT / 2) - (125/2), 125, 125, 4);
-	Button light1 ((SCREEN_WIDTH / 2) - (200/2) - 150, (SCREEN_HEIGHT / 2) - (120/2)+ 50, 200, 120, 5);
-	Button light2 ((SCREEN_WIDTH / 2) - (200/2) - 150, (SCREEN_HEIGHT / 2) - (87/2)+ 50, 200, 87, 6);
-	Button heavy1 ((SCREEN_WIDTH / 2) - (203/2) + 150, (SCREEN_HEIGHT / 2) - (180/2)+ 50, 203, 180, 7);
-	Button heavy2 ((SCREEN_WIDTH / 2) - (259/2) + 150, (SCREEN_HEIGHT / 2) - (180/2)+ 50, 259, 180, 8);
-	
 	bool quit = false;
-	// Create stars
-	Shooting_Star star[SHOOTING_STARS];
+	// Shooting stars, and the engine trails and debris of the ships
+	Particle_System stars(true);
+	Particle_System sparks(false);
+	// Explosions of the wrecked ships
+	Animation_Pool explosions;
 	
-	// Create planets
-	Planet planets[MAX_PLANETS];
-	int count = 0;
-	srand((unsigned)time(0));
-	while (count < MAX_PLANETS)
+	// Lockstep options: -record <file> writes this session's inputs, -replay <file> plays one back,
+	// -host <socket> waits for another copy of the game to -join <socket> and play the match live
+	// -loadtest <clients> [ticks] runs the headless load generator instead of the game
+	// -server <rooms> [seconds] [threads] hosts many AI matches without a window
+	// -shards <regions> [ticks] [ships] splits one large AI match across processes
+	// -map <file> draws the background from a map file, -makemap <file> <columns> <rows> <image>... writes one
+	// -profile prints what drawing each layer costs every second
+	// -pack <file> takes the textures from an asset pack, -cookassets <file> writes one
+	// -spritebudget <megabytes> limits how much texture memory is kept resident
+	// -noatlas draws ship, pod and explosion frames from separate surfaces, to compare against the atlases
+	// -blitbench times drawing the game's sprites through SDL and through the sprite blitter
+	// -bands <n> splits each frame into n horizontal bands drawn by as many threads
+	// -bpp 16 draws in RGB565, converting every texture to it as it loads
+	// -size <width> <height> opens the screen at another size than 1024 x 768
+	Lockstep lockstep;
+	const char *map = NULL;
+	const char *pack = NULL;
+	int sprite_budget = SPRITE_BUDGET;
+	int bands = 1;
+	bool profile = false;
+	int profile_frames = 0;
+	for (int i = 1; i < argc; i++)
 	{
-		int type = rand()%4;
-		Circle temp;
-		temp.x = rand()%14200;
-		temp.y = rand()%14200;
-		for (int i = 0; i <= count; i++)
+		if (strcmp(args[i], "-profile") == 0) profile = true;
+		if (strcmp(args[i], "-noatlas") == 0) sprites.use_atlases(false);
+		if (strcmp(args[i], "-blitbench") == 0)
+		{
+			run_blit_bench();
+			return 0;
+		}
+	}
+	for (int i = 1; i + 1 < argc; i++)
+	{
+		if (strcmp(args[i], "-makemap") == 0)
 		{
-			if (get_distance(temp, planets[count].get_circle()) < 1200)
+			if (i + 4 >= argc)
+			{
+				fprintf(stderr, "Usage: -makemap <file> <columns> <rows> <image>...\n");
+				return 1;
+			}
+			std::vector<const char*> names(args + i + 4, args + argc);
+			if (!Tilemap::write(args[i+1], atoi(args[i+2]), atoi(args[i+3]), names))
 			{
-				temp.x = rand()%14200;
-				temp.y = rand()%14200;
-				i = 0;
+				fprintf(stderr, "Could not write map %s\n", args[i+1]);
+				return 1;
 			}
+			return 0;
+		}
+		if (strcmp(args[i], "-map") == 0) map = args[i+1];
+		if (strcmp(args[i], "-cookassets") == 0)
+		{
+			if (!cook_assets(args[i+1]))
+			{
+				fprintf(stderr, "Could not write asset pack %s\n", args[i+1]);
+				return 1;
+			}
+			return 0;
+		}
+		if (strcmp(args[i], "-pack") == 0) pack = args[i+1];
+		if (strcmp(args[i], "-spritebudget") == 0) sprite_budget = atoi(args[i+1]);
+		if (strcmp(args[i], "-bands") == 0) bands = atoi(args[i+1]);
+		if (strcmp(args[i], "-bpp") == 0)
+		{
+			screen_bpp = atoi(args[i+1]);
+			if (screen_bpp != 16 && screen_bpp != 32)
+			{
+				fprintf(stderr, "-bpp takes 16 or 32\n");
+				return 1;
+			}
+		}
+		if (strcmp(args[i], "-size") == 0)
+		{
+			// The menu pictures are 800 x 600
+			screen_width = i + 2 < argc ? atoi(args[i+1]) : 0;
+			screen_height = i + 2 < argc ? atoi(args[i+2]) : 0;
+			if (screen_width < 800 || screen_height < 600 || screen_width > 8192 || screen_height > 8192)
+			{
+				fprintf(stderr, "-size takes a width and height from 800 x 600 to 8192 x 8192\n");
+				return 1;
+			}
+		}
+		if (strcmp(args[i], "-loadtest") == 0)
+		{
+#ifdef WIN32
+			fprintf(stderr, "-loadtest needs fork and Unix sockets\n");
+			return 1;
+#else
+			int ticks = 200;
+			if (i + 2 < argc) ticks = atoi(args[i+2]);
+			run_load_test(atoi(args[i+1]), ticks);
+			return 0;
+#endif
+		}
+		if (strcmp(args[i], "-server") == 0)
+		{
+			int seconds = 10;
+			int threads = 4;
+			if (i + 2 < argc) seconds = atoi(args[i+2]);
+			if (i + 3 < argc) threads = atoi(args[i+3]);
+			if (atoi(args[i+1]) < 1)
+			{
+				fprintf(stderr, "-server needs at least one room\n");
+				return 1;
+			}
+			if( SDL_Init( SDL_INIT_TIMER ) == -1 ) return 1;
+			run_server(atoi(args[i+1]), seconds, threads);
+			SDL_Quit();
+			return 0;
+		}
+		if (strcmp(args[i], "-shards") == 0)
+		{
+#ifdef WIN32
+			fprintf(stderr, "-shards needs fork and Unix sockets\n");
+			return 1;
+#else
+			int ticks = 400;
+			int ships = 400;
+			if (i + 2 < argc) ticks = atoi(args[i+2]);
+			if (i + 3 < argc) ships = atoi(args[i+3]);
+			run_shards(atoi(args[i+1]), ticks, ships);
+			return 0;
+#endif
+		}
+		if (strcmp(args[i], "-record") == 0) lockstep.record(args[i+1]);
+		else if (strcmp(args[i], "-replay") == 0 && !lockstep.playback(args[i+1]))
+		{
+			fprintf(stderr, "Could not read lockstep log %s\n", args[i+1]);
+			return 1;
+		}
+		else if (strcmp(args[i], "-host") == 0 && !lockstep.host(args[i+1]))
+		{
+			fprintf(stderr, "Could not host a lockstep match on %s\n", args[i+1]);
+			return 1;
+		}
+		else if (strcmp(args[i], "-join") == 0 && !lockstep.join(args[i+1]))
+		{
+			fprintf(stderr, "Could not join a lockstep match on %s\n", args[i+1]);
+			return 1;
 		}
-		planets[count].create(type, temp.x, temp.y);
-		count++;
 	}
-	// Create players
-	Ship players[MAX_PLAYERS];
+	
+	camera.w = screen_width;
+	camera.h = screen_height;
+	// Set all buttons to react to screen size change
+	Button newGame( (screen_width / 2) - (150/2) - 200, (screen_height / 2) - (50/2) - 120, 150, 50, 0);
+	Button howToPlay( (screen_width / 2) - (150/2), (screen_height / 2) - (50/2) - 120, 150, 50, 1);
+	Button exitGame( (screen_width / 2) - (150/2) + 200, (screen_height / 2) - (50/2) - 120, 150, 50, 2);
+	Button team1 ((screen_width / 2) - (125/2) - 100, (screen_height / 2) - (125/2), 125, 125, 3);
+	Button team2 ((screen_width / 2) - (125/2) + 100, (screen_height / 2) - (125/2), 125, 125, 4);
+	Button light1 ((screen_width / 2) - (200/2) - 150, (screen_height / 2) - (120/2)+ 50, 200, 120, 5);
+	Button light2 ((screen_width / 2) - (200/2) - 150, (screen_height / 2) - (87/2)+ 50, 200, 87, 6);
+	Button heavy1 ((screen_width / 2) - (203/2) + 150, (screen_height / 2) - (180/2)+ 50, 203, 180, 7);
+	Button heavy2 ((screen_width / 2) - (259/2) + 150, (screen_height / 2) - (180/2)+ 50, 259, 180, 8);
+	
+	// The local match, and shorthands for its contents
+	Room game(MAX_PLAYERS, FPS);
+	Planet *planets = game.planets;
+	Ship *players = game.players;
+	bool &paused = game.world.paused;
+	int &this_mothership = game.world.this_mothership;
 	int this_player = 0;
-	// Init game for 'quick start'
-	this_mothership = 1;
-	enemy_mothership = 2;
-	// Set motherships
-	players[1].set_type(2);
-	players[2].set_type(5);
-	// Make motherships distance further apart if necessary
-	while (get_distance(players[1].get_circle(), players[2].get_circle()) < 10000)
-	{
-		players[2].set_type(5);
-	}
-	// Set reference boxes
-	mothership[0] = players[this_mothership].get_coords();
-	mothership[1] = players[enemy_mothership].get_coords();
-	players[0].set_type(player_type);
-	this_mothership = players[this_player].get_team();
-	if (this_mothership == 1) 
-	{
-		blue_mother = 0;
-		red_mother = 1;
-		enemy_mothership = 2;
-	}
-	else 
-	{
-		blue_mother = 1;
-		red_mother = 0;
-		enemy_mothership = 1;
-	}
-	// init AI
-	players[1].ai_on();
-	players[2].ai_on();
-	srand((unsigned)time(0));
-
-	// init other players and distribute equally between both teams
-	for (int i = 3; i < (MAX_PLAYERS/2); i++)
+	// Ship flown by the peer that joined a live match (-1 without one)
+	int peer_ship = -1;
+	if (lockstep.get_mode() != LOCKSTEP_OFF && lockstep.get_mode() != LOCKSTEP_RECORD)
 	{
-		int type = rand()%2;
-		players[i].set_type(type);
-		players[i].ai_on();
+		// Go straight into the recorded or hosted match
+		player_type = lockstep.player_type;
+		paused = false;
+		menu_position = 3;
 	}
-	srand((unsigned)time(0));
-
-	for (int i = (MAX_PLAYERS/2); i < MAX_PLAYERS; i++)
+	if (lockstep.get_mode() != LOCKSTEP_PLAYBACK) lockstep.start((Uint32)time(0), player_type);
+	game.create_world(lockstep.player_type, lockstep.seed);
+	if (lockstep.get_mode() == LOCKSTEP_PEER)
 	{
-		int type = rand()%5;
-		while (type < 3)
-		{
-			type = rand()%5;
-		}
-		players[i].set_type(type);
-		players[i].ai_on();
+		// The peer that joined takes a fighter on the other team
+		peer_ship = lockstep.player_type < 3 ? game.world.player_count / 2 + 1 : 3;
+		players[peer_ship].ai_off();
+		if (lockstep.joined()) this_player = peer_ship;
 	}
+	game.interest.set_viewer(this_player);
+	
     //The tiles that will be used
-    Tile *tiles[ TOTAL_TILES ];
+    Tilemap tiles;
     
     //The frames rate regulator
     Timer fps;
@@ -2652,16 +7995,34 @@ int main( int argc, char* args[] )
     {
         return 1;
     }
+    render_queue.set_bands( bands );
     //Load the files
-    if( load_files() == false )
+    sprites.set_budget( (long)sprite_budget * 1024 * 1024 );
+    if( load_files( pack ) == false )
     {
         return 1;
     }
+    prefetch_sprites(game);
     //Set the tiles
-    if( set_tiles( tiles ) == false )
+    if( set_tiles( tiles, map ) == false )
     {
         return 1;    
     }
+    //Create stars
+    create_shooting_stars( stars, SHOOTING_STARS );
+    
+    //The radar minimap
+    Radar radar;
+    if( radar.create() == false )
+    {
+        return 1;
+    }
+    //The background layers in drawing order: the tiles, then a star field that scrolls faster to look nearer
+    Background background;
+    if( background.add_layer( paint_tiles, &tiles, 100 ) == false || background.add_layer( paint_stars, NULL, 150 ) == false )
+    {
+        return 1;
+    }
 	
     //Make sure the program waits for a quit
     while( quit == false )
@@ -2677,103 +8038,45 @@ int main( int argc, char* args[] )
 			{
 				int reset = 0;
 				// Handle menu events
-				newGame.handle_events();
-				howToPlay.handle_events();
-				exitGame.handle_events();
+				newGame.handle_events(paused);
+				howToPlay.handle_events(paused);
+				exitGame.handle_events(paused);
 				
 				if (menu_position == 0)
 				{
-					team1.handle_events();
-					team2.handle_events();
+					team1.handle_events(paused);
+					team2.handle_events(paused);
 				}
 				else if (menu_position == 1)
 				{
-					light1.handle_events();
-					heavy1.handle_events();
+					light1.handle_events(paused);
+					heavy1.handle_events(paused);
 					reset = 1;
 				}
 				else if (menu_position == 2)
 				{
-					light2.handle_events();
-					heavy2.handle_events();
+					light2.handle_events(paused);
+					heavy2.handle_events(paused);
 					reset = 1;
 				}
 				
-				// Reset game (as above)
-				if (reset == 1)
+				// Start a new game once the player has picked their ship (live matches just carry on)
+				if (reset == 1 && !paused && lockstep.get_mode() != LOCKSTEP_PEER)
 				{
-					count = 0;
-					srand((unsigned)time(0));
-					while (count < MAX_PLANETS)
-					{
-						int type = rand()%4;
-						Circle temp;
-						temp.x = rand()%14200;
-						temp.y = rand()%14200;
-						for (int i = 0; i <= count; i++)
-						{
-							if (get_distance(temp, planets[count].get_circle()) < 1200)
-							{
-								temp.x = rand()%14200;
-								temp.y = rand()%14200;
-								i = 0;
-							}
-						}
-						planets[count].create(type, temp.x, temp.y);
-						count++;
-					}
-					players[1].set_type(2);
-					players[2].set_type(5);
-					while (get_distance(players[1].get_circle(), players[2].get_circle()) < 10000)
-					{
-						players[2].set_type(5);
-					}
-					
-					
-					players[0].set_type(player_type);
-					this_mothership = players[this_player].get_team();
-					if (this_mothership == 1) 
-					{
-						blue_mother = 0;
-						red_mother = 1;
-						enemy_mothership = 2;
-					}
-					else 
-					{
-						blue_mother = 1;
-						red_mother = 0;
-						enemy_mothership = 1;
-					}
-					mothership[0] = players[this_mothership].get_coords();
-					mothership[1] = players[enemy_mothership].get_coords();
-					players[0].set_type(player_type);
-					players[1].ai_on();
-					players[2].ai_on();
-					srand((unsigned)time(0));
-
-					for (int i = 3; i < (MAX_PLAYERS/2)+1; i++)
-					{
-						int type = rand()%2;
-						players[i].set_type(type);
-						players[i].ai_on(); 
-					}
-					srand((unsigned)time(0));
-
-					for (int i = (MAX_PLAYERS/2)+1; i < MAX_PLAYERS; i++)
-					{
-						int type = rand()%5;
-						while (type < 3)
-						{
-							type = rand()%5;
-						}
-						players[i].set_type(type);
-						players[i].ai_on();
-					}
+					lockstep.start((Uint32)time(0), player_type);
+					game.create_world(player_type, lockstep.seed);
+					prefetch_sprites(game);
+					explosions.clear();
 				}
-
-				
 			}
-            players[0].handle_input( event );
+			// Played back matches take the player's input from the log
+            if (lockstep.get_mode() != LOCKSTEP_PLAYBACK) players[this_player].handle_input( event );
+            
+            //Load the textures again from disk (or the pack) after they have been edited
+            if( event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F5 ) sprites.reload();
+            
+            //The window was uncovered, so only part of it would be sent otherwise
+            if( event.type == SDL_VIDEOEXPOSE ) render_queue.invalidate();
             
             //If the user has Xed out the window
             if( event.type == SDL_QUIT )
@@ -2784,36 +8087,25 @@ int main( int argc, char* args[] )
         }
 
         //Set the camera
-        players[0].set_camera();
+        players[this_player].set_camera();
+		camera = game.world.camera;
         
-        //Show the tiles
-         for( int t = 0; t < TOTAL_TILES; t++ )
-         {
-             tiles[ t ]->show( screen );
-         }
+        //Keep the map chunks under the camera and every ship resident
+        std::vector<SDL_Rect> near;
+        near.push_back( camera );
+        for( int i = 0; i < game.world.player_count; i++ )
+        {
+            if( players[i].do_render() ) near.push_back( players[i].get_view() );
+        }
+        tiles.page( near );
+        
+        //Show the background
+        background.show();
 
 		if( event.type == SDL_KEYDOWN )
 			{
 				switch( event.key.keysym.sym )
 				{
-					// HANDLE RESPAWN KEYS
-					case SDLK_1:
-					if(players[0].do_render() || players[0].get_pod().r != 0 || mothership[players[0].get_team()-1].w == 0){}
-					else if (players[0].get_team() == 1) 
-					{
-						players[0].set_type(0);
-					}
-					else players[0].set_type(3);
-					break;
-					case SDLK_2:
-					if(players[0].do_render() || players[0].get_pod().r != 0 || mothership[players[0].get_team()-1].w == 0){}
-					else if (players[0].get_team() == 1) 
-					{
-						players[0].set_type(1);
-					}
-					else players[0].set_type(4);
-					break;
-					
 					// Handle resume key
 					case SDLK_ESCAPE:
 					active_button = 1;
@@ -2830,13 +8122,14 @@ int main( int argc, char* args[] )
 		// Show menu
 		if (paused)
 		{
+			sprites.use( SET_MENU );
 			SDL_ShowCursor(SDL_ENABLE);
 			// Resize to fit window
-			int xW = (SCREEN_WIDTH / 2) - (800/2);
-			int yH = (SCREEN_HEIGHT / 2) - (600/2); 
+			int xW = (screen_width / 2) - (800/2);
+			int yH = (screen_height / 2) - (600/2); 
 			int position = 0;
 			if (menu_position == 3) position = 1;
-			apply_surface(xW,yH, menu[position], screen);
+			render_queue.add( LAYER_MENU, xW, yH, assets.surface(menu[position]) );
 			if (menu_position == 0)
 			{
 				team1.show();
@@ -2864,184 +8157,87 @@ int main( int argc, char* args[] )
 		else
 		{
 			SDL_ShowCursor(SDL_DISABLE);
-			// Check collision between ships 
-			// Check all players for collisions
-			for(int i= 0 ; i < MAX_PLAYERS; i++)
+			// One lockstep tick: the player's input for this tick, then the simulation
+			players[0].apply_input( lockstep.exchange( players[this_player].get_keys() ) );
+			if (peer_ship >= 0) players[peer_ship].apply_input( lockstep.get_peer_input() );
+			if (lockstep.finished())
 			{
-				for (int c = 0; c < MAX_PLAYERS; c++)
-				{
-					// Check that the two players are not the same and are both alive
-					if( i!= c &&  players[i].do_render() && players[c].do_render())
-					{	
-						// Check each player for a colision
-						if (check_collision((Circle&)(Circle const&)players[i].get_circle(), (Circle&)(Circle const&)players[c].get_circle()) == true)			
-						{
-							// If player is on team one and is colliding with mothership, recharge shield
-							if (players[i].get_team() == 1 && players[c].get_type() == 2)
-							{
-								players[i].recharge_shield(1);
-							}
-							// Above for team 2
-							else if (players[i].get_team() == 2 && players[c].get_type() == 5)
-							{
-								players[i].recharge_shield(1);
-							}
-							// NOTE: Collision detection between ships was removed to enhance gameplay, as the 'bounce' function made the gameplay frustrating
-						}
-						// Check that player 'i's projectile has not impacted on player 'c's ship
-						if (collision((SDL_Rect&)(SDL_Rect const&)players[i].get_proj().get_coords(), (SDL_Rect&)(SDL_Rect const&)players[c].get_coords()) == true && i != c)
-						{
-							// Do not allow friendly fire
-							// If player 1 is 0,1,2 and player 2 is 0,1,2 then do nothing
-							if(players[i].get_team() == 1 && players[c].get_team() == 1){}// && players[c].get_type() < 3){}
-							// Else if player 1 is 3,4,5 and player 2 is 3,4,5 then do nothing
-							else if(players[i].get_team() == 2 && players[c].get_team() == 2){}// && players[i].get_type() > 2 && players[c].get_type() < 6 && players[c].get_type() > 2){}
-							// Otherwise, hurt player
-							else
-							{
-								players[i].destroy_proj();
-								players[c].hurt(players[i].get_damage());
-							}
-						}
-						
-					}
-					
-				}
+				if (lockstep.get_mode() == LOCKSTEP_PEER) fprintf(stderr, "Lockstep peer left after %d ticks\n", lockstep.get_tick());
+				else fprintf(stderr, "Lockstep replay verified %d ticks\n", lockstep.get_tick());
+				quit = true;
 			}
-			for (int i = 0; i< MAX_PLANETS; i++)
+			game.tick();
+			/* SHOW GRAPHICS ON SCREEN */
+			// Only what is inside the camera is drawn; the rest is counted as culled
+			int drawn = 0;
+			int culled = 0;
+			stars.update();
+			queue_particles( LAYER_STARS, stars );
+			for (int i = 0; i < MAX_PLANETS; i++)
 			{
-				for (int c = 0; c < MAX_PLAYERS; c++)
-				{	
-					// if player collides with planet - begin capture
-					if (collision((SDL_Rect&)(SDL_Rect const&)planets[i].get_coords(), (SDL_Rect&)(SDL_Rect const&)players[c].get_coords()) == true && players[c].do_render())
+				if (collision(camera, (SDL_Rect&)(SDL_Rect const&)planets[i].get_coords()))
+				{
+					planets[i].show();
+					// PLANET OWNER LOGOS
+					if (planets[i].get_owner() > 0)
 					{
-						if (players[c].get_type() < 3)
-						{
-							planets[i].capture(players[c].get_damage()/2, 1);
-						}
-						else planets[i].capture(players[c].get_damage()/2, 2);
+						int tempX = planets[i].get_coords().x - camera.x + (planets[i].get_coords().w/2)-62;
+						int tempY = planets[i].get_coords().y - camera.y + (planets[i].get_coords().h/2)-62;
+						render_queue.add( LAYER_LOGOS, tempX, tempY, assets.surface(planet_owner[planets[i].get_owner()-1]) );
 					}
+					drawn++;
 				}
-			
-			}
-
-			for (int i = 0; i < MAX_PLAYERS; i++)
-			{
-				players[i].move(planets, players);
+				else culled++;
 			}
-			/* SHOW GRAPHICS ON SCREEN */
-			for (int i = 0; i < SHOOTING_STARS; i++)
+			// Explosions run on simulation ticks and are only drawn when seen
+			for (unsigned int b = 0; b < game.blasts.size(); b++)
 			{
-				star[i].move();
-				star[i].show(screen);
+				explosions.spawn( game.blasts[b].box, game.blasts[b].type, game.ticks );
+				emit_debris( sparks, game.blasts[b].box );
 			}
-			int count = 0;
-			while (count < MAX_PLANETS)
+			explosions.update( game.ticks );
+			explosions.show( game.ticks, drawn, culled );
+			// Shield flashes run whether or not they are seen
+			for (int i = 0; i < game.world.player_count; i++)
 			{
-				planets[count].show(screen);
-				count++;
+				players[i].animate();
+				int x, y, xDir, yDir;
+				if (players[i].get_exhaust( x, y, xDir, yDir )) emit_trail( sparks, x, y, xDir, yDir );
 			}
-			players[this_mothership].show(screen);
-			players[enemy_mothership].show(screen);
-
-			count = 0;
-			while (count < MAX_PLAYERS)
+			sparks.update();
+			queue_particles( LAYER_EFFECTS, sparks );
+			std::vector<int> in_view;
+			game.world_index.visible(camera, in_view);
+			for (unsigned int v = 0; v < in_view.size(); v++)
 			{
-				if (count == this_mothership || count == enemy_mothership) {}
-				else players[count].show( screen );
-				
-				count ++;
+				if (players[in_view[v]].show()) drawn++;
+				else culled++;
 			}
-			// PLANET OWNER LOGOS
-			for (int i = 0; i < MAX_PLANETS; i++)
+			culled += game.world.player_count - (int)in_view.size();
+			std::vector<int> shots;
+			game.world_index.projectiles.query(camera, shots);
+			for (unsigned int v = 0; v < shots.size(); v++)
 			{
-				if (planets[i].get_owner() > 0)
-				{
-					int tempX = planets[i].get_coords().x - camera.x + (planets[i].get_coords().w/2)-62;
-					int tempY = planets[i].get_coords().y - camera.y + (planets[i].get_coords().h/2)-62;
-					apply_surface( tempX, tempY, planet_owner[planets[i].get_owner()-1], screen);
-				}
+				game.projectiles.show(shots[v]);
 			}
+			drawn += (int)shots.size();
+			culled += game.projectiles.size() - (int)shots.size();
+			render_queue.count(drawn, culled);
 			
 			// HEALTH BAR
-			players[0].show_health( screen );
+			players[this_player].show_health();
 			
 			// RADAR SCREEN
-			if (players[this_player].get_type() < 3)apply_surface( 0, 0, radar_screen[0], screen);
-			else apply_surface(0, 0, radar_screen[1], screen);
-			for (int i = 0; i < MAX_PLANETS; i++)
-			{
-				if (planets[i].get_owner() == 1)
-				{
-					apply_surface( (planets[i].get_coords().x / 100)+7, (planets[i].get_coords().y / 100)+7, radar_dot[6], screen);
-				}
-				else if (planets[i].get_owner() == 2)
-				{
-					apply_surface( (planets[i].get_coords().x / 100)+7, (planets[i].get_coords().y / 100)+7, radar_dot[7], screen);
-				}
-				else apply_surface( (planets[i].get_coords().x / 100)+7, (planets[i].get_coords().y / 100)+7, radar_dot[5], screen);
-			}
-			for (int i = 0; i < MAX_PLAYERS; i++)
-			{
-				if (players[i].do_render())
-				{
-					if (i == this_player) {apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[2], screen);}
-					else
-					{
-						switch (players[i].get_type())
-						{
-							case 0:
-							if (players[this_player].get_team() != players[i].get_team())
-							{
-								if (players[i].revealed()) apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[0], screen);
-							}
-							else apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[0], screen);
-							break;
-							case 1:
-							if (players[this_player].get_team() != players[i].get_team())
-							{
-								if (players[i].revealed()) apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[0], screen);
-							}
-							else apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[0], screen);
-							break;
-							case 2:
-							if (players[this_player].get_team() != players[i].get_team())
-							{
-								if (players[i].revealed()) apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[3], screen);
-							}
-							else apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[3], screen);
-							break;
-							case 3:
-							if (players[this_player].get_team() != players[i].get_team())
-							{
-								if (players[i].revealed()) apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[1], screen);
-							}
-							else apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[1], screen);break;
-							case 4:
-							if (players[this_player].get_team() != players[i].get_team())
-							{
-								if (players[i].revealed()) apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[1], screen);
-							}
-							else apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[1], screen);break;
-							case 5:
-							if (players[this_player].get_team() != players[i].get_team())
-							{
-								if (players[i].revealed()) apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[4], screen);
-							}
-							else apply_surface( (players[i].get_coords().x / 100)+7, (players[i].get_coords().y / 100)+7, radar_dot[4], screen);break;
-							default: break;
-						}
-					}
-				}
-			}
-			mothership[0] = players[this_mothership].get_coords();
-			mothership[1] = players[enemy_mothership].get_coords();
+			radar.show(players, game.interest.radar, planets, this_player);
 			if (!players[this_player].do_render() && !players[this_mothership].do_render() && !paused)
 			{
-				int xW = (SCREEN_WIDTH / 2) - (741/2);
-				int yH = (SCREEN_HEIGHT / 2) - (51/2); 
-				apply_surface( xW, yH, menu[2], screen);
+				int xW = (screen_width / 2) - (741/2);
+				int yH = (screen_height / 2) - (51/2); 
+				sprites.use( SET_MENU );
+				render_queue.add( LAYER_MENU, xW, yH, assets.surface(menu[2]) );
 			}
+			// Check this tick's world against the peer's
+			if (!lockstep.end_tick( game.hash() )) quit = true;
 		}
 		int red_captured = 0;
 		int blue_captured = 0;
@@ -3056,16 +8252,17 @@ int main( int argc, char* args[] )
 		{
 			if (players[this_player].get_team() == 1)
 			{
-				int xW = (SCREEN_WIDTH / 2) - (741/2);
-				int yH = (SCREEN_HEIGHT / 2) - (51/2); 
-				apply_surface( xW, yH, menu[2], screen);
-				players[this_player].destroy();
+				int xW = (screen_width / 2) - (741/2);
+				int yH = (screen_height / 2) - (51/2); 
+				sprites.use( SET_MENU );
+				render_queue.add( LAYER_MENU, xW, yH, assets.surface(menu[2]) );
 			}
 			else
 			{
-				int xW = (SCREEN_WIDTH / 2) - (741/2);
-				int yH = (SCREEN_HEIGHT / 2) - (51/2); 
-				apply_surface( xW, yH, menu[3], screen);
+				int xW = (screen_width / 2) - (741/2);
+				int yH = (screen_height / 2) - (51/2); 
+				sprites.use( SET_MENU );
+				render_queue.add( LAYER_MENU, xW, yH, assets.surface(menu[3]) );
 			}
 		}
 		// Same for blue win
@@ -3073,20 +8270,35 @@ int main( int argc, char* args[] )
 		{	
 			if (players[this_player].get_team() == 1)
 			{
-				int xW = (SCREEN_WIDTH / 2) - (741/2);
-				int yH = (SCREEN_HEIGHT / 2) - (51/2); 
-				apply_surface( xW, yH, menu[3], screen);
+				int xW = (screen_width / 2) - (741/2);
+				int yH = (screen_height / 2) - (51/2); 
+				sprites.use( SET_MENU );
+				render_queue.add( LAYER_MENU, xW, yH, assets.surface(menu[3]) );
 			}
 			else
 			{
-				int xW = (SCREEN_WIDTH / 2) - (741/2);
-				int yH = (SCREEN_HEIGHT / 2) - (51/2); 
-				apply_surface( xW, yH, menu[2], screen);
-				players[this_player].destroy();
+				int xW = (screen_width / 2) - (741/2);
+				int yH = (screen_height / 2) - (51/2); 
+				sprites.use( SET_MENU );
+				render_queue.add( LAYER_MENU, xW, yH, assets.surface(menu[2]) );
 			}
 		}
-		//Update the screen
-		if( SDL_Flip( screen ) == -1 )
+		// The losing team's players are wrecked the same way on every peer
+		if ((red_captured >= MAX_PLANETS || blue_captured >= MAX_PLANETS) && !paused)
+		{
+			int losers = red_captured >= MAX_PLANETS ? 1 : 2;
+			if (players[0].get_team() == losers) players[0].destroy();
+			if (peer_ship >= 0 && players[peer_ship].get_team() == losers) players[peer_ship].destroy();
+		}
+		//Draw the frame and update the screen
+		render_queue.flush( screen );
+		sprites.next_frame();
+		if( profile && ++profile_frames % FPS == 0 )
+		{
+			render_queue.report( stdout );
+			sprites.report( stdout );
+		}
+		if( render_queue.present( screen ) == false )
 		{
 			return 1;    
 		}
@@ -3097,6 +8309,7 @@ int main( int argc, char* args[] )
         }
     }
     //Clean up any uneeded data
-    clean_up( tiles );
+	lockstep.close();
+    clean_up();
     return 0;    
 }